@@ -52,7 +52,8 @@ void ai_initialize_map(ai_context *ctx, memory_arena *mem, u32 width, u32 height
                                             );
 }
 
-void ai_update(memory_arena *mem, communication *comm) {
+// NOTE: Returns false once the connection is gone
+bool ai_update(memory_arena *mem, communication *comm) {
     ai_context *ctx = (ai_context *)mem->base;
 
     if (!ctx->is_init) {
@@ -82,68 +83,82 @@ void ai_update(memory_arena *mem, communication *comm) {
         comm_write(comm, &header, sizeof(header));
 
         ctx->current_state = ai_state_names::INITIALIZE;
-    } else if (ctx->current_state == ai_state_names::INITIALIZE) {
-        comm_server_header *header;
-        s32 len = comm_read(comm, ctx->read_buffer.base, ctx->read_buffer.max); 
-        u32 buf_it = sizeof(comm_shared_header);
-        if (len > 0) {
-            if (len - buf_it >= sizeof(*header)) {
-                header = (comm_server_header *)(ctx->read_buffer.base + buf_it);
-                if (header->name == comm_server_msg_names::INIT_MAP) {
-                    comm_server_init_map_body *init_map_body;
-                    buf_it += sizeof(*header);
-                    if (len - buf_it >= sizeof(*init_map_body)) {
-                        init_map_body = (comm_server_init_map_body *)(ctx->read_buffer.base + buf_it);
-                        ai_initialize_map(ctx, mem, init_map_body->width, init_map_body->height);
-                        ctx->current_state = ai_state_names::GAME;
+    } else {
+        for (u32 packet = 0; packet < comm_reads_per_frame; ++packet) {
+            s32 len = comm_read(comm, ctx->read_buffer.base, ctx->read_buffer.max);
+            if (len == 0)
+                break;
+            if (len < 0)
+                continue;
+
+            if (ctx->current_state == ai_state_names::INITIALIZE) {
+                comm_server_header *header;
+                u32 buf_it = sizeof(comm_shared_header);
+                if (len > 0) {
+                    if (len - buf_it >= sizeof(*header)) {
+                        header = (comm_server_header *)(ctx->read_buffer.base + buf_it);
+                        if (header->name == comm_server_msg_names::INIT_MAP) {
+                            comm_server_init_map_body *init_map_body;
+                            buf_it += sizeof(*header);
+                            if (len - buf_it >= sizeof(*init_map_body)) {
+                                init_map_body = (comm_server_init_map_body *)(ctx->read_buffer.base + buf_it);
+                                ai_initialize_map(ctx, mem, init_map_body->width, init_map_body->height);
+                                ctx->current_state = ai_state_names::GAME;
+                            }
+                        }
                     }
                 }
-            }
-        }
-    } else if (ctx->current_state == ai_state_names::GAME) {
-        comm_server_header *header;
-        s32 len = comm_read(comm, ctx->read_buffer.base, ctx->read_buffer.max);
-        u32 buf_it = sizeof(comm_shared_header);
-        if (len > 0) {
-            while (len - buf_it >= sizeof(*header)) {
-                header = (comm_server_header *)(ctx->read_buffer.base + buf_it);
-                buf_it += sizeof(*header);
-                if (header->name == comm_server_msg_names::DISCOVER) {
-                    comm_server_discover_body *discover_body;
-                    if (len - buf_it >= sizeof(*discover_body)) {
-                        discover_body = (comm_server_discover_body *)(ctx->read_buffer.base + buf_it);
-                        buf_it += sizeof(*discover_body);
-                        for (u32 i = 0; i < discover_body->num; ++i) {
-                            comm_server_discover_body_tile *tile = (comm_server_discover_body_tile *)(ctx->read_buffer.base + buf_it);
-                            buf_it += sizeof(*tile);
-                            ctx->map.terrain[tile->position.y * ctx->map.width + tile->position.x] =tile->name;
+            } else if (ctx->current_state == ai_state_names::GAME) {
+                comm_server_header *header;
+                u32 buf_it = sizeof(comm_shared_header);
+                if (len > 0) {
+                    while (len - buf_it >= sizeof(*header)) {
+                        header = (comm_server_header *)(ctx->read_buffer.base + buf_it);
+                        buf_it += sizeof(*header);
+                        if (header->name == comm_server_msg_names::DISCOVER) {
+                            comm_server_discover_body *discover_body;
+                            if (len - buf_it >= sizeof(*discover_body)) {
+                                discover_body = (comm_server_discover_body *)(ctx->read_buffer.base + buf_it);
+                                buf_it += sizeof(*discover_body);
+                                for (u32 i = 0; i < discover_body->num; ++i) {
+                                    comm_server_discover_body_tile *tile = (comm_server_discover_body_tile *)(ctx->read_buffer.base + buf_it);
+                                    buf_it += sizeof(*tile);
+                                    ctx->map.terrain[tile->position.y * ctx->map.width + tile->position.x] =tile->name;
+                                }
+                            }
+                        } else if (header->name == comm_server_msg_names::DISCOVER_TOWN) {
+                            comm_server_discover_town_body *discover_town_body;
+                            if (len - buf_it >= sizeof(*discover_town_body)) {
+                                discover_town_body = (comm_server_discover_town_body *)(ctx->read_buffer.base + buf_it);
+                                buf_it += sizeof(*discover_town_body);
+
+                                u32 id = ctx->map.towns.used++;
+                                ctx->map.towns.positions[id] = discover_town_body->position;
+                                ctx->map.towns.owners[id] = discover_town_body->owner;
+                                ctx->map.towns.server_ids[id] = discover_town_body->id;
+                            }
+                        } else if (header->name == comm_server_msg_names::PING) {
+                            comm_client_header client_header;
+                            client_header.name = comm_client_msg_names::PONG;
+                            comm_write(comm, &client_header, sizeof(client_header));
+                        } else if (header->name == comm_server_msg_names::YOUR_TURN) {
+                            comm_client_header client_header;
+                            client_header.name = comm_client_msg_names::END_TURN;
+                            comm_write(comm, &client_header, sizeof(client_header));
+                        } else if (header->name == comm_server_msg_names::ENTITY_DELTA) {
+                            // NOTE: The AI does not track units, so it never
+                            // acknowledges and always gets full states
+                            u32 size = comm_read_entity_delta(ctx->read_buffer.base + buf_it, len - buf_it, NULL, 0, NULL, NULL);
+                            if (size == 0) break;
+                            buf_it += size;
+                        } else if (header->name == comm_server_msg_names::ADD_UNIT) {
+                            comm_server_add_unit_body *add_unit_body;
+                            if (len - buf_it >= sizeof(*add_unit_body)) {
+                                add_unit_body = (comm_server_add_unit_body *)(ctx->read_buffer.base + buf_it);
+                                buf_it += sizeof(*add_unit_body);
+                            }
                         }
                     }
-                } else if (header->name == comm_server_msg_names::DISCOVER_TOWN) {
-                    comm_server_discover_town_body *discover_town_body;
-                    if (len - buf_it >= sizeof(*discover_town_body)) {
-                        discover_town_body = (comm_server_discover_town_body *)(ctx->read_buffer.base + buf_it);
-                        buf_it += sizeof(*discover_town_body);
-
-                        u32 id = ctx->map.towns.used++;
-                        ctx->map.towns.positions[id] = discover_town_body->position;
-                        ctx->map.towns.owners[id] = discover_town_body->owner;
-                        ctx->map.towns.server_ids[id] = discover_town_body->id;
-                    }
-                } else if (header->name == comm_server_msg_names::PING) {
-                    comm_client_header client_header;
-                    client_header.name = comm_client_msg_names::PONG;
-                    comm_write(comm, &client_header, sizeof(client_header));
-                } else if (header->name == comm_server_msg_names::YOUR_TURN) {
-                    comm_client_header client_header;
-                    client_header.name = comm_client_msg_names::END_TURN;
-                    comm_write(comm, &client_header, sizeof(client_header));
-                } else if (header->name == comm_server_msg_names::ADD_UNIT) {
-                    comm_server_add_unit_body *add_unit_body;
-                    if (len - buf_it >= sizeof(*add_unit_body)) {
-                        add_unit_body = (comm_server_add_unit_body *)(ctx->read_buffer.base + buf_it);
-                        buf_it += sizeof(*add_unit_body);
-                    }
                 }
             }
         }
@@ -151,5 +166,7 @@ void ai_update(memory_arena *mem, communication *comm) {
 
     if (!comm_flush(comm)) {
         sitrep(SITREP_INFO, "AI disconnected");
+        return false;
     }
+    return true;
 }
@@ -49,6 +49,12 @@ struct client_context {
     u32 my_server_id;
     bool my_turn;
 
+    struct {
+        bool enabled;
+        u32 latest_id;
+        comm_sync_snapshot history[COMM_SYNC_HISTORY];
+    } sync;
+
     struct {
         u32 width, height;
         terrain_names *terrain;
@@ -149,6 +155,18 @@ u32 get_neighbors_for_unit(client_context *ctx, unit *u, v2<u32> pt, memory_aren
     return rv;
 }
 
+// NOTE: Sends the steps gathered so far, if any
+void send_move_path(communication *comm, comm_client_move_path_body *body) {
+    if (body->num_steps == 0)
+        return;
+
+    comm_client_header header;
+    header.name = comm_client_msg_names::MOVE_PATH;
+    comm_write(comm, &header, sizeof(header));
+    comm_write(comm, body, sizeof(*body));
+    body->num_steps = 0;
+}
+
 u32 get_path_for_unit(client_context *ctx, unit *u, v2<u32> goal, memory_arena *mem, v2<u32> **paths) {
     auto frontier = priority_queue<v2<u32>>();
     frontier.push(u->position, 0);
@@ -634,269 +652,387 @@ CLIENT_INIT(client_init) {
     ctx->is_init = true;
 }
 
+int unit_server_id_compare(const void *a, const void *b) {
+    u32 id_a = (*(unit **)a)->server_id;
+    u32 id_b = (*(unit **)b)->server_id;
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+// NOTE: Makes the units in map.entities match state, which is sorted by id.
+// Units that stay keep their entity, so a selection survives the update.
+void apply_sync_state(client_context *ctx, memory_arena *mem, comm_sync_entity *state, u32 num) {
+    memory_arena temp = ctx->temp_mem;
+
+    u32 num_units = 0;
+    unit **units = (unit **)(temp.base + temp.used);
+    auto ent_iter = ctx->map.entities.first;
+    while (ent_iter) {
+        auto ent = ent_iter->payload;
+        if (ent->type == entity_types::UNIT) {
+            unit **slot = (unit **)memory_arena_use(&temp, sizeof(*slot));
+            *slot = (unit *)ent;
+            num_units++;
+        }
+        ent_iter = ent_iter->next;
+    }
+    qsort(units, num_units, sizeof(*units), unit_server_id_compare);
+
+    u32 s = 0;
+    for (u32 i = 0; i < num_units; ++i) {
+        unit *u = units[i];
+        while (s < num && state[s].id < u->server_id) {
+            ++s;
+        }
+        if (s < num && state[s].id == u->server_id) continue;
+
+        if (ctx->selected_entity == u) {
+            ctx->selected_entity = NULL;
+        }
+        if (u->loaded_by) {
+            u->loaded_by->slot = NULL;
+        }
+        if (u->slot) {
+            u->slot->loaded_by = NULL;
+        }
+        remove_entity_by_server_id(&ctx->map.entities, u->server_id);
+    }
+
+    u32 j = 0;
+    for (s = 0; s < num; ++s) {
+        comm_sync_entity *e = &state[s];
+        while (j < num_units && units[j]->server_id < e->id) {
+            ++j;
+        }
+
+        unit *u;
+        if (j < num_units && units[j]->server_id == e->id) {
+            u = units[j];
+        } else {
+            u = (unit *)memory_arena_use(mem, sizeof(*u));
+            ctx->map.entities.push_front(u);
+            u->type = entity_types::UNIT;
+            u->server_id = e->id;
+            u->slot = NULL;
+            u->loaded_by = NULL;
+        }
+        u->owner = e->owner;
+        u->name = e->name;
+        u->action_points = e->action_points;
+        u->position = e->position;
+    }
+}
+
 CLIENT_NET_UPDATE(client_net_update) {
     client_context *ctx = (client_context *)mem->base;
 
-    if (ctx->current_screen == client_screen_names::MAIN_MENU) {
-        comm_server_header *header;
-        s32 len = comm_read(comm, ctx->read_buffer.base, ctx->read_buffer.max); 
-        u32 buf_it = sizeof(comm_shared_header);
-        if (len > 0) {
-            while (len - buf_it >= sizeof(*header)) {
-                header = (comm_server_header *)(ctx->read_buffer.base + buf_it);
-                buf_it += sizeof(*header);
-                if (header->name == comm_server_msg_names::PING) {
-                    comm_client_header client_header;
-                    client_header.name = comm_client_msg_names::PONG;
-                    comm_write(comm, &client_header, sizeof(client_header));
-                } else if (header->name == comm_server_msg_names::STARTING) {
-                    ctx->current_screen = client_screen_names::INITIALIZE_GAME;
-                } else {
-                    sitrep(SITREP_WARNING, "(MAIN_MENU) Unhandled server message (%u)", header->name);
+    // NOTE: Drain every packet that is waiting, up to a budget so a flood
+    // can not stall the frame
+    for (u32 packet = 0; packet < comm_reads_per_frame; ++packet) {
+        s32 len = comm_read(comm, ctx->read_buffer.base, ctx->read_buffer.max);
+        if (len == 0)
+            break;
+        if (len < 0)
+            continue;
+
+        if (ctx->current_screen == client_screen_names::MAIN_MENU) {
+            comm_server_header *header;
+            u32 buf_it = sizeof(comm_shared_header);
+            if (len > 0) {
+                while (len - buf_it >= sizeof(*header)) {
+                    header = (comm_server_header *)(ctx->read_buffer.base + buf_it);
+                    buf_it += sizeof(*header);
+                    if (header->name == comm_server_msg_names::PING) {
+                        comm_client_header client_header;
+                        client_header.name = comm_client_msg_names::PONG;
+                        comm_write(comm, &client_header, sizeof(client_header));
+                    } else if (header->name == comm_server_msg_names::STARTING) {
+                        ctx->current_screen = client_screen_names::INITIALIZE_GAME;
+                    } else {
+                        sitrep(SITREP_WARNING, "(MAIN_MENU) Unhandled server message (%u)", header->name);
+                    }
                 }
             }
-        }
-    } else if (ctx->current_screen == client_screen_names::INITIALIZE_GAME) {
-        comm_server_header *header;
-        s32 len = comm_read(comm, ctx->read_buffer.base, ctx->read_buffer.max); 
-        u32 buf_it = sizeof(comm_shared_header);
-        if (len > 0) {
-            while (len - buf_it >= sizeof(*header)) {
-                header = (comm_server_header *)(ctx->read_buffer.base + buf_it);
-                buf_it += sizeof(*header);
-                if (header->name == comm_server_msg_names::INIT_MAP) {
-                    comm_server_init_map_body *init_map_body;
-                    if (len - buf_it >= sizeof(*init_map_body)) {
-                        init_map_body = (comm_server_init_map_body *)(ctx->read_buffer.base + buf_it);
-                        buf_it += sizeof(*init_map_body);
-                        ctx->my_server_id = init_map_body->your_id;
-                        ctx->clients.used = init_map_body->num_clients + 1;
-                        initialize_map(ctx, mem, init_map_body->width, init_map_body->height);
-                        ctx->current_screen = client_screen_names::GAME;
-                        sitrep(SITREP_DEBUG, "INIT_EVERYBODY");
-                        PlayMusicStream(ctx->background_music);
+        } else if (ctx->current_screen == client_screen_names::INITIALIZE_GAME) {
+            comm_server_header *header;
+            u32 buf_it = sizeof(comm_shared_header);
+            if (len > 0) {
+                while (len - buf_it >= sizeof(*header)) {
+                    header = (comm_server_header *)(ctx->read_buffer.base + buf_it);
+                    buf_it += sizeof(*header);
+                    if (header->name == comm_server_msg_names::INIT_MAP) {
+                        comm_server_init_map_body *init_map_body;
+                        if (len - buf_it >= sizeof(*init_map_body)) {
+                            init_map_body = (comm_server_init_map_body *)(ctx->read_buffer.base + buf_it);
+                            buf_it += sizeof(*init_map_body);
+                            ctx->my_server_id = init_map_body->your_id;
+                            ctx->clients.used = init_map_body->num_clients + 1;
+                            ctx->sync.enabled = (init_map_body->flags & COMM_INIT_MAP_DELTA_SYNC) != 0;
+                            ctx->sync.latest_id = COMM_SYNC_NO_BASELINE;
+                            initialize_map(ctx, mem, init_map_body->width, init_map_body->height);
+                            ctx->current_screen = client_screen_names::GAME;
+                            sitrep(SITREP_DEBUG, "INIT_EVERYBODY");
+                            PlayMusicStream(ctx->background_music);
+                        }
+                    } else if (header->name == comm_server_msg_names::PING) {
+                        comm_client_header client_header;
+                        client_header.name = comm_client_msg_names::PONG;
+                        comm_write(comm, &client_header, sizeof(client_header));
+                    } else if (header->name == comm_server_msg_names::YOUR_TURN) {
+                        sitrep(SITREP_DEBUG, "WHOOP");
+                        ctx->my_turn = true;
+                    } else {
+                        sitrep(SITREP_WARNING, "(INITIALIZE_GAME) Unhandled server message (%u)", header->name);
                     }
-                } else if (header->name == comm_server_msg_names::PING) {
-                    comm_client_header client_header;
-                    client_header.name = comm_client_msg_names::PONG;
-                    comm_write(comm, &client_header, sizeof(client_header));
-                } else if (header->name == comm_server_msg_names::YOUR_TURN) {
-                    sitrep(SITREP_DEBUG, "WHOOP");
-                    ctx->my_turn = true;
-                } else {
-                    sitrep(SITREP_WARNING, "(INITIALIZE_GAME) Unhandled server message (%u)", header->name);
                 }
             }
-        }
-    } else if (ctx->current_screen == client_screen_names::GAME) {
-
+        } else if (ctx->current_screen == client_screen_names::GAME) {
 
-        comm_server_header *header;
-        s32 len = comm_read(comm, ctx->read_buffer.base, ctx->read_buffer.max);
-        u32 buf_it = sizeof(comm_shared_header);
-        if (len > 0) {
-            while (len - buf_it >= sizeof(*header)) {
-                header = (comm_server_header *)(ctx->read_buffer.base + buf_it);
-                buf_it += sizeof(*header);
-                if (header->name == comm_server_msg_names::DISCOVER) {
-                    comm_server_discover_body *discover_body;
-                    if (len - buf_it >= sizeof(*discover_body)) {
-                        discover_body = (comm_server_discover_body *)(ctx->read_buffer.base + buf_it);
-                        buf_it += sizeof(*discover_body);
-                        for (u32 i = 0; i < discover_body->num; ++i) {
-                            comm_server_discover_body_tile *tile = (comm_server_discover_body_tile *)(ctx->read_buffer.base + buf_it);
-                            buf_it += sizeof(*tile);
-                            ctx->map.terrain[tile->position.y * ctx->map.width + tile->position.x] = tile->name;
-                        }
-                    }
-                    update_client_map(ctx);
-                } else if (header->name == comm_server_msg_names::DISCOVER_TOWN) {
-                    comm_server_discover_town_body *discover_town_body;
-                    if (len - buf_it >= sizeof(*discover_town_body)) {
-                        discover_town_body = (comm_server_discover_town_body *)(ctx->read_buffer.base + buf_it);
-                        buf_it += sizeof(*discover_town_body);
 
-                        bool found = false;
-                        auto ent_iter = ctx->map.entities.first;
-                        while (ent_iter) {
-                            auto ent = ent_iter->payload;
-                            if (ent->server_id == discover_town_body->id) {
-                                found = true;
+            comm_server_header *header;
+            u32 buf_it = sizeof(comm_shared_header);
+            if (len > 0) {
+                while (len - buf_it >= sizeof(*header)) {
+                    header = (comm_server_header *)(ctx->read_buffer.base + buf_it);
+                    buf_it += sizeof(*header);
+                    if (header->name == comm_server_msg_names::DISCOVER) {
+                        comm_server_discover_body *discover_body;
+                        if (len - buf_it >= sizeof(*discover_body)) {
+                            discover_body = (comm_server_discover_body *)(ctx->read_buffer.base + buf_it);
+                            buf_it += sizeof(*discover_body);
+                            for (u32 i = 0; i < discover_body->num; ++i) {
+                                comm_server_discover_body_tile *tile = (comm_server_discover_body_tile *)(ctx->read_buffer.base + buf_it);
+                                buf_it += sizeof(*tile);
+                                ctx->map.terrain[tile->position.y * ctx->map.width + tile->position.x] = tile->name;
                             }
-                            ent_iter = ent_iter->next;
                         }
+                        update_client_map(ctx);
+                    } else if (header->name == comm_server_msg_names::DISCOVER_TOWN) {
+                        comm_server_discover_town_body *discover_town_body;
+                        if (len - buf_it >= sizeof(*discover_town_body)) {
+                            discover_town_body = (comm_server_discover_town_body *)(ctx->read_buffer.base + buf_it);
+                            buf_it += sizeof(*discover_town_body);
+
+                            bool found = false;
+                            auto ent_iter = ctx->map.entities.first;
+                            while (ent_iter) {
+                                auto ent = ent_iter->payload;
+                                if (ent->server_id == discover_town_body->id) {
+                                    found = true;
+                                }
+                                ent_iter = ent_iter->next;
+                            }
 
-                        if (!found) {
-                            structure *town = (structure *)memory_arena_use(mem, sizeof(*town));
-                            ctx->map.entities.push_front(town);
-                            town->type = entity_types::STRUCTURE;
-                            town->position = discover_town_body->position;
-                            town->owner = discover_town_body->owner;
-                            town->server_id = discover_town_body->id;
-
-                            if (discover_town_body->owner == ctx->my_server_id) {
-                                s32 camera_x = (s32)discover_town_body->position.x;
-                                s32 camera_y = (s32)discover_town_body->position.y;
-                                u32 num_tiles_in_scr_width = GetScreenWidth() / 32;
-                                u32 num_tiles_in_scr_height = GetScreenHeight() / 32;
-                                u32 half_scr_width = num_tiles_in_scr_width >> 1;
-                                u32 half_scr_height = num_tiles_in_scr_height >> 1;
-                                camera_x -= half_scr_width;
-                                if (camera_x < 0)
-                                    camera_x = 0;
-                                camera_y -= half_scr_height;
-                                if (camera_y < 0)
-                                    camera_y = 0;
-                                ctx->camera.x = camera_x;
-                                ctx->camera.y = camera_y;
+                            if (!found) {
+                                structure *town = (structure *)memory_arena_use(mem, sizeof(*town));
+                                ctx->map.entities.push_front(town);
+                                town->type = entity_types::STRUCTURE;
+                                town->position = discover_town_body->position;
+                                town->owner = discover_town_body->owner;
+                                town->server_id = discover_town_body->id;
+
+                                if (discover_town_body->owner == ctx->my_server_id) {
+                                    s32 camera_x = (s32)discover_town_body->position.x;
+                                    s32 camera_y = (s32)discover_town_body->position.y;
+                                    u32 num_tiles_in_scr_width = GetScreenWidth() / 32;
+                                    u32 num_tiles_in_scr_height = GetScreenHeight() / 32;
+                                    u32 half_scr_width = num_tiles_in_scr_width >> 1;
+                                    u32 half_scr_height = num_tiles_in_scr_height >> 1;
+                                    camera_x -= half_scr_width;
+                                    if (camera_x < 0)
+                                        camera_x = 0;
+                                    camera_y -= half_scr_height;
+                                    if (camera_y < 0)
+                                        camera_y = 0;
+                                    ctx->camera.x = camera_x;
+                                    ctx->camera.y = camera_y;
+                                }
                             }
                         }
-                    }
-                } else if (header->name == comm_server_msg_names::YOUR_TURN) {
-                    ctx->my_turn = true;
-                } else if (header->name == comm_server_msg_names::SET_UNIT_ACTION_POINTS) {
-                    comm_server_set_unit_action_points_body *body;
-                    if (len - buf_it >= sizeof(*body)) {
-                        body = (comm_server_set_unit_action_points_body *)(ctx->read_buffer.base + buf_it);
-                        buf_it += sizeof(*body);
-                        auto ent_iter = ctx->map.entities.first;
-                        while (ent_iter) {
-                            auto ent = ent_iter->payload;
-                            if (ent->type == entity_types::UNIT) {
-                                auto u = (unit *)ent;
-                                if (u->server_id == body->unit_id) {
-                                    u->action_points = body->new_action_points;
+                    } else if (header->name == comm_server_msg_names::YOUR_TURN) {
+                        ctx->my_turn = true;
+                    } else if (header->name == comm_server_msg_names::SET_UNIT_ACTION_POINTS) {
+                        comm_server_set_unit_action_points_body *body;
+                        if (len - buf_it >= sizeof(*body)) {
+                            body = (comm_server_set_unit_action_points_body *)(ctx->read_buffer.base + buf_it);
+                            buf_it += sizeof(*body);
+                            auto ent_iter = ctx->map.entities.first;
+                            while (ent_iter) {
+                                auto ent = ent_iter->payload;
+                                if (ent->type == entity_types::UNIT) {
+                                    auto u = (unit *)ent;
+                                    if (u->server_id == body->unit_id) {
+                                        u->action_points = body->new_action_points;
+                                    }
                                 }
+                                ent_iter = ent_iter->next;
                             }
-                            ent_iter = ent_iter->next;
                         }
-                    }
-                } else if (header->name == comm_server_msg_names::CONSTRUCTION_SET) {
-                    comm_server_construction_set_body *construction_set_body;
-                    if (len - buf_it >= sizeof(*construction_set_body)) {
-                        construction_set_body = (comm_server_construction_set_body *)(ctx->read_buffer.base + buf_it);
-                        buf_it += sizeof(*construction_set_body);
-
-                        auto ent_iter = ctx->map.entities.first;
-                        while (ent_iter) {
-                            auto ent = ent_iter->payload;
-                            if (ent->type == entity_types::STRUCTURE) {
-                                auto town = (structure *)ent;
-                                if (town->server_id == construction_set_body->town_id) {
-                                    town->construction = construction_set_body->unit_name;
+                    } else if (header->name == comm_server_msg_names::CONSTRUCTION_SET) {
+                        comm_server_construction_set_body *construction_set_body;
+                        if (len - buf_it >= sizeof(*construction_set_body)) {
+                            construction_set_body = (comm_server_construction_set_body *)(ctx->read_buffer.base + buf_it);
+                            buf_it += sizeof(*construction_set_body);
+
+                            auto ent_iter = ctx->map.entities.first;
+                            while (ent_iter) {
+                                auto ent = ent_iter->payload;
+                                if (ent->type == entity_types::STRUCTURE) {
+                                    auto town = (structure *)ent;
+                                    if (town->server_id == construction_set_body->town_id) {
+                                        town->construction = construction_set_body->unit_name;
+                                    }
                                 }
+                                ent_iter = ent_iter->next;
+                            }
+                            if (ctx->selected_entity != NULL && ctx->selected_entity->server_id == construction_set_body->town_id) {
+                                ctx->gui.town.build_active = (s32)construction_set_body->unit_name;
                             }
-                            ent_iter = ent_iter->next;
-                        }
-                        if (ctx->selected_entity != NULL && ctx->selected_entity->server_id == construction_set_body->town_id) {
-                            ctx->gui.town.build_active = (s32)construction_set_body->unit_name;
                         }
-                    }
-                } else if (header->name == comm_server_msg_names::ADD_UNIT) {
-                    comm_server_add_unit_body *add_unit_body;
-                    if (len - buf_it >= sizeof(*add_unit_body)) {
-                        add_unit_body = (comm_server_add_unit_body *)(ctx->read_buffer.base + buf_it);
-                        buf_it += sizeof(*add_unit_body);
-
-                        entity *ent = find_entity_by_server_id(ctx->map.entities, add_unit_body->unit_id);
-                        if (ent) {
-                            if (ent->type == entity_types::UNIT) {
-                                unit *u = (unit *)ent;
+                    } else if (header->name == comm_server_msg_names::ADD_UNIT) {
+                        comm_server_add_unit_body *add_unit_body;
+                        if (len - buf_it >= sizeof(*add_unit_body)) {
+                            add_unit_body = (comm_server_add_unit_body *)(ctx->read_buffer.base + buf_it);
+                            buf_it += sizeof(*add_unit_body);
+
+                            entity *ent = find_entity_by_server_id(ctx->map.entities, add_unit_body->unit_id);
+                            if (ent) {
+                                if (ent->type == entity_types::UNIT) {
+                                    unit *u = (unit *)ent;
+                                    u->position = add_unit_body->position;
+                                    u->name = add_unit_body->unit_name;
+                                    u->action_points = add_unit_body->action_points;
+                                    u->owner = add_unit_body->owner;
+                                }
+                            } else {
+                                unit *u = (unit *)memory_arena_use(mem, sizeof(*u));
+                                ctx->map.entities.push_front(u);
+                                ctx->selected_entity = u;
+                                u->type = entity_types::UNIT;
+                                u->server_id = add_unit_body->unit_id;
                                 u->position = add_unit_body->position;
                                 u->name = add_unit_body->unit_name;
                                 u->action_points = add_unit_body->action_points;
                                 u->owner = add_unit_body->owner;
                             }
-                        } else {
-                            unit *u = (unit *)memory_arena_use(mem, sizeof(*u));
-                            ctx->map.entities.push_front(u);
-                            ctx->selected_entity = u;
-                            u->type = entity_types::UNIT;
-                            u->server_id = add_unit_body->unit_id;
-                            u->position = add_unit_body->position;
-                            u->name = add_unit_body->unit_name;
-                            u->action_points = add_unit_body->action_points;
-                            u->owner = add_unit_body->owner;
                         }
-                    }
-                } else if (header->name == comm_server_msg_names::REMOVE_UNIT) {
-                    comm_server_remove_unit_body *remove_unit_body;
-                    if (len - buf_it >= sizeof(*remove_unit_body)) {
-                        remove_unit_body = (comm_server_remove_unit_body *)(ctx->read_buffer.base + buf_it);
-                        buf_it += sizeof(*remove_unit_body);
-
-                        if (ctx->selected_entity &&
-                            ctx->selected_entity->server_id == remove_unit_body->unit_id) {
-                            ctx->selected_entity = NULL;
+                    } else if (header->name == comm_server_msg_names::REMOVE_UNIT) {
+                        comm_server_remove_unit_body *remove_unit_body;
+                        if (len - buf_it >= sizeof(*remove_unit_body)) {
+                            remove_unit_body = (comm_server_remove_unit_body *)(ctx->read_buffer.base + buf_it);
+                            buf_it += sizeof(*remove_unit_body);
+
+                            if (ctx->selected_entity &&
+                                ctx->selected_entity->server_id == remove_unit_body->unit_id) {
+                                ctx->selected_entity = NULL;
+                            }
+                            remove_entity_by_server_id(&ctx->map.entities, remove_unit_body->unit_id);
                         }
-                        remove_entity_by_server_id(&ctx->map.entities, remove_unit_body->unit_id);
-                    }
-                } else if (header->name == comm_server_msg_names::MOVE_UNIT) {
-                    comm_server_move_unit_body *move_unit_body;
-                    if (len - buf_it >= sizeof(*move_unit_body)) {
-                        move_unit_body = (comm_server_move_unit_body *)(ctx->read_buffer.base + buf_it);
-                        buf_it += sizeof(*move_unit_body);
-
-                        auto ent_iter = ctx->map.entities.first;
-                        while (ent_iter) {
-                            auto ent = ent_iter->payload;
-                            if (ent->type == entity_types::UNIT) {
-                                auto u = (unit *)ent;
-                                if (u->server_id == move_unit_body->unit_id) {
-                                    u->position = move_unit_body->new_position;
-                                    u->action_points = move_unit_body->action_points_left;
-                                    break;
+                    } else if (header->name == comm_server_msg_names::MOVE_UNIT) {
+                        comm_server_move_unit_body *move_unit_body;
+                        if (len - buf_it >= sizeof(*move_unit_body)) {
+                            move_unit_body = (comm_server_move_unit_body *)(ctx->read_buffer.base + buf_it);
+                            buf_it += sizeof(*move_unit_body);
+
+                            auto ent_iter = ctx->map.entities.first;
+                            while (ent_iter) {
+                                auto ent = ent_iter->payload;
+                                if (ent->type == entity_types::UNIT) {
+                                    auto u = (unit *)ent;
+                                    if (u->server_id == move_unit_body->unit_id) {
+                                        u->position = move_unit_body->new_position;
+                                        u->action_points = move_unit_body->action_points_left;
+                                        break;
+                                    }
                                 }
-                            }
 
-                            ent_iter = ent_iter->next;
+                                ent_iter = ent_iter->next;
+                            }
                         }
-                    }
-                } else if (header->name == comm_server_msg_names::LOAD_UNIT) {
-                    comm_server_load_unit_body *load_unit_body;
-                    if (len - buf_it >= sizeof(*load_unit_body)) {
-                        load_unit_body = (comm_server_load_unit_body *)(ctx->read_buffer.base + buf_it);
-                        buf_it += sizeof(*load_unit_body);
-
-                        auto ent_that_loads = find_entity_by_server_id(ctx->map.entities, load_unit_body->unit_that_loads);
-                        auto ent_to_load = find_entity_by_server_id(ctx->map.entities, load_unit_body->unit_to_load);
-                        if (ent_that_loads && ent_to_load) {
-                            if (ent_that_loads->type == entity_types::UNIT &&
-                                ent_to_load->type == entity_types::UNIT) {
-                                auto u_to_load = (unit *)ent_to_load;
-                                auto u_that_loads = (unit *)ent_that_loads;
-                                u_to_load->action_points = load_unit_body->action_points_left;
-                                u_to_load->position = load_unit_body->new_position;
-                                u_that_loads->slot = u_to_load;
-                                u_to_load->loaded_by = u_that_loads;
+                    } else if (header->name == comm_server_msg_names::LOAD_UNIT) {
+                        comm_server_load_unit_body *load_unit_body;
+                        if (len - buf_it >= sizeof(*load_unit_body)) {
+                            load_unit_body = (comm_server_load_unit_body *)(ctx->read_buffer.base + buf_it);
+                            buf_it += sizeof(*load_unit_body);
+
+                            auto ent_that_loads = find_entity_by_server_id(ctx->map.entities, load_unit_body->unit_that_loads);
+                            auto ent_to_load = find_entity_by_server_id(ctx->map.entities, load_unit_body->unit_to_load);
+                            if (ent_that_loads && ent_to_load) {
+                                if (ent_that_loads->type == entity_types::UNIT &&
+                                    ent_to_load->type == entity_types::UNIT) {
+                                    auto u_to_load = (unit *)ent_to_load;
+                                    auto u_that_loads = (unit *)ent_that_loads;
+                                    u_to_load->action_points = load_unit_body->action_points_left;
+                                    u_to_load->position = load_unit_body->new_position;
+                                    u_that_loads->slot = u_to_load;
+                                    u_to_load->loaded_by = u_that_loads;
+                                }
                             }
                         }
-                    }
-                } else if (header->name == comm_server_msg_names::UNLOAD_UNIT) {
-                    comm_server_unload_unit_body *unload_unit_body;
-                    if (len - buf_it >= sizeof(*unload_unit_body)) {
-                        unload_unit_body = (comm_server_unload_unit_body *)(ctx->read_buffer.base + buf_it);
-                        buf_it += sizeof(*unload_unit_body);
-
-                        auto ent = find_entity_by_server_id(ctx->map.entities, unload_unit_body->unit_id);
-                        if (ent) {
-                            if (ent->type == entity_types::UNIT) {
-                                auto u = (unit *)ent;
-                                u->action_points = unload_unit_body->action_points_left;
-                                u->position = unload_unit_body->new_position;
-                                if (u->loaded_by) {
-                                    u->loaded_by->slot = NULL;
-                                    u->loaded_by = NULL;
+                    } else if (header->name == comm_server_msg_names::UNLOAD_UNIT) {
+                        comm_server_unload_unit_body *unload_unit_body;
+                        if (len - buf_it >= sizeof(*unload_unit_body)) {
+                            unload_unit_body = (comm_server_unload_unit_body *)(ctx->read_buffer.base + buf_it);
+                            buf_it += sizeof(*unload_unit_body);
+
+                            auto ent = find_entity_by_server_id(ctx->map.entities, unload_unit_body->unit_id);
+                            if (ent) {
+                                if (ent->type == entity_types::UNIT) {
+                                    auto u = (unit *)ent;
+                                    u->action_points = unload_unit_body->action_points_left;
+                                    u->position = unload_unit_body->new_position;
+                                    if (u->loaded_by) {
+                                        u->loaded_by->slot = NULL;
+                                        u->loaded_by = NULL;
+                                    }
                                 }
                             }
                         }
+                    } else if (header->name == comm_server_msg_names::ENTITY_DELTA) {
+                        comm_server_entity_delta_body *body = (comm_server_entity_delta_body *)(ctx->read_buffer.base + buf_it);
+                        u32 size = comm_read_entity_delta(ctx->read_buffer.base + buf_it, len - buf_it, NULL, 0, NULL, NULL);
+                        if (size == 0) break;
+
+                        // NOTE: Retransmitted and reordered states are older
+                        // than what we have, and a baseline we no longer hold
+                        // is simply never acknowledged
+                        comm_sync_snapshot *baseline = NULL;
+                        if (body->baseline_id != COMM_SYNC_NO_BASELINE) {
+                            baseline = &ctx->sync.history[body->baseline_id % COMM_SYNC_HISTORY];
+                            if (baseline->id != body->baseline_id)
+                                baseline = NULL;
+                        }
+
+                        if (body->snapshot_id > ctx->sync.latest_id &&
+                            (baseline || body->baseline_id == COMM_SYNC_NO_BASELINE)) {
+                            memory_arena temp = ctx->temp_mem;
+                            u32 num_baseline = baseline ? baseline->num : 0;
+                            comm_sync_entity *state = (comm_sync_entity *)memory_arena_use(&temp,
+                                                            sizeof(*state) * (num_baseline + body->num_changed));
+                            u32 num;
+                            comm_read_entity_delta(ctx->read_buffer.base + buf_it, len - buf_it,
+                                                   baseline ? baseline->entities : NULL, num_baseline,
+                                                   state, &num);
+
+                            comm_sync_store(&ctx->sync.history[body->snapshot_id % COMM_SYNC_HISTORY],
+                                            body->snapshot_id, state, num);
+                            ctx->sync.latest_id = body->snapshot_id;
+                            apply_sync_state(ctx, mem, state, num);
+
+                            comm_client_header client_header;
+                            client_header.name = comm_client_msg_names::SYNC_ACK;
+                            comm_write(comm, &client_header, sizeof(client_header));
+                            comm_client_sync_ack_body ack;
+                            ack.snapshot_id = body->snapshot_id;
+                            comm_write(comm, &ack, sizeof(ack));
+                        }
+                        buf_it += size;
+                    } else if (header->name == comm_server_msg_names::PING) {
+                        comm_client_header client_header;
+                        client_header.name = comm_client_msg_names::PONG;
+                        comm_write(comm, &client_header, sizeof(client_header));
+                    } else {
+                        sitrep(SITREP_WARNING, "(GAME) Unhandled server message (%u)", header->name);
                     }
-                } else if (header->name == comm_server_msg_names::PING) {
-                    comm_client_header client_header;
-                    client_header.name = comm_client_msg_names::PONG;
-                    comm_write(comm, &client_header, sizeof(client_header));
-                } else {
-                    sitrep(SITREP_WARNING, "(GAME) Unhandled server message (%u)", header->name);
                 }
             }
         }
@@ -965,6 +1101,9 @@ CLIENT_UPDATE_AND_RENDER(client_update_and_render) {
                             v2<u32> *paths;
                             u32 num_paths = get_path_for_unit(ctx, u, mouse_tile_pos, &ctx->temp_mem, &paths);
 
+                            // NOTE: Plain steps in a row go out as one MOVE_PATH
+                            comm_client_move_path_body move_path = {0};
+                            move_path.unit_id = u->server_id;
                             for (u32 i = 0; i < num_paths; ++i) {
                                 u32 num_entities;
                                 entity **entities = find_entities_at_position(ctx->map.entities, paths[i], &ctx->temp_mem, &num_entities);
@@ -974,6 +1113,7 @@ CLIENT_UPDATE_AND_RENDER(client_update_and_render) {
 
                                 comm_client_header header;
                                 if (u->loaded_by != NULL) {
+                                    send_move_path(comm, &move_path);
                                     header.name = comm_client_msg_names::UNLOAD_UNIT;
                                     comm_write(comm, &header, sizeof(header));
                                     comm_client_unload_unit_body body;
@@ -995,6 +1135,7 @@ CLIENT_UPDATE_AND_RENDER(client_update_and_render) {
                                     }
 
                                     if (u_that_loads != NULL) {
+                                        send_move_path(comm, &move_path);
                                         header.name = comm_client_msg_names::LOAD_UNIT;
                                         comm_write(comm, &header, sizeof(header));
                                         comm_client_load_unit_body body;
@@ -1002,17 +1143,15 @@ CLIENT_UPDATE_AND_RENDER(client_update_and_render) {
                                         body.unit_to_load = u->server_id;
                                         comm_write(comm, &body, sizeof(body));
                                     } else {
-                                        header.name = comm_client_msg_names::MOVE_UNIT;
-                                        comm_write(comm, &header, sizeof(header));
-                                        comm_client_move_unit_body body;
-                                        body.unit_id = u->server_id;
-                                        body.delta = d;
-                                        comm_write(comm, &body, sizeof(body));
+                                        if (move_path.num_steps == COMM_MOVE_PATH_MAX_STEPS)
+                                            send_move_path(comm, &move_path);
+                                        move_path.steps[move_path.num_steps++] = comm_path_direction(d);
                                     }
                                 }
 
                                 prev_path = paths[i];
                             }
+                            send_move_path(comm, &move_path);
                         }
                     }
                 } else if (IsMouseButtonPressed(MOUSE_RIGHT_BUTTON)) {
@@ -0,0 +1,294 @@
+#define COMM_CAPTURE_MAGIC 0x50414D4D
+#define COMM_CAPTURE_VERSION 1
+
+enum comm_capture_directions {
+    COMM_CAPTURE_SENT = 0,
+    COMM_CAPTURE_RECEIVED
+};
+
+struct comm_capture_file_header {
+    u32 magic;
+    u32 version;
+};
+
+struct comm_capture_record {
+    u32 time;
+    u16 connection;
+    u8 direction;
+    u8 pad;
+    u32 size;
+};
+
+struct comm_capture {
+    FILE *file;
+    u32 start_time;
+    u32 num_records;
+};
+
+struct comm_capture_link {
+    comm_capture *capture;
+    u16 connection;
+
+    uintptr_t inner_handle;
+    comm_send_t *inner_send;
+    comm_recv_t *inner_recv;
+};
+
+bool comm_capture_open(comm_capture *capture, char *path) {
+    capture->file = fopen(path, "wb");
+    if (!capture->file) {
+        sitrep(SITREP_ERROR, "Could not open capture file '%s'", path);
+        return false;
+    }
+
+    comm_capture_file_header header;
+    header.magic = COMM_CAPTURE_MAGIC;
+    header.version = COMM_CAPTURE_VERSION;
+    fwrite(&header, sizeof(header), 1, capture->file);
+
+    capture->start_time = time_get_now_in_ms();
+    capture->num_records = 0;
+    return true;
+}
+
+void comm_capture_close(comm_capture *capture) {
+    if (capture->file) {
+        fclose(capture->file);
+        capture->file = NULL;
+    }
+}
+
+void comm_capture_record_packet(comm_capture_link *link, comm_capture_directions direction, void *data, u32 size) {
+    comm_capture *capture = link->capture;
+    if (!capture->file)
+        return;
+
+    comm_capture_record record;
+    record.time = time_get_now_in_ms() - capture->start_time;
+    record.connection = link->connection;
+    record.direction = (u8)direction;
+    record.pad = 0;
+    record.size = size;
+
+    // NOTE: Matches on different threads may share one capture
+#ifndef _WIN32
+    flockfile(capture->file);
+#endif
+    fwrite(&record, sizeof(record), 1, capture->file);
+    fwrite(data, size, 1, capture->file);
+    capture->num_records++;
+#ifndef _WIN32
+    funlockfile(capture->file);
+#endif
+}
+
+COMM_SEND(comm_capture_send) {
+    comm_capture_link *link = (comm_capture_link *)comm.handle;
+    comm_capture_record_packet(link, COMM_CAPTURE_SENT, data, size);
+
+    communication inner = {0};
+    inner.handle = link->inner_handle;
+    inner.send = link->inner_send;
+    inner.recv = link->inner_recv;
+    inner.send(inner, data, size);
+}
+
+COMM_RECV(comm_capture_recv) {
+    comm_capture_link *link = (comm_capture_link *)comm.handle;
+
+    communication inner = {0};
+    inner.handle = link->inner_handle;
+    inner.send = link->inner_send;
+    inner.recv = link->inner_recv;
+    u32 rv = inner.recv(inner, buffer, size);
+
+    if (rv > 0 && rv != COMM_DROPPED) {
+        comm_capture_record_packet(link, COMM_CAPTURE_RECEIVED, buffer, rv);
+    }
+    return rv;
+}
+
+void comm_capture_wrap(communication *comm, comm_capture_link *link, comm_capture *capture, u16 connection) {
+    link->capture = capture;
+    link->connection = connection;
+    link->inner_handle = comm->handle;
+    link->inner_send = comm->send;
+    link->inner_recv = comm->recv;
+
+    comm->handle = (uintptr_t)link;
+    comm->send = &comm_capture_send;
+    comm->recv = &comm_capture_recv;
+}
+
+// NOTE: Replay feeds the RECEIVED half of a capture back through recv, one
+// cursor per connection. Sends are counted and dropped.
+enum class comm_replay_speeds {
+    ORIGINAL,
+    MAXIMUM
+};
+
+struct comm_replay {
+    u8 *data;
+    u32 size;
+
+    comm_capture_record **records;
+    u32 *next_for_connection;
+    u32 num_records;
+
+    u32 *cursors;
+    u32 num_connections;
+
+    comm_replay_speeds speed;
+    u32 start_time;
+    u32 now;
+};
+
+struct comm_replay_stats {
+    u32 packets, bytes, sent_packets, sent_bytes;
+};
+
+// NOTE: Stats are per link, the links of different matches are read and
+// written on different threads
+struct comm_replay_link {
+    comm_replay *replay;
+    u16 connection;
+    comm_replay_stats stats;
+};
+
+bool comm_replay_open(comm_replay *replay, char *path, comm_replay_speeds speed, memory_arena *mem) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        sitrep(SITREP_ERROR, "Could not open capture file '%s'", path);
+        return false;
+    }
+
+    fseek(file, 0, SEEK_END);
+    replay->size = (u32)ftell(file);
+    fseek(file, 0, SEEK_SET);
+    replay->data = memory_arena_use(mem, replay->size);
+    u32 read = fread(replay->data, 1, replay->size, file);
+    fclose(file);
+
+    comm_capture_file_header *header = (comm_capture_file_header *)replay->data;
+    if (read != replay->size || replay->size < sizeof(*header) ||
+        header->magic != COMM_CAPTURE_MAGIC || header->version != COMM_CAPTURE_VERSION) {
+        sitrep(SITREP_ERROR, "'%s' is not a capture file", path);
+        return false;
+    }
+
+    u32 it = sizeof(*header);
+    replay->num_records = 0;
+    replay->num_connections = 0;
+    while (it + sizeof(comm_capture_record) <= replay->size) {
+        comm_capture_record *record = (comm_capture_record *)(replay->data + it);
+        if (it + sizeof(*record) + record->size > replay->size)
+            break;
+        if (record->direction == COMM_CAPTURE_RECEIVED) {
+            replay->num_records++;
+            replay->num_connections = MAX(replay->num_connections, (u32)record->connection + 1);
+        }
+        it += sizeof(*record) + record->size;
+    }
+
+    replay->records = (comm_capture_record **)memory_arena_use(mem, sizeof(*replay->records) * replay->num_records);
+    replay->next_for_connection = (u32 *)memory_arena_use(mem, sizeof(*replay->next_for_connection) * replay->num_records);
+    replay->cursors = (u32 *)memory_arena_use(mem, sizeof(*replay->cursors) * replay->num_connections);
+    u32 *lasts = (u32 *)memory_arena_use(mem, sizeof(*lasts) * replay->num_connections);
+    for (u32 i = 0; i < replay->num_connections; ++i) {
+        replay->cursors[i] = replay->num_records;
+        lasts[i] = replay->num_records;
+    }
+
+    it = sizeof(*header);
+    u32 num = 0;
+    while (num < replay->num_records) {
+        comm_capture_record *record = (comm_capture_record *)(replay->data + it);
+        it += sizeof(*record) + record->size;
+        if (record->direction != COMM_CAPTURE_RECEIVED)
+            continue;
+
+        replay->records[num] = record;
+        replay->next_for_connection[num] = replay->num_records;
+        if (lasts[record->connection] == replay->num_records)
+            replay->cursors[record->connection] = num;
+        else
+            replay->next_for_connection[lasts[record->connection]] = num;
+        lasts[record->connection] = num;
+        ++num;
+    }
+
+    replay->speed = speed;
+    replay->start_time = time_get_now_in_ms();
+    replay->now = 0;
+    return true;
+}
+
+// NOTE: Call once per frame. At ORIGINAL speed the replay clock follows
+// the wall clock, at MAXIMUM it jumps straight to the next packet.
+void comm_replay_step(comm_replay *replay) {
+    if (replay->speed == comm_replay_speeds::ORIGINAL) {
+        replay->now = time_get_now_in_ms() - replay->start_time;
+    } else {
+        u32 earliest = 0xFFFFFFFF;
+        for (u32 i = 0; i < replay->num_connections; ++i) {
+            u32 cursor = replay->cursors[i];
+            if (cursor < replay->num_records)
+                earliest = MIN(earliest, replay->records[cursor]->time);
+        }
+        if (earliest != 0xFFFFFFFF && earliest > replay->now)
+            replay->now = earliest;
+    }
+}
+
+bool comm_replay_done(comm_replay *replay) {
+    for (u32 i = 0; i < replay->num_connections; ++i) {
+        if (replay->cursors[i] < replay->num_records)
+            return false;
+    }
+    return true;
+}
+
+COMM_SEND(comm_replay_send) {
+    comm_replay_link *link = (comm_replay_link *)comm.handle;
+    link->stats.sent_packets++;
+    link->stats.sent_bytes += size;
+}
+
+COMM_RECV(comm_replay_recv) {
+    comm_replay_link *link = (comm_replay_link *)comm.handle;
+    comm_replay *replay = link->replay;
+    if (link->connection >= replay->num_connections)
+        return 0;
+
+    u32 cursor = replay->cursors[link->connection];
+    if (cursor >= replay->num_records)
+        return 0;
+
+    comm_capture_record *record = replay->records[cursor];
+    if (record->time > replay->now)
+        return 0;
+
+    replay->cursors[link->connection] = replay->next_for_connection[cursor];
+    if (record->size > size)
+        return COMM_DROPPED;
+
+    memcpy(buffer, record + 1, record->size);
+    link->stats.packets++;
+    link->stats.bytes += record->size;
+    return record->size;
+}
+
+void comm_replay_init(communication *comm, comm_replay_link *link, comm_replay *replay, u16 connection, memory_arena buffer) {
+    link->replay = replay;
+    link->connection = connection;
+    memset(&link->stats, 0, sizeof(link->stats));
+
+    comm->handle = (uintptr_t)link;
+    comm->send = &comm_replay_send;
+    comm->recv = &comm_replay_recv;
+
+    comm->buffer = buffer;
+    memory_arena_use(&comm->buffer, sizeof(comm_shared_header));
+    comm->local_sequence_number = 0;
+    comm->remote_sequence_number = 0;
+}
@@ -17,7 +17,7 @@ COMM_RECV(comm_client_memory_recv) {
 		amount_to_read = packet_size;
 	} else if (packet_size > size) {
 		mem->add_to_read_it(packet_size);
-		return 0;
+		return COMM_DROPPED;
 	} else {
 		amount_to_read = size;
 	}
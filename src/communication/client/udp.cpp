@@ -0,0 +1,69 @@
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+
+COMM_SEND(comm_client_udp_send) {
+    s32 fd = (s32)comm.handle;
+    ssize_t rv = send(fd, data, size, MSG_DONTWAIT);
+    if (rv < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        sitrep(SITREP_WARNING, "Udp send failed (%s)", strerror(errno));
+    }
+}
+
+COMM_RECV(comm_client_udp_recv) {
+    s32 fd = (s32)comm.handle;
+    ssize_t rv = recv(fd, buffer, size, MSG_DONTWAIT | MSG_TRUNC);
+    if (rv < 0) {
+        return 0;
+    }
+    if (rv == 0 || (u32)rv > size) {
+        return COMM_DROPPED;
+    }
+    return (u32)rv;
+}
+
+bool comm_client_udp_init(communication *comm, char *host, char *port, memory_arena buffer) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        sitrep(SITREP_ERROR, "Could not resolve '%s:%s'", host, port);
+        return false;
+    }
+
+    s32 fd = socket(res->ai_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        sitrep(SITREP_ERROR, "Could not connect to '%s:%s' (%s)", host, port, strerror(errno));
+        freeaddrinfo(res);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    freeaddrinfo(res);
+
+    s32 rcvbuf = MB(4);
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    comm->handle = (uintptr_t)fd;
+    comm->send = &comm_client_udp_send;
+    comm->recv = &comm_client_udp_recv;
+
+    comm->buffer = buffer;
+    memory_arena_use(&comm->buffer, sizeof(comm_shared_header));
+    comm->local_sequence_number = 0;
+    comm->remote_sequence_number = 0;
+
+    // NOTE: The server only takes a new address that opens with CONNECT.
+    // It goes out again until acknowledged like any packet.
+    comm_client_header header;
+    header.name = comm_client_msg_names::CONNECT;
+    comm_write(comm, &header, sizeof(header));
+    comm_flush(comm);
+
+    return true;
+}
+#endif
@@ -0,0 +1,50 @@
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define COMM_CLIENT_UNIX_SLOT_SIZE MB(1)
+
+bool comm_client_unix_init(communication *comm, comm_unix_socket *sock, char *path, memory_arena buffer) {
+    s32 fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        sitrep(SITREP_ERROR, "Could not create unix socket (%s)", strerror(errno));
+        return false;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        sitrep(SITREP_ERROR, "Could not connect to '%s' (%s)", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    s32 sndbuf = MB(4);
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+    sock->fd = fd;
+    sock->batch_slot_size = COMM_CLIENT_UNIX_SLOT_SIZE;
+    sock->batch_used = sock->batch_it = 0;
+
+    // NOTE: The receive batch lives at the tail of the send buffer, so the
+    // header reserved at its base stays where comm_flush expects it
+    buffer.max -= sock->batch_slot_size * COMM_UNIX_BATCH_SIZE;
+    sock->batch = buffer.base + buffer.max;
+
+    comm->handle = (uintptr_t)sock;
+    comm->send = &comm_unix_send;
+    comm->recv = &comm_unix_recv;
+
+    comm->buffer = buffer;
+    memory_arena_use(&comm->buffer, sizeof(comm_shared_header));
+    comm->local_sequence_number = 0;
+    comm->remote_sequence_number = 0;
+
+    return true;
+}
+#endif
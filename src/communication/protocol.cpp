@@ -1,10 +1,29 @@
 #define PROTOCOL_VERSION 0 
 
+// NOTE: How many packets a client or AI drains per frame before it gives
+// the rest of the frame a turn, unless set with --packets-per-frame
+#define COMM_DEFAULT_READS_PER_FRAME 32
+
+u32 comm_reads_per_frame = COMM_DEFAULT_READS_PER_FRAME;
+
+// NOTE: An unacknowledged packet goes out again after this long
+#define COMM_RETRANSMIT_MS 1000
+#define COMM_MAX_RETRIES 5
+
 struct comm_memory_pipe {
     ring_buffer<u8> *in;
     ring_buffer<u8> *out;
 };
 
+#define COMM_UNIX_BATCH_SIZE 16
+
+struct comm_unix_socket {
+    s32 fd;
+    u8 *batch;
+    u32 batch_sizes[COMM_UNIX_BATCH_SIZE];
+    u32 batch_slot_size, batch_used, batch_it;
+};
+
 struct comm_sent_packet {
     u32 when;
     u32 sequence;
@@ -19,6 +38,11 @@ typedef COMM_SEND(comm_send_t);
 #define COMM_RECV(_n) u32 _n(communication comm, void *buffer, u32 size)
 typedef COMM_RECV(comm_recv_t);
 
+// NOTE: What recv and comm_read return for a packet they took and threw
+// away, more may be waiting. 0 means there is nothing left to read. As an
+// s32 it is -1.
+#define COMM_DROPPED 0xFFFFFFFF
+
 struct communication {
     uintptr_t handle;
     comm_send_t *send;
@@ -46,12 +70,12 @@ bool comm_flush(communication *comm) {
         comm_sent_packet *packet = comm->sent_packets.get(i);
         u32 ms = now - packet->when;
 
-        if (ms >= 1000) {
+        if (ms >= COMM_RETRANSMIT_MS) {
             comm->send(*comm, packet->mem.base, packet->mem.used);       
             comm->last_sent_time = now;
             packet->when = now;
             packet->retries++;
-            if (packet->retries >= 5) {
+            if (packet->retries >= COMM_MAX_RETRIES) {
                 u32 len = comm->sent_packets.length();
                 for (u32 i = 0; i < len; ++i) {
                     packet = comm->sent_packets.get(i);
@@ -74,7 +98,9 @@ bool comm_flush(communication *comm) {
     u32 magic = PROTOCOL_VERSION;
     magic |= (0b101 << 29);
     header->magic = magic;
-    header->sequence = comm->local_sequence_number++;
+    // NOTE: Sequences start at 1. A peer that has read nothing yet acks 0,
+    // which must not acknowledge the first packet.
+    header->sequence = ++comm->local_sequence_number;
     header->ack = comm->remote_sequence_number;
 
     header->ack_bitfield = 0;
@@ -111,6 +137,19 @@ bool comm_flush(communication *comm) {
     return true;
 }
 
+// NOTE: When comm_flush next has something to send again. False while
+// every packet is acknowledged.
+bool comm_retransmit_at(communication *comm, u32 *when) {
+    bool rv = false;
+    for (u32 i = 0; i < comm->sent_packets.length(); ++i) {
+        u32 at = comm->sent_packets.get(i)->when + COMM_RETRANSMIT_MS;
+        if (!rv || (s32)(at - *when) < 0)
+            *when = at;
+        rv = true;
+    }
+    return rv;
+}
+
 void comm_write(communication *comm, void *data, u32 size) {
     u8 *ptr = memory_arena_use(&comm->buffer, size);
     memcpy(ptr, data, size);
@@ -120,21 +159,21 @@ u32 comm_read(communication *comm, void *buffer, u32 size) {
     u8 *buf = (u8 *)buffer;
     comm_shared_header *header;
 
-    s32 len = comm->recv(*comm, buffer, size);
+    u32 len = comm->recv(*comm, buffer, size);
 
-    if (len < 0) {
+    if (len == 0) {
         return 0;
     }
 
-    if (len < sizeof(header)) {
-        return 0;
+    if (len == COMM_DROPPED || len < sizeof(*header)) {
+        return COMM_DROPPED;
     }
 
     header = (comm_shared_header *)buffer;
     
     u32 version = header->magic ^ (0b101 << 29);
     if (version != PROTOCOL_VERSION) {
-        return 0;
+        return COMM_DROPPED;
     }
 
     if (header->sequence > comm->remote_sequence_number) {
@@ -184,7 +223,8 @@ enum class comm_server_msg_names {
     SET_UNIT_ACTION_POINTS,
     LOAD_UNIT,
     UNLOAD_UNIT,
-    STARTING
+    STARTING,
+    ENTITY_DELTA
 };
 
 enum class comm_client_msg_names {
@@ -197,7 +237,9 @@ enum class comm_client_msg_names {
     SET_CONSTRUCTION,
     MOVE_UNIT,
     LOAD_UNIT,
-    UNLOAD_UNIT
+    UNLOAD_UNIT,
+    SYNC_ACK,
+    MOVE_PATH
 };
 
 struct comm_client_header {
@@ -208,10 +250,15 @@ struct comm_server_header {
     comm_server_msg_names name;
 };
 
+enum comm_init_map_flags {
+    COMM_INIT_MAP_DELTA_SYNC = 1 << 0
+};
+
 struct comm_server_init_map_body {
     u32 your_id;
     u32 num_clients;
     u32 width, height;
+    u32 flags;
 };
 
 struct comm_server_discover_body {
@@ -257,6 +304,32 @@ struct comm_client_move_unit_body {
     v2<s32> delta;
 };
 
+#define COMM_MOVE_PATH_MAX_STEPS 16
+#define COMM_PATH_NUM_DIRECTIONS 8
+#define COMM_PATH_NO_DIRECTION 0xFF
+
+// NOTE: Clockwise from up, a step of a path is an index into these
+v2<s32> comm_path_directions[COMM_PATH_NUM_DIRECTIONS] = {
+    {0, -1}, {1, -1}, {1, 0}, {1, 1}, {0, 1}, {-1, 1}, {-1, 0}, {-1, -1}
+};
+
+u8 comm_path_direction(v2<s32> delta) {
+    for (u8 i = 0; i < COMM_PATH_NUM_DIRECTIONS; ++i) {
+        if (comm_path_directions[i].x == delta.x && comm_path_directions[i].y == delta.y)
+            return i;
+    }
+    return COMM_PATH_NO_DIRECTION;
+}
+
+// NOTE: A whole walk in one message. The server takes steps until one is
+// blocked or the unit runs out of action points and answers with where
+// the unit ended up.
+struct comm_client_move_path_body {
+    u32 unit_id;
+    u32 num_steps;
+    u8 steps[COMM_MOVE_PATH_MAX_STEPS];
+};
+
 struct comm_server_move_unit_body {
     u32 unit_id;
     u32 action_points_left;
@@ -296,3 +369,244 @@ struct comm_server_unload_unit_body {
     u32 action_points_left;
     v2<u32> new_position;
 };
+
+// NOTE: In delta sync mode units are not sent as ADD/MOVE/REMOVE events.
+// The server numbers every state it sends a client, the client answers
+// SYNC_ACK with the ones it applied, and each ENTITY_DELTA only carries
+// what differs from the newest acknowledged state.
+#define COMM_SYNC_HISTORY 32
+#define COMM_SYNC_NO_BASELINE 0
+
+struct comm_sync_entity {
+    u32 id;
+    s32 owner;
+    unit_names name;
+    u32 action_points;
+    v2<u32> position;
+};
+
+enum comm_sync_fields {
+    COMM_SYNC_OWNER = 1 << 0,
+    COMM_SYNC_NAME = 1 << 1,
+    COMM_SYNC_ACTION_POINTS = 1 << 2,
+    COMM_SYNC_POSITION = 1 << 3
+};
+
+struct comm_sync_snapshot {
+    u32 id;
+    u32 num, max;
+    comm_sync_entity *entities;
+};
+
+void comm_sync_store(comm_sync_snapshot *snapshot, u32 id, comm_sync_entity *entities, u32 num) {
+    if (num > snapshot->max) {
+        snapshot->max = MAX(num, snapshot->max * 2);
+        snapshot->entities = (comm_sync_entity *)realloc(snapshot->entities, sizeof(*snapshot->entities) * snapshot->max);
+        assert(snapshot->entities);
+    }
+    snapshot->id = id;
+    snapshot->num = num;
+    if (num)
+        memcpy(snapshot->entities, entities, sizeof(*entities) * num);
+}
+
+void comm_sync_release(comm_sync_snapshot *snapshot) {
+    free(snapshot->entities);
+    snapshot->entities = NULL;
+    snapshot->num = snapshot->max = 0;
+}
+
+int comm_sync_entity_compare(const void *a, const void *b) {
+    u32 id_a = ((comm_sync_entity *)a)->id;
+    u32 id_b = ((comm_sync_entity *)b)->id;
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+struct comm_server_entity_delta_body {
+    u32 snapshot_id;
+    u32 baseline_id;
+    u32 num_changed;
+    u32 num_removed;
+};
+
+struct comm_client_sync_ack_body {
+    u32 snapshot_id;
+};
+
+#define COMM_UNKNOWN_MESSAGE 0xFFFFFFFF
+
+u32 comm_client_body_size(comm_client_msg_names name) {
+    switch (name) {
+        case comm_client_msg_names::CONNECT:
+        case comm_client_msg_names::START:
+        case comm_client_msg_names::PONG:
+        case comm_client_msg_names::ADMIN_DISCOVER_ENTIRE_MAP:
+        case comm_client_msg_names::END_TURN:
+            return 0;
+        case comm_client_msg_names::ADMIN_ADD_UNIT: return sizeof(comm_client_admin_add_unit_body);
+        case comm_client_msg_names::SET_CONSTRUCTION: return sizeof(comm_client_set_construction_body);
+        case comm_client_msg_names::MOVE_UNIT: return sizeof(comm_client_move_unit_body);
+        case comm_client_msg_names::LOAD_UNIT: return sizeof(comm_client_load_unit_body);
+        case comm_client_msg_names::UNLOAD_UNIT: return sizeof(comm_client_unload_unit_body);
+        case comm_client_msg_names::SYNC_ACK: return sizeof(comm_client_sync_ack_body);
+        case comm_client_msg_names::MOVE_PATH: return sizeof(comm_client_move_path_body);
+    }
+    return COMM_UNKNOWN_MESSAGE;
+}
+
+// NOTE: Returns where the run of whole, known client messages in a packet
+// read by comm_read ends. Whatever follows the first bad message is
+// dropped, so handlers can trust every body they are given.
+u32 comm_client_validate(u8 *data, u32 len) {
+    u32 it = sizeof(comm_shared_header);
+    while (it + sizeof(comm_client_header) <= len) {
+        comm_client_header *header = (comm_client_header *)(data + it);
+        u32 body_size = comm_client_body_size(header->name);
+        if (body_size == COMM_UNKNOWN_MESSAGE || it + sizeof(*header) + body_size > len)
+            break;
+        it += sizeof(*header) + body_size;
+    }
+    return it;
+}
+
+void comm_write_entity_delta(communication *comm, u32 snapshot_id, u32 baseline_id,
+                             comm_sync_entity *baseline, u32 num_baseline,
+                             comm_sync_entity *current, u32 num_current) {
+    comm_server_header header;
+    header.name = comm_server_msg_names::ENTITY_DELTA;
+    comm_write(comm, &header, sizeof(header));
+
+    comm_server_entity_delta_body *body =
+        (comm_server_entity_delta_body *)memory_arena_use(&comm->buffer, sizeof(*body));
+    body->snapshot_id = snapshot_id;
+    body->baseline_id = baseline_id;
+    body->num_changed = 0;
+    body->num_removed = 0;
+
+    // NOTE: Both lists are sorted by id, so one merge pass finds every
+    // added, changed and removed entity
+    u32 b = 0;
+    for (u32 c = 0; c < num_current; ++c) {
+        while (b < num_baseline && baseline[b].id < current[c].id) {
+            ++b;
+        }
+
+        comm_sync_entity *now = &current[c];
+        comm_sync_entity *was = (b < num_baseline && baseline[b].id == now->id) ? &baseline[b] : NULL;
+
+        u8 fields = 0;
+        if (!was || was->owner != now->owner) fields |= COMM_SYNC_OWNER;
+        if (!was || was->name != now->name) fields |= COMM_SYNC_NAME;
+        if (!was || was->action_points != now->action_points) fields |= COMM_SYNC_ACTION_POINTS;
+        if (!was || was->position != now->position) fields |= COMM_SYNC_POSITION;
+        if (!fields) continue;
+
+        comm_write(comm, &now->id, sizeof(now->id));
+        comm_write(comm, &fields, sizeof(fields));
+        if (fields & COMM_SYNC_OWNER) {
+            u8 owner = (u8)now->owner;
+            comm_write(comm, &owner, sizeof(owner));
+        }
+        if (fields & COMM_SYNC_NAME) {
+            u8 name = (u8)now->name;
+            comm_write(comm, &name, sizeof(name));
+        }
+        if (fields & COMM_SYNC_ACTION_POINTS) {
+            u8 action_points = (u8)now->action_points;
+            comm_write(comm, &action_points, sizeof(action_points));
+        }
+        if (fields & COMM_SYNC_POSITION) {
+            u16 xy[2] = {(u16)now->position.x, (u16)now->position.y};
+            comm_write(comm, xy, sizeof(xy));
+        }
+        body->num_changed++;
+    }
+
+    u32 c = 0;
+    for (b = 0; b < num_baseline; ++b) {
+        while (c < num_current && current[c].id < baseline[b].id) {
+            ++c;
+        }
+        if (c < num_current && current[c].id == baseline[b].id) continue;
+
+        comm_write(comm, &baseline[b].id, sizeof(baseline[b].id));
+        body->num_removed++;
+    }
+}
+
+// NOTE: The removed ids follow the changes, which vary in length, so
+// they are rarely aligned
+u32 comm_sync_removed_at(u8 *removed, u32 r) {
+    u32 id;
+    memcpy(&id, removed + sizeof(u32) * r, sizeof(id));
+    return id;
+}
+
+// NOTE: Applies a delta to baseline and writes the resulting state, sorted
+// by id, to out. out must have room for num_baseline + body->num_changed
+// entities. Returns the number of bytes consumed, or 0 if the message is
+// cut short.
+u32 comm_read_entity_delta(u8 *data, u32 len, comm_sync_entity *baseline, u32 num_baseline,
+                           comm_sync_entity *out, u32 *num_out) {
+    comm_server_entity_delta_body *body = (comm_server_entity_delta_body *)data;
+    if (len < sizeof(*body)) return 0;
+    u32 it = sizeof(*body);
+
+    u8 *changes = data + it;
+    for (u32 i = 0; i < body->num_changed; ++i) {
+        if (it + sizeof(u32) + sizeof(u8) > len) return 0;
+        u8 fields = data[it + sizeof(u32)];
+        it += sizeof(u32) + sizeof(u8);
+        if (fields & COMM_SYNC_OWNER) it += sizeof(u8);
+        if (fields & COMM_SYNC_NAME) it += sizeof(u8);
+        if (fields & COMM_SYNC_ACTION_POINTS) it += sizeof(u8);
+        if (fields & COMM_SYNC_POSITION) it += sizeof(u16) * 2;
+    }
+    if (it > len || body->num_removed > (len - it) / sizeof(u32)) return 0;
+    u8 *removed = data + it;
+    it += sizeof(u32) * body->num_removed;
+
+    if (!out) return it;
+
+    u32 b = 0, r = 0, num = 0;
+    u8 *change = changes;
+    for (u32 i = 0; i <= body->num_changed; ++i) {
+        u32 id = 0xFFFFFFFF;
+        if (i < body->num_changed) {
+            memcpy(&id, change, sizeof(id));
+        }
+
+        while (b < num_baseline && baseline[b].id < id) {
+            while (r < body->num_removed && comm_sync_removed_at(removed, r) < baseline[b].id) ++r;
+            if (r == body->num_removed || comm_sync_removed_at(removed, r) != baseline[b].id) {
+                out[num++] = baseline[b];
+            }
+            ++b;
+        }
+        if (i == body->num_changed) break;
+
+        comm_sync_entity *e = &out[num++];
+        if (b < num_baseline && baseline[b].id == id) {
+            *e = baseline[b++];
+        } else {
+            memset(e, 0, sizeof(*e));
+            e->id = id;
+        }
+
+        change += sizeof(u32);
+        u8 fields = *change++;
+        if (fields & COMM_SYNC_OWNER) e->owner = *change++;
+        if (fields & COMM_SYNC_NAME) e->name = (unit_names)*change++;
+        if (fields & COMM_SYNC_ACTION_POINTS) e->action_points = *change++;
+        if (fields & COMM_SYNC_POSITION) {
+            u16 xy[2];
+            memcpy(xy, change, sizeof(xy));
+            change += sizeof(xy);
+            e->position.x = xy[0];
+            e->position.y = xy[1];
+        }
+    }
+
+    *num_out = num;
+    return it;
+}
@@ -0,0 +1,407 @@
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define COMM_UDP_BATCH_SIZE 32
+#define COMM_UDP_MAX_DATAGRAM 65507
+#define COMM_UDP_INBOX_SIZE KB(64)
+#define COMM_UDP_NONE 0xFFFFFFFF
+#define COMM_UDP_FULL_REPORT_MS 1000
+
+struct comm_udp_server;
+
+struct comm_udp_connection {
+    comm_udp_server *server;
+    struct sockaddr_in addr;
+    ring_buffer<u8> inbox;
+    u32 id;
+    u32 hash_next;
+    u32 heap_index;
+    u32 wake_at;
+    bool in_use, ready;
+};
+
+struct comm_udp_timer {
+    u32 when;
+    u32 connection;
+};
+
+struct comm_udp_server {
+    s32 fd, epoll_fd;
+
+    comm_udp_connection *connections;
+    u32 max, used, free_head;
+
+    u32 *table;
+    u32 table_mask;
+
+    comm_udp_timer *timers;
+    u32 timers_used;
+
+    // NOTE: Filled by comm_udp_server_poll, only valid until the next poll
+    u32 *ready;
+    u32 ready_used;
+    u32 *accepted;
+    u32 accepted_used;
+
+    u8 *batch;
+
+    // NOTE: Datagrams that would have made a connection while the table
+    // was full, reported at most once per COMM_UDP_FULL_REPORT_MS
+    u32 full_dropped;
+    u32 full_reported_at;
+};
+
+u32 comm_udp_hash(struct sockaddr_in *addr) {
+    u64 key = ((u64)addr->sin_addr.s_addr << 16) | addr->sin_port;
+    key *= 0x9E3779B97F4A7C15ull;
+    return (u32)(key >> 32);
+}
+
+void comm_udp_timer_swap(comm_udp_server *server, u32 a, u32 b) {
+    comm_udp_timer temp = server->timers[a];
+    server->timers[a] = server->timers[b];
+    server->timers[b] = temp;
+    server->connections[server->timers[a].connection].heap_index = a;
+    server->connections[server->timers[b].connection].heap_index = b;
+}
+
+void comm_udp_timer_sift_up(comm_udp_server *server, u32 i) {
+    while (i > 0) {
+        u32 parent = (i - 1) / 2;
+        if ((s32)(server->timers[i].when - server->timers[parent].when) >= 0)
+            break;
+        comm_udp_timer_swap(server, i, parent);
+        i = parent;
+    }
+}
+
+void comm_udp_timer_sift_down(comm_udp_server *server, u32 i) {
+    for (;;) {
+        u32 smallest = i;
+        u32 left = i * 2 + 1;
+        u32 right = left + 1;
+        if (left < server->timers_used &&
+            (s32)(server->timers[left].when - server->timers[smallest].when) < 0)
+            smallest = left;
+        if (right < server->timers_used &&
+            (s32)(server->timers[right].when - server->timers[smallest].when) < 0)
+            smallest = right;
+        if (smallest == i)
+            break;
+        comm_udp_timer_swap(server, i, smallest);
+        i = smallest;
+    }
+}
+
+void comm_udp_timer_remove(comm_udp_server *server, u32 id) {
+    comm_udp_connection *conn = &server->connections[id];
+    u32 i = conn->heap_index;
+    if (i == COMM_UDP_NONE)
+        return;
+
+    u32 last = --server->timers_used;
+    if (i != last) {
+        comm_udp_timer_swap(server, i, last);
+        u32 moved = server->timers[i].connection;
+        comm_udp_timer_sift_up(server, i);
+        comm_udp_timer_sift_down(server, server->connections[moved].heap_index);
+    }
+    conn->heap_index = COMM_UDP_NONE;
+}
+
+// NOTE: Asks comm_udp_server_poll to report the connection as ready at
+// the given time even if nothing arrives for it, e.g. for pings and
+// retransmits. A connection has at most one pending wake up.
+void comm_udp_server_wake_at(comm_udp_server *server, u32 id, u32 when) {
+    comm_udp_connection *conn = &server->connections[id];
+    conn->wake_at = when;
+    if (conn->heap_index == COMM_UDP_NONE) {
+        u32 i = server->timers_used++;
+        server->timers[i].when = when;
+        server->timers[i].connection = id;
+        conn->heap_index = i;
+        comm_udp_timer_sift_up(server, i);
+    } else {
+        u32 i = conn->heap_index;
+        server->timers[i].when = when;
+        comm_udp_timer_sift_up(server, i);
+        comm_udp_timer_sift_down(server, conn->heap_index);
+    }
+}
+
+void comm_udp_mark_ready(comm_udp_server *server, u32 id) {
+    comm_udp_connection *conn = &server->connections[id];
+    if (!conn->ready) {
+        conn->ready = true;
+        server->ready[server->ready_used++] = id;
+    }
+}
+
+u32 comm_udp_find(comm_udp_server *server, struct sockaddr_in *addr) {
+    u32 it = server->table[comm_udp_hash(addr) & server->table_mask];
+    while (it != COMM_UDP_NONE) {
+        comm_udp_connection *conn = &server->connections[it];
+        if (conn->addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+            conn->addr.sin_port == addr->sin_port)
+            return it;
+        it = conn->hash_next;
+    }
+    return COMM_UDP_NONE;
+}
+
+u32 comm_udp_accept(comm_udp_server *server, struct sockaddr_in *addr) {
+    if (server->free_head == COMM_UDP_NONE) {
+        return COMM_UDP_NONE;
+    }
+
+    u32 id = server->free_head;
+    comm_udp_connection *conn = &server->connections[id];
+    server->free_head = conn->hash_next;
+
+    conn->addr = *addr;
+    conn->in_use = true;
+    conn->ready = false;
+    conn->heap_index = COMM_UDP_NONE;
+    conn->inbox.read_it = conn->inbox.write_it = 0;
+
+    u32 bucket = comm_udp_hash(addr) & server->table_mask;
+    conn->hash_next = server->table[bucket];
+    server->table[bucket] = id;
+
+    ++server->used;
+    server->accepted[server->accepted_used++] = id;
+    return id;
+}
+
+void comm_udp_server_close(comm_udp_server *server, u32 id) {
+    comm_udp_connection *conn = &server->connections[id];
+    if (!conn->in_use)
+        return;
+
+    u32 *it = &server->table[comm_udp_hash(&conn->addr) & server->table_mask];
+    while (*it != id) {
+        it = &server->connections[*it].hash_next;
+    }
+    *it = conn->hash_next;
+
+    comm_udp_timer_remove(server, id);
+    conn->in_use = false;
+    conn->hash_next = server->free_head;
+    server->free_head = id;
+    --server->used;
+}
+
+bool comm_udp_server_init(comm_udp_server *server, u16 port, u32 max_connections, memory_arena *mem) {
+    server->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (server->fd < 0) {
+        sitrep(SITREP_ERROR, "Could not create udp socket (%s)", strerror(errno));
+        return false;
+    }
+
+    s32 rcvbuf = MB(8);
+    setsockopt(server->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(server->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        sitrep(SITREP_ERROR, "Could not bind udp port %u (%s)", port, strerror(errno));
+        close(server->fd);
+        return false;
+    }
+
+    server->epoll_fd = epoll_create1(0);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u32 = 0;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->fd, &event);
+
+    server->max = max_connections;
+    server->used = 0;
+    server->connections = (comm_udp_connection *)memory_arena_use(mem, sizeof(*server->connections) * max_connections);
+    for (u32 i = 0; i < max_connections; ++i) {
+        comm_udp_connection *conn = &server->connections[i];
+        conn->server = server;
+        conn->id = i;
+        conn->in_use = false;
+        conn->hash_next = (i + 1 < max_connections) ? i + 1 : COMM_UDP_NONE;
+        conn->inbox = ring_buffer<u8>(mem, COMM_UDP_INBOX_SIZE);
+    }
+    server->free_head = 0;
+
+    u32 table_size = 1;
+    while (table_size < max_connections * 2)
+        table_size <<= 1;
+    server->table_mask = table_size - 1;
+    server->table = (u32 *)memory_arena_use(mem, sizeof(*server->table) * table_size);
+    memset(server->table, 0xFF, sizeof(*server->table) * table_size);
+
+    server->timers = (comm_udp_timer *)memory_arena_use(mem, sizeof(*server->timers) * max_connections);
+    server->timers_used = 0;
+    server->ready = (u32 *)memory_arena_use(mem, sizeof(*server->ready) * max_connections);
+    server->ready_used = 0;
+    server->accepted = (u32 *)memory_arena_use(mem, sizeof(*server->accepted) * max_connections);
+    server->accepted_used = 0;
+    server->batch = memory_arena_use(mem, COMM_UDP_MAX_DATAGRAM * COMM_UDP_BATCH_SIZE);
+    server->full_dropped = 0;
+    server->full_reported_at = time_get_now_in_ms() - COMM_UDP_FULL_REPORT_MS;
+
+    return true;
+}
+
+// NOTE: Only a packet starting with CONNECT makes a connection, so stray
+// or spoofed datagrams cannot fill the table
+bool comm_udp_is_connect(u8 *data, u32 size) {
+    if (size < sizeof(comm_shared_header) + sizeof(comm_client_header))
+        return false;
+
+    comm_shared_header *shared = (comm_shared_header *)data;
+    if ((shared->magic ^ (0b101 << 29)) != PROTOCOL_VERSION)
+        return false;
+
+    comm_client_header *header = (comm_client_header *)(data + sizeof(*shared));
+    return header->name == comm_client_msg_names::CONNECT;
+}
+
+void comm_udp_server_drain(comm_udp_server *server) {
+    struct mmsghdr msgs[COMM_UDP_BATCH_SIZE];
+    struct iovec iovecs[COMM_UDP_BATCH_SIZE];
+    struct sockaddr_in addrs[COMM_UDP_BATCH_SIZE];
+
+    for (;;) {
+        memset(msgs, 0, sizeof(msgs));
+        for (u32 i = 0; i < COMM_UDP_BATCH_SIZE; ++i) {
+            iovecs[i].iov_base = server->batch + i * COMM_UDP_MAX_DATAGRAM;
+            iovecs[i].iov_len = COMM_UDP_MAX_DATAGRAM;
+            msgs[i].msg_hdr.msg_iov = &iovecs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        }
+
+        s32 num = recvmmsg(server->fd, msgs, COMM_UDP_BATCH_SIZE, MSG_DONTWAIT, NULL);
+        if (num <= 0)
+            return;
+
+        for (s32 i = 0; i < num; ++i) {
+            u8 *data = server->batch + i * COMM_UDP_MAX_DATAGRAM;
+            u32 size = msgs[i].msg_len;
+            u32 id = comm_udp_find(server, &addrs[i]);
+            if (id == COMM_UDP_NONE) {
+                if (!comm_udp_is_connect(data, size))
+                    continue;
+
+                id = comm_udp_accept(server, &addrs[i]);
+                if (id == COMM_UDP_NONE) {
+                    u32 now = time_get_now_in_ms();
+                    ++server->full_dropped;
+                    if (now - server->full_reported_at >= COMM_UDP_FULL_REPORT_MS) {
+                        sitrep(SITREP_WARNING, "Connection table full, dropped %u connects", server->full_dropped);
+                        server->full_dropped = 0;
+                        server->full_reported_at = now;
+                    }
+                    continue;
+                }
+            }
+
+            if (size == 0)
+                continue;
+
+            comm_udp_connection *conn = &server->connections[id];
+            if (conn->inbox.distance() + sizeof(size) + size >= conn->inbox.max) {
+                continue;
+            }
+            conn->inbox.write((u8 *)&size, sizeof(size));
+            conn->inbox.write(data, size);
+            comm_udp_mark_ready(server, id);
+        }
+
+        if (num < COMM_UDP_BATCH_SIZE)
+            return;
+    }
+}
+
+// NOTE: Waits at most timeout_ms for traffic or the next due wake up and
+// returns how many connections are in server->ready. Idle connections
+// are never visited.
+u32 comm_udp_server_poll(comm_udp_server *server, s32 timeout_ms) {
+    for (u32 i = 0; i < server->ready_used; ++i) {
+        server->connections[server->ready[i]].ready = false;
+    }
+    server->ready_used = 0;
+    server->accepted_used = 0;
+
+    u32 now = time_get_now_in_ms();
+    if (server->timers_used > 0) {
+        s32 until = (s32)(server->timers[0].when - now);
+        if (until < 0)
+            until = 0;
+        if (timeout_ms < 0 || until < timeout_ms)
+            timeout_ms = until;
+    }
+
+    struct epoll_event event;
+    s32 num = epoll_wait(server->epoll_fd, &event, 1, timeout_ms);
+    if (num > 0) {
+        comm_udp_server_drain(server);
+    }
+
+    now = time_get_now_in_ms();
+    while (server->timers_used > 0 && (s32)(now - server->timers[0].when) >= 0) {
+        u32 id = server->timers[0].connection;
+        comm_udp_timer_remove(server, id);
+        comm_udp_mark_ready(server, id);
+    }
+
+    return server->ready_used;
+}
+
+COMM_SEND(comm_server_udp_send) {
+    comm_udp_connection *conn = (comm_udp_connection *)comm.handle;
+    if (size > COMM_UDP_MAX_DATAGRAM) {
+        sitrep(SITREP_WARNING, "Packet of %u bytes does not fit in a datagram", size);
+        return;
+    }
+
+    sendto(conn->server->fd, data, size, MSG_DONTWAIT,
+           (struct sockaddr *)&conn->addr, sizeof(conn->addr));
+}
+
+COMM_RECV(comm_server_udp_recv) {
+    comm_udp_connection *conn = (comm_udp_connection *)comm.handle;
+    ring_buffer<u8> *mem = &conn->inbox;
+    if (mem->distance() < 4) {
+        return 0;
+    }
+    u32 packet_size, amount_to_read;
+    mem->read((u8 *)&packet_size, 4);
+    if (packet_size < size) {
+        amount_to_read = packet_size;
+    } else if (packet_size > size) {
+        mem->add_to_read_it(packet_size);
+        return COMM_DROPPED;
+    } else {
+        amount_to_read = size;
+    }
+
+    return mem->read((u8 *)buffer, amount_to_read);
+}
+
+void comm_server_udp_init(communication *comm, comm_udp_server *server, u32 id, memory_arena buffer) {
+    comm->handle = (uintptr_t)&server->connections[id];
+    comm->send = &comm_server_udp_send;
+    comm->recv = &comm_server_udp_recv;
+
+    comm->buffer = buffer;
+    memory_arena_use(&comm->buffer, sizeof(comm_shared_header));
+    comm->local_sequence_number = 0;
+    comm->remote_sequence_number = 0;
+}
+#endif
@@ -0,0 +1,61 @@
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define COMM_SERVER_UNIX_SLOT_SIZE KB(64)
+
+s32 comm_server_unix_listen(char *path) {
+    s32 fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        sitrep(SITREP_ERROR, "Could not create unix socket (%s)", strerror(errno));
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 64) < 0) {
+        sitrep(SITREP_ERROR, "Could not listen on '%s' (%s)", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+s32 comm_server_unix_accept(s32 listen_fd) {
+    s32 fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+    if (fd < 0) {
+        return -1;
+    }
+
+    s32 sndbuf = MB(4);
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    return fd;
+}
+
+void comm_server_unix_init(communication *comm, comm_unix_socket *sock, s32 fd, memory_arena buffer) {
+    sock->fd = fd;
+    sock->batch_slot_size = COMM_SERVER_UNIX_SLOT_SIZE;
+    sock->batch_used = sock->batch_it = 0;
+
+    // NOTE: The receive batch lives at the tail of the send buffer, so the
+    // header reserved at its base stays where comm_flush expects it
+    buffer.max -= sock->batch_slot_size * COMM_UNIX_BATCH_SIZE;
+    sock->batch = buffer.base + buffer.max;
+
+    comm->handle = (uintptr_t)sock;
+    comm->send = &comm_unix_send;
+    comm->recv = &comm_unix_recv;
+
+    comm->buffer = buffer;
+    memory_arena_use(&comm->buffer, sizeof(comm_shared_header));
+    comm->local_sequence_number = 0;
+    comm->remote_sequence_number = 0;
+}
+#endif
@@ -0,0 +1,178 @@
+// NOTE: Wraps any transport; outgoing packets are held until their delivery
+// time and then handed to the wrapped transport's send
+
+struct comm_sim_config {
+    u32 latency_ms;
+    u32 jitter_ms;
+    real32 loss;
+    real32 duplicate;
+    real32 reorder;
+    u32 reorder_delay_ms;
+    u32 bandwidth_bytes_per_second; // NOTE: 0 means unlimited
+    u32 queue_limit_ms;             // NOTE: 0 means unlimited
+};
+
+struct comm_sim_packet {
+    comm_sim_packet *next;
+    u32 deliver_at;
+    u32 size;
+    u8 data[1];
+};
+
+struct comm_sim_link {
+    uintptr_t inner_handle;
+    comm_send_t *inner_send;
+    comm_recv_t *inner_recv;
+
+    comm_sim_config config;
+    random_series series;
+    u32 link_free_at;
+    comm_sim_packet *in_flight;
+
+    struct {
+        u32 sent, delivered, lost, duplicated, reordered, queue_dropped;
+    } stats;
+};
+
+// NOTE: When set, time_get_now_in_ms returns comm_sim_now instead of the
+// wall clock, so a soak test can advance minutes of link time in a loop
+bool comm_sim_virtual_clock = false;
+u32 comm_sim_now = 0;
+
+void comm_sim_advance(u32 ms) {
+    comm_sim_now += ms;
+}
+
+communication comm_sim_inner(comm_sim_link *link) {
+    communication rv = {0};
+    rv.handle = link->inner_handle;
+    rv.send = link->inner_send;
+    rv.recv = link->inner_recv;
+    return rv;
+}
+
+void comm_sim_enqueue(comm_sim_link *link, void *data, u32 size, u32 deliver_at) {
+    comm_sim_packet *packet = (comm_sim_packet *)malloc(sizeof(*packet) + size);
+    assert(packet);
+    packet->deliver_at = deliver_at;
+    packet->size = size;
+    memcpy(packet->data, data, size);
+
+    // NOTE: Insert after every packet due at the same time, so a link
+    // without jitter keeps send order
+    comm_sim_packet **it = &link->in_flight;
+    while (*it && (s32)((*it)->deliver_at - deliver_at) <= 0) {
+        it = &(*it)->next;
+    }
+    packet->next = *it;
+    *it = packet;
+}
+
+void comm_sim_pump(comm_sim_link *link) {
+    u32 now = time_get_now_in_ms();
+    communication inner = comm_sim_inner(link);
+
+    while (link->in_flight && (s32)(now - link->in_flight->deliver_at) >= 0) {
+        comm_sim_packet *packet = link->in_flight;
+        link->in_flight = packet->next;
+
+        inner.send(inner, packet->data, packet->size);
+        link->stats.delivered++;
+        free(packet);
+    }
+}
+
+u32 comm_sim_delay(comm_sim_link *link) {
+    u32 rv = link->config.latency_ms;
+    if (link->config.jitter_ms) {
+        rv += random_next_u32(&link->series) % (link->config.jitter_ms + 1);
+    }
+    if (random_unilateral(&link->series) < link->config.reorder) {
+        rv += link->config.reorder_delay_ms;
+        link->stats.reordered++;
+    }
+    return rv;
+}
+
+COMM_SEND(comm_sim_send) {
+    comm_sim_link *link = (comm_sim_link *)comm.handle;
+    u32 now = time_get_now_in_ms();
+    link->stats.sent++;
+
+    if (random_unilateral(&link->series) < link->config.loss) {
+        link->stats.lost++;
+        comm_sim_pump(link);
+        return;
+    }
+
+    u32 departs_at = now;
+    if (link->config.bandwidth_bytes_per_second) {
+        if ((s32)(link->link_free_at - now) > 0) {
+            departs_at = link->link_free_at;
+        }
+
+        if (link->config.queue_limit_ms && departs_at - now > link->config.queue_limit_ms) {
+            link->stats.queue_dropped++;
+            comm_sim_pump(link);
+            return;
+        }
+
+        u64 serialize_ms = ((u64)size * 1000) / link->config.bandwidth_bytes_per_second;
+        departs_at += (u32)serialize_ms;
+        link->link_free_at = departs_at;
+    }
+
+    comm_sim_enqueue(link, data, size, departs_at + comm_sim_delay(link));
+    if (random_unilateral(&link->series) < link->config.duplicate) {
+        link->stats.duplicated++;
+        comm_sim_enqueue(link, data, size, departs_at + comm_sim_delay(link));
+    }
+
+    comm_sim_pump(link);
+}
+
+COMM_RECV(comm_sim_recv) {
+    comm_sim_link *link = (comm_sim_link *)comm.handle;
+    comm_sim_pump(link);
+
+    communication inner = comm_sim_inner(link);
+    return inner.recv(inner, buffer, size);
+}
+
+void comm_sim_wrap(communication *comm, comm_sim_link *link, comm_sim_config config, u64 seed) {
+    link->inner_handle = comm->handle;
+    link->inner_send = comm->send;
+    link->inner_recv = comm->recv;
+
+    link->config = config;
+    link->series = random_seed(seed);
+    link->link_free_at = 0;
+    link->in_flight = NULL;
+    memset(&link->stats, 0, sizeof(link->stats));
+
+    comm->handle = (uintptr_t)link;
+    comm->send = &comm_sim_send;
+    comm->recv = &comm_sim_recv;
+}
+
+// NOTE: When everything sent so far will have been delivered
+u32 comm_sim_drained_at(comm_sim_link *link) {
+    u32 rv = time_get_now_in_ms();
+    for (comm_sim_packet *packet = link->in_flight; packet; packet = packet->next) {
+        if ((s32)(packet->deliver_at - rv) > 0)
+            rv = packet->deliver_at;
+    }
+    return rv;
+}
+
+void comm_sim_unwrap(communication *comm, comm_sim_link *link) {
+    while (link->in_flight) {
+        comm_sim_packet *next = link->in_flight->next;
+        free(link->in_flight);
+        link->in_flight = next;
+    }
+
+    comm->handle = link->inner_handle;
+    comm->send = link->inner_send;
+    comm->recv = link->inner_recv;
+}
@@ -0,0 +1,57 @@
+// NOTE: What both ends of a unix SOCK_SEQPACKET connection do the same.
+// Packets are read COMM_UNIX_BATCH_SIZE at a time with one recvmmsg and
+// handed out one per recv from the batch.
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <errno.h>
+
+COMM_SEND(comm_unix_send) {
+    comm_unix_socket *sock = (comm_unix_socket *)comm.handle;
+    ssize_t rv = send(sock->fd, data, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (rv < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        sitrep(SITREP_WARNING, "Unix socket send failed (%s)", strerror(errno));
+    }
+}
+
+COMM_RECV(comm_unix_recv) {
+    comm_unix_socket *sock = (comm_unix_socket *)comm.handle;
+    if (sock->batch_it == sock->batch_used) {
+        struct mmsghdr msgs[COMM_UNIX_BATCH_SIZE];
+        struct iovec iovecs[COMM_UNIX_BATCH_SIZE];
+        memset(msgs, 0, sizeof(msgs));
+        for (u32 i = 0; i < COMM_UNIX_BATCH_SIZE; ++i) {
+            iovecs[i].iov_base = sock->batch + i * sock->batch_slot_size;
+            iovecs[i].iov_len = sock->batch_slot_size;
+            msgs[i].msg_hdr.msg_iov = &iovecs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        sock->batch_it = sock->batch_used = 0;
+        s32 num = recvmmsg(sock->fd, msgs, COMM_UNIX_BATCH_SIZE, MSG_DONTWAIT, NULL);
+        if (num <= 0) {
+            return 0;
+        }
+
+        for (s32 i = 0; i < num; ++i) {
+            if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                sitrep(SITREP_WARNING, "Unix socket packet larger than %u bytes dropped", sock->batch_slot_size);
+                sock->batch_sizes[i] = 0;
+            } else {
+                sock->batch_sizes[i] = msgs[i].msg_len;
+            }
+        }
+        sock->batch_used = num;
+    }
+
+    u32 slot = sock->batch_it++;
+    u32 packet_size = sock->batch_sizes[slot];
+    if (packet_size == 0 || packet_size > size) {
+        return COMM_DROPPED;
+    }
+
+    memcpy(buffer, sock->batch + slot * sock->batch_slot_size, packet_size);
+    return packet_size;
+}
+#endif
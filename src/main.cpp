@@ -10,7 +10,21 @@
 #include "communication/protocol.cpp"
 #include "communication/server/memory.cpp"
 #include "communication/client/memory.cpp"
+#include "communication/unix.cpp"
+#include "communication/server/unix.cpp"
+#include "communication/client/unix.cpp"
+#include "communication/server/udp.cpp"
+#include "communication/client/udp.cpp"
+#include "communication/simulator.cpp"
+#include "communication/capture.cpp"
+#include "server/jobs.cpp"
+#include "server/noise.cpp"
+#include "server/map_cache.cpp"
+#include "server/journal.cpp"
+#include "server/timers.cpp"
+#include "server/profile.cpp"
 #include "server/server.cpp"
+#include "server/save.cpp"
 
 #define CLIENT_NET_UPDATE(_n) void _n(memory_arena *mem, communication *comm)
 typedef CLIENT_NET_UPDATE(client_net_update_t);
@@ -30,6 +44,7 @@ enum class main_screen_names {
     IN_GAME
 } main_screen_name = main_screen_names::MAIN_MENU;
 
+server_config s_config = {0};
 server_input s_input = {0};
 server_output s_output = {0};
 
@@ -64,6 +79,9 @@ void sitrep(sitrep_names name, char *fmt, ...) {
 }
 
 u32 time_get_now_in_ms() {
+    if (comm_sim_virtual_clock)
+        return comm_sim_now;
+
 #ifdef _WIN32
     return 0;
 #else
@@ -80,6 +98,10 @@ u32 time_get_now_in_ms() {
 }
 
 int main(int argc, char *argv[]) {
+    // NOTE: Picks the noise path chunks are generated with, before any
+    // server_update can generate one
+    noise_init();
+
     total_memory.name = "total_memory";
     total_memory.used = 0;
     total_memory.max = GB(2);
@@ -87,7 +109,7 @@ int main(int argc, char *argv[]) {
     assert(total_memory.base);
     memset(total_memory.base, 0, total_memory.max);
 
-    server_memory = memory_arena_child(&total_memory, MB(100), "server_memory");
+    server_memory = memory_arena_child(&total_memory, server_memory_size(s_config, NUM_CLIENTS + NUM_AI), "server_memory");
     communication server_comms[NUM_CLIENTS + NUM_AI];
 
     ring_buffer<u8> *server_to_client_ring_buffer = (ring_buffer<u8> *)malloc(sizeof(*server_to_client_ring_buffer) * NUM_CLIENTS);
@@ -137,6 +159,56 @@ int main(int argc, char *argv[]) {
         server_comms[i + NUM_CLIENTS] = server_to_ai_comm[i];
     }
 
+    // NOTE: With --connect or --unix the first client talks to a
+    // moac_server over udp or a unix socket and the local server is never
+    // updated. With --ai an AI plays that connection instead, headless.
+    bool remote = false;
+    bool remote_ai = false;
+#ifndef _WIN32
+    comm_unix_socket remote_socket;
+#endif
+    for (s32 i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--delta-sync") == 0) {
+            s_config.delta_sync = true;
+        } else if (strcmp(argv[i], "--ai") == 0) {
+            remote_ai = true;
+        } else if (strcmp(argv[i], "--packets-per-frame") == 0 && i + 1 < argc) {
+            comm_reads_per_frame = MAX(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--connect") == 0 && i + 2 < argc) {
+            remote = comm_client_udp_init(&client_to_server_comm[0], argv[i + 1], argv[i + 2],
+                                          memory_arena_child(&total_memory, MB(100), "client_to_remote_memory"));
+            if (!remote)
+                return EXIT_FAILURE;
+#ifndef _WIN32
+        } else if (strcmp(argv[i], "--unix") == 0 && i + 1 < argc) {
+            remote = comm_client_unix_init(&client_to_server_comm[0], &remote_socket, argv[i + 1],
+                                           memory_arena_child(&total_memory, MB(100), "client_to_remote_memory"));
+            if (!remote)
+                return EXIT_FAILURE;
+#endif
+        }
+    }
+
+    if (remote && remote_ai) {
+        memory_arena remote_ai_memory = memory_arena_child(&total_memory, MB(20), "remote_ai_memory");
+        while (ai_update(&remote_ai_memory, &client_to_server_comm[0])) {
+#ifndef _WIN32
+            usleep(16000);
+#endif
+        }
+        return EXIT_SUCCESS;
+    }
+
+    comm_capture capture = {0};
+    comm_capture_link capture_links[NUM_CLIENTS + NUM_AI];
+    for (s32 i = 1; i < argc - 1; ++i) {
+        if (strcmp(argv[i], "--capture") == 0 && comm_capture_open(&capture, argv[i + 1])) {
+            for (u32 j = 0; j < NUM_CLIENTS + NUM_AI; ++j) {
+                comm_capture_wrap(&server_comms[j], &capture_links[j], &capture, j);
+            }
+        }
+    }
+
     InitWindow(1280, 720, "Hello, world");
     InitAudioDevice();
     SetTargetFPS(60);
@@ -146,7 +218,13 @@ int main(int argc, char *argv[]) {
     }
 
     while(!WindowShouldClose()) {
-        server_update(&server_memory, server_comms, NUM_CLIENTS + NUM_AI, s_input, &s_output);
+        if (remote) {
+            client_net_update_ptr(&client_memory[0], &client_to_server_comm[0]);
+            client_update_and_render_ptr(&client_memory[0], &client_to_server_comm[0]);
+            continue;
+        }
+
+        server_update(&server_memory, server_comms, NUM_CLIENTS + NUM_AI, s_config, s_input, &s_output);
         memset(&s_input, 0, sizeof(s_input));
 
         for (u32 i = 0; i < NUM_CLIENTS; ++i) {
@@ -162,6 +240,7 @@ int main(int argc, char *argv[]) {
     }
 
     CloseWindow();
+    comm_capture_close(&capture);
 
     return EXIT_SUCCESS;
 }
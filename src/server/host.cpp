@@ -0,0 +1,243 @@
+// NOTE: Runs many independent matches in one process. Every match owns an
+// arena with its own server_context at the base, so matches share nothing
+// and can be ticked on any worker. A match only ticks when marked pending,
+// the transport does that for input and for the wake ups it was asked for
+// with match_host_wake_at, so idle matches cost nothing.
+
+struct match_stats {
+    u32 ticks;
+    umax memory_used;
+    real32 last_tick_ms, max_tick_ms, total_tick_ms;
+    real32 total_sync_ms;
+};
+
+struct match {
+    bool in_use, pending, finished;
+
+    // NOTE: The arena of a loaded match is a mapping of its save
+    bool loaded;
+
+    memory_arena memory;
+    communication *comms;
+    u32 num_comms;
+    server_config config;
+    server_output output;
+
+    match_stats stats;
+};
+
+struct match_host {
+    job_pool *pool;
+
+    match *matches;
+    u32 max, used;
+
+    u32 *scheduled;
+    u32 num_scheduled;
+
+    // NOTE: What the profiled matches timed since the last report
+    server_profile profile;
+};
+
+real32 match_host_now_in_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0f + ts.tv_nsec / 1.0e6f;
+}
+
+void match_host_init(match_host *host, u32 max_matches, job_pool *pool) {
+    host->pool = pool;
+    host->max = max_matches;
+    host->used = 0;
+    host->matches = (match *)calloc(max_matches, sizeof(*host->matches));
+    host->scheduled = (u32 *)malloc(sizeof(*host->scheduled) * max_matches);
+    host->num_scheduled = 0;
+    assert(host->matches && host->scheduled);
+}
+
+// NOTE: comms are copied, the transports behind them stay with the caller.
+// Returns the match id, or -1 if the host is full or out of memory.
+s32 match_host_add(match_host *host, communication *comms, u32 num_comms, server_config config) {
+    for (u32 i = 0; i < host->max; ++i) {
+        match *m = &host->matches[i];
+        if (m->in_use)
+            continue;
+
+        memset(m, 0, sizeof(*m));
+        m->memory.name = "match_memory";
+        m->memory.max = server_memory_size(config, num_comms);
+        m->memory.used = 0;
+        m->memory.base = (u8 *)calloc(1, m->memory.max);
+        m->comms = (communication *)malloc(sizeof(*m->comms) * num_comms);
+        if (!m->memory.base || !m->comms) {
+            free(m->memory.base);
+            free(m->comms);
+            sitrep(SITREP_ERROR, "Out of memory for a new match");
+            return -1;
+        }
+        memcpy(m->comms, comms, sizeof(*comms) * num_comms);
+        m->num_comms = num_comms;
+        m->config = config;
+        m->pending = true;
+        m->in_use = true;
+        ++host->used;
+        return (s32)i;
+    }
+
+    return -1;
+}
+
+// NOTE: Like match_host_add, but the match continues from a save
+s32 match_host_load(match_host *host, communication *comms, u32 num_comms, server_config config, char *path) {
+    for (u32 i = 0; i < host->max; ++i) {
+        match *m = &host->matches[i];
+        if (m->in_use)
+            continue;
+
+        memset(m, 0, sizeof(*m));
+        m->memory.name = "match_memory";
+        m->comms = (communication *)malloc(sizeof(*m->comms) * num_comms);
+        if (!m->comms || !server_load(&m->memory, path, num_comms, config)) {
+            free(m->comms);
+            sitrep(SITREP_ERROR, "Could not load a match from '%s'", path);
+            return -1;
+        }
+
+        memcpy(m->comms, comms, sizeof(*comms) * num_comms);
+        m->num_comms = num_comms;
+        m->config = ((server_context *)m->memory.base)->config;
+        m->loaded = true;
+        m->pending = true;
+        m->in_use = true;
+        ++host->used;
+        return (s32)i;
+    }
+
+    return -1;
+}
+
+bool match_host_save(match_host *host, u32 id, char *path) {
+    match *m = &host->matches[id];
+    return m->in_use && server_save(&m->memory, path);
+}
+
+void match_host_remove(match_host *host, u32 id) {
+    match *m = &host->matches[id];
+    if (!m->in_use)
+        return;
+
+    if (m->loaded) {
+        server_unload(&m->memory);
+    } else {
+        server_release(&m->memory);
+        free(m->memory.base);
+    }
+    free(m->comms);
+    m->in_use = false;
+    --host->used;
+}
+
+// NOTE: Removes the matches still running and frees the host
+void match_host_release(match_host *host) {
+    for (u32 i = 0; i < host->max; ++i) {
+        match_host_remove(host, i);
+    }
+    free(host->matches);
+    free(host->scheduled);
+    host->matches = NULL;
+    host->scheduled = NULL;
+    host->max = 0;
+}
+
+// NOTE: Transports call this when a connection of the match has data
+void match_host_mark_pending(match_host *host, u32 id) {
+    host->matches[id].pending = true;
+}
+
+JOB_FN(match_host_tick_one) {
+    match_host *host = (match_host *)data;
+    match *m = &host->matches[host->scheduled[index]];
+
+    real32 start = match_host_now_in_ms();
+    server_input input = {0};
+    server_update(&m->memory, m->comms, m->num_comms, m->config, input, &m->output);
+    real32 elapsed = match_host_now_in_ms() - start;
+
+    server_context *ctx = (server_context *)m->memory.base;
+    bool anyone_connected = false;
+    for (u32 i = 1; i < ctx->clients.used; ++i) {
+        anyone_connected |= ctx->clients.connecteds[i];
+    }
+    m->finished = !anyone_connected;
+
+    m->stats.ticks++;
+    m->stats.memory_used = m->memory.used;
+    m->stats.last_tick_ms = elapsed;
+    m->stats.total_tick_ms += elapsed;
+    m->stats.total_sync_ms += m->output.journal_sync_ms;
+    if (elapsed > m->stats.max_tick_ms)
+        m->stats.max_tick_ms = elapsed;
+}
+
+// NOTE: When connection i of a match that has ticked next needs a tick
+// without input. False for a connection that is gone.
+bool match_host_wake_at(match_host *host, u32 id, u32 i, u32 *when) {
+    match *m = &host->matches[id];
+    return server_wake_at((server_context *)m->memory.base, i + 1, when);
+}
+
+// NOTE: Ticks every pending match, spread over the pool. Returns how many
+// matches ran, their ids are in host->scheduled.
+u32 match_host_tick(match_host *host) {
+    host->num_scheduled = 0;
+    for (u32 i = 0; i < host->max; ++i) {
+        match *m = &host->matches[i];
+        if (!m->in_use || m->finished)
+            continue;
+
+        if (m->pending) {
+            m->pending = false;
+            host->scheduled[host->num_scheduled++] = i;
+        }
+    }
+
+    job_pool_parallel_for(host->pool, match_host_tick_one, host, host->num_scheduled);
+    return host->num_scheduled;
+}
+
+void match_host_report(match_host *host) {
+    u32 ticks = 0;
+    umax memory_used = 0;
+    real32 total_tick_ms = 0, max_tick_ms = 0, total_sync_ms = 0;
+    for (u32 i = 0; i < host->max; ++i) {
+        match *m = &host->matches[i];
+        if (!m->in_use)
+            continue;
+
+        ticks += m->stats.ticks;
+        memory_used += m->stats.memory_used;
+        total_tick_ms += m->stats.total_tick_ms;
+        total_sync_ms += m->stats.total_sync_ms;
+        max_tick_ms = MAX(max_tick_ms, m->stats.max_tick_ms);
+    }
+
+    sitrep(SITREP_INFO, "%u matches, %u ticks, avg tick %.3f ms (%.3f ms journal sync), max tick %.3f ms, %u KB arena",
+           host->used, ticks, ticks ? total_tick_ms / ticks : 0.0f, ticks ? total_sync_ms / ticks : 0.0f,
+           max_tick_ms, (u32)(memory_used / 1024));
+
+    // NOTE: Runs between host ticks, so no match is writing its profile
+    bool any_profiled = false;
+    profile_reset(&host->profile);
+    for (u32 i = 0; i < host->max; ++i) {
+        match *m = &host->matches[i];
+        if (!m->in_use || !m->config.profile)
+            continue;
+
+        server_context *ctx = (server_context *)m->memory.base;
+        profile_merge(&host->profile, &ctx->profile);
+        profile_reset(&ctx->profile);
+        any_profiled = true;
+    }
+    if (any_profiled)
+        profile_report(&host->profile);
+}
@@ -0,0 +1,151 @@
+#define JOB_FN(_n) void _n(void *data, u32 index)
+typedef JOB_FN(job_fn_t);
+
+#ifndef _WIN32
+#include <pthread.h>
+
+// NOTE: A fixed set of workers that only ever run one parallel-for at a
+// time. The caller takes indices too, so a pool with zero workers is just
+// a serial loop.
+struct job_pool {
+    pthread_t *threads;
+    u32 num_threads;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond, done_cond;
+
+    job_fn_t *fn;
+    void *data;
+    u32 count;
+    u32 next;
+    u32 finished;
+    u32 active;
+    u32 generation;
+    bool quit;
+};
+
+// NOTE: Pulls indices until the batch is exhausted. Returns how many it ran.
+u32 job_pool_run(job_pool *pool, job_fn_t *fn, void *data, u32 count) {
+    u32 rv = 0;
+    for (;;) {
+        u32 index = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+        if (index >= count)
+            break;
+        fn(data, index);
+        ++rv;
+    }
+    return rv;
+}
+
+void *job_pool_worker(void *arg) {
+    job_pool *pool = (job_pool *)arg;
+    u32 seen_generation = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+    for (;;) {
+        while (!pool->quit && pool->generation == seen_generation) {
+            pthread_cond_wait(&pool->work_cond, &pool->mutex);
+        }
+        if (pool->quit)
+            break;
+
+        seen_generation = pool->generation;
+        job_fn_t *fn = pool->fn;
+        void *data = pool->data;
+        u32 count = pool->count;
+        pool->active++;
+        pthread_mutex_unlock(&pool->mutex);
+
+        u32 ran = job_pool_run(pool, fn, data, count);
+
+        pthread_mutex_lock(&pool->mutex);
+        pool->finished += ran;
+        pool->active--;
+        if (pool->active == 0)
+            pthread_cond_signal(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+void job_pool_init(job_pool *pool, u32 num_threads) {
+    memset(pool, 0, sizeof(*pool));
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    pool->num_threads = num_threads;
+    pool->threads = (pthread_t *)malloc(sizeof(*pool->threads) * MAX(num_threads, 1));
+    for (u32 i = 0; i < num_threads; ++i) {
+        pthread_create(&pool->threads[i], NULL, job_pool_worker, pool);
+    }
+}
+
+void job_pool_destroy(job_pool *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (u32 i = 0; i < pool->num_threads; ++i) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    free(pool->threads);
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->mutex);
+}
+
+// NOTE: Runs fn(data, i) for every i below count and returns once all of
+// them are done and no worker is still looking at this batch, so the next
+// call can never hand a stale worker a new index.
+void job_pool_parallel_for(job_pool *pool, job_fn_t *fn, void *data, u32 count) {
+    if (count == 0)
+        return;
+
+    if (!pool || pool->num_threads == 0 || count == 1) {
+        for (u32 i = 0; i < count; ++i) {
+            fn(data, i);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->fn = fn;
+    pool->data = data;
+    pool->count = count;
+    pool->next = 0;
+    pool->finished = 0;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    u32 ran = job_pool_run(pool, fn, data, count);
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->finished += ran;
+    while (pool->finished < count || pool->active > 0) {
+        pthread_cond_wait(&pool->done_cond, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+#else
+// NOTE: No workers on Windows, every batch runs on the caller
+struct job_pool {
+    u32 num_threads;
+};
+
+void job_pool_init(job_pool *pool, u32 num_threads) {
+    pool->num_threads = 0;
+}
+
+void job_pool_destroy(job_pool *pool) {
+}
+
+void job_pool_parallel_for(job_pool *pool, job_fn_t *fn, void *data, u32 count) {
+    for (u32 i = 0; i < count; ++i) {
+        fn(data, i);
+    }
+}
+#endif
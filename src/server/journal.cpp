@@ -0,0 +1,141 @@
+// NOTE: Append-only log of every game command the server handled, in the
+// order it handled them, with the turn they came in. Every few turns the
+// whole match is saved next to it as a keyframe, so a replay can start at
+// the keyframe before the turn it wants and only run the commands since.
+// The file is the header followed by records, each one a journal_record
+// and size bytes of payload.
+//
+// Synced, the journal is a write-ahead log: the commands of a tick are
+// made durable together with one fdatasync before anything they caused
+// is sent, so after a crash no client has seen an effect the journal lost.
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define JOURNAL_MAGIC 0x4A414F4D
+#define JOURNAL_VERSION 1
+#define JOURNAL_DEFAULT_KEYFRAME_TURNS 64
+
+enum journal_record_names : u32 {
+    // NOTE: The command's client header and body, as the client sent them
+    JOURNAL_COMMAND = 0,
+    // NOTE: No payload, the match was saved to the keyframe path of turn.
+    // A keyframe written in the background may never have made it.
+    JOURNAL_KEYFRAME
+};
+
+struct journal_header {
+    u32 magic;
+    u32 version;
+    u64 map_seed;
+    u32 map_width, map_height;
+    u32 num_clients;
+    u32 keyframe_turns;
+};
+
+struct journal_record {
+    journal_record_names name;
+    u32 client;
+    u32 turn;
+    u32 size;
+};
+
+struct match_journal {
+    FILE *file;
+    char *path;
+    u32 keyframe_turns;
+
+    // NOTE: Whether to fdatasync on commit and if anything came since
+    bool sync, dirty;
+
+    // NOTE: The keyframe a forked child is still writing, if any
+    s32 keyframe_pid;
+    u32 keyframe_turn, keyframe_start;
+    real32 keyframe_fork_ms;
+    u64 keyframe_faults;
+};
+
+void journal_keyframe_path(char *out, u32 size, char *path, u32 turn) {
+    snprintf(out, size, "%s.k%u", path, turn);
+}
+
+// NOTE: A new or renamed file is only durable once its directory is
+void journal_sync_dir(char *path) {
+#ifndef _WIN32
+    char dir[512];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash == dir)
+        slash[1] = 0;
+    else if (slash)
+        *slash = 0;
+    else
+        snprintf(dir, sizeof(dir), ".");
+
+    s32 fd = open(dir, O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+#endif
+}
+
+bool journal_open(match_journal *j, char *path, journal_header *header, bool sync) {
+    memset(j, 0, sizeof(*j));
+    j->file = fopen(path, "wb");
+    if (!j->file) {
+        sitrep(SITREP_WARNING, "Could not create journal '%s'", path);
+        return false;
+    }
+
+    header->magic = JOURNAL_MAGIC;
+    header->version = JOURNAL_VERSION;
+    fwrite(header, sizeof(*header), 1, j->file);
+    j->path = path;
+    j->keyframe_turns = header->keyframe_turns;
+    j->sync = sync;
+    j->dirty = true;
+    if (sync)
+        journal_sync_dir(path);
+    return true;
+}
+
+void journal_write(match_journal *j, journal_record_names name, u32 client, u32 turn, void *data, u32 size) {
+    if (!j->file)
+        return;
+
+    journal_record record = {name, client, turn, size};
+    fwrite(&record, sizeof(record), 1, j->file);
+    if (size)
+        fwrite(data, 1, size, j->file);
+    j->dirty = true;
+}
+
+// NOTE: Once per tick, before the tick sends anything. The records stay in
+// the stdio buffer until then and a synced journal has them on disk after.
+// Returns the milliseconds spent waiting on the disk.
+real32 journal_commit(match_journal *j) {
+    if (!j->file || !j->dirty)
+        return 0;
+
+    j->dirty = false;
+    fflush(j->file);
+#ifndef _WIN32
+    if (j->sync) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (fdatasync(fileno(j->file)) != 0)
+            sitrep(SITREP_WARNING, "Could not sync journal '%s'", j->path);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        return (end.tv_sec - start.tv_sec) * 1000.0f + (end.tv_nsec - start.tv_nsec) / 1000000.0f;
+    }
+#endif
+    return 0;
+}
+
+void journal_close(match_journal *j) {
+    if (j->file)
+        fclose(j->file);
+    memset(j, 0, sizeof(*j));
+}
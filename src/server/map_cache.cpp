@@ -0,0 +1,142 @@
+// NOTE: Generated maps on disk, keyed by seed and size. The file is the
+// header, the town count of every chunk, the terrain chunk by chunk as one
+// byte per tile, padding to 8 bytes and then the town positions in chunk
+// order, so a match can point its terrain straight into the mapping.
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define MAP_CACHE_MAGIC 0x4D414F4D
+#define MAP_CACHE_VERSION 4
+
+struct map_cache_header {
+    u32 magic;
+    u32 version;
+    u64 seed;
+    u32 width, height;
+    u32 num_towns;
+    u32 pad;
+};
+
+struct map_cache {
+    u8 *base;
+    umax size;
+
+    terrain_names *terrain;
+    u32 *chunk_num_towns;
+    v2<u32> *towns;
+    u32 num_towns;
+};
+
+umax map_cache_counts_offset() {
+    return sizeof(map_cache_header);
+}
+
+umax map_cache_terrain_offset(u32 num_chunks) {
+    return map_cache_counts_offset() + sizeof(u32) * num_chunks;
+}
+
+umax map_cache_towns_offset(u32 num_chunks, umax terrain_size) {
+    umax terrain_end = map_cache_terrain_offset(num_chunks) + terrain_size;
+    return (terrain_end + 7) & ~(umax)7;
+}
+
+void map_cache_path(char *out, u32 size, char *dir, u64 seed, u32 width, u32 height) {
+    snprintf(out, size, "%s/map_%016llx_%ux%u.bin", dir, (unsigned long long)seed, width, height);
+}
+
+// NOTE: Maps the file privately, so the match may write to its terrain
+// without touching the file or the other matches that share it
+bool map_cache_open(map_cache *cache, char *dir, u64 seed, u32 width, u32 height,
+                    u32 num_chunks, umax terrain_size) {
+    memset(cache, 0, sizeof(*cache));
+#ifndef _WIN32
+    char path[512];
+    map_cache_path(path, sizeof(path), dir, seed, width, height);
+    s32 fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (umax)st.st_size < sizeof(map_cache_header)) {
+        close(fd);
+        return false;
+    }
+
+    u8 *base = (u8 *)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return false;
+
+    map_cache_header *header = (map_cache_header *)base;
+    umax towns_offset = map_cache_towns_offset(num_chunks, terrain_size);
+    if (header->magic != MAP_CACHE_MAGIC || header->version != MAP_CACHE_VERSION ||
+        header->seed != seed || header->width != width || header->height != height ||
+        (umax)st.st_size != towns_offset + sizeof(v2<u32>) * header->num_towns) {
+        sitrep(SITREP_WARNING, "Ignoring stale map cache '%s'", path);
+        munmap(base, st.st_size);
+        return false;
+    }
+
+    cache->base = base;
+    cache->size = st.st_size;
+    cache->terrain = (terrain_names *)(base + map_cache_terrain_offset(num_chunks));
+    cache->chunk_num_towns = (u32 *)(base + map_cache_counts_offset());
+    cache->towns = (v2<u32> *)(base + towns_offset);
+    cache->num_towns = header->num_towns;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void map_cache_close(map_cache *cache) {
+#ifndef _WIN32
+    if (cache->base)
+        munmap(cache->base, cache->size);
+#endif
+    memset(cache, 0, sizeof(*cache));
+}
+
+// NOTE: Written under a temporary name and renamed into place, so matches
+// generating the same map at once never see half a file
+void map_cache_store(char *dir, u64 seed, u32 width, u32 height, u32 num_chunks,
+                     umax terrain_size, terrain_names *terrain, u32 *chunk_num_towns, v2<u32> *towns, u32 num_towns) {
+#ifndef _WIN32
+    char path[512], tmp_path[520];
+    map_cache_path(path, sizeof(path), dir, seed, width, height);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+    s32 fd = mkstemp(tmp_path);
+    if (fd < 0) {
+        sitrep(SITREP_WARNING, "Could not create map cache '%s'", tmp_path);
+        return;
+    }
+    fchmod(fd, 0644);
+
+    FILE *file = fdopen(fd, "wb");
+    map_cache_header header = {0};
+    header.magic = MAP_CACHE_MAGIC;
+    header.version = MAP_CACHE_VERSION;
+    header.seed = seed;
+    header.width = width;
+    header.height = height;
+    header.num_towns = num_towns;
+
+    u8 pad[8] = {0};
+    umax pad_size = map_cache_towns_offset(num_chunks, terrain_size) - map_cache_terrain_offset(num_chunks) - terrain_size;
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(chunk_num_towns, sizeof(*chunk_num_towns), num_chunks, file) == num_chunks &&
+              fwrite(terrain, 1, terrain_size, file) == terrain_size &&
+              fwrite(pad, 1, pad_size, file) == pad_size &&
+              fwrite(towns, sizeof(*towns), num_towns, file) == num_towns;
+    ok = fclose(file) == 0 && ok;
+
+    if (!ok || rename(tmp_path, path) != 0) {
+        sitrep(SITREP_WARNING, "Could not write map cache '%s'", path);
+        unlink(tmp_path);
+    }
+#endif
+}
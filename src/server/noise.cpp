@@ -0,0 +1,293 @@
+#define STB_PERLIN_IMPLEMENTATION
+#include "stb_perlin.h"
+
+// NOTE: Batched Perlin noise. A batch is a run of points that share y and z,
+// which is what a map row is, so only x varies across the lanes. The math
+// mirrors stb_perlin_noise3 operation for operation, so every path returns
+// the same values as the scalar reference up to float rounding.
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NOISE_X86 1
+#endif
+
+enum class noise_path_names {
+    SCALAR = 0,
+    SSE2,
+    AVX2
+};
+
+char *noise_path_strings[] = {"scalar", "sse2", "avx2"};
+
+// NOTE: stb keeps its tables in bytes and the gradients behind a second
+// lookup. Gathers want 32 bit entries, and resolving the gradient per hash
+// slot up front saves a dependent load per corner.
+static s32 noise_perm[512];
+static real32 noise_grad_x[512], noise_grad_y[512], noise_grad_z[512];
+static noise_path_names noise_path;
+static bool noise_is_init;
+
+// NOTE: Not thread safe, call it before handing batches to the pool
+void noise_init() {
+    if (noise_is_init)
+        return;
+
+    static real32 basis[12][3] = {
+        { 1, 1, 0}, {-1, 1, 0}, { 1,-1, 0}, {-1,-1, 0},
+        { 1, 0, 1}, {-1, 0, 1}, { 1, 0,-1}, {-1, 0,-1},
+        { 0, 1, 1}, { 0,-1, 1}, { 0, 1,-1}, { 0,-1,-1},
+    };
+    for (u32 i = 0; i < 512; ++i) {
+        noise_perm[i] = stb__perlin_randtab[i];
+        u32 grad_idx = stb__perlin_randtab_grad_idx[i];
+        noise_grad_x[i] = basis[grad_idx][0];
+        noise_grad_y[i] = basis[grad_idx][1];
+        noise_grad_z[i] = basis[grad_idx][2];
+    }
+
+#ifdef NOISE_X86
+    noise_path = __builtin_cpu_supports("avx2") ? noise_path_names::AVX2 : noise_path_names::SSE2;
+#else
+    noise_path = noise_path_names::SCALAR;
+#endif
+    noise_is_init = true;
+}
+
+// NOTE: The parts of a lattice lookup that only depend on the shared y and z
+struct noise_yz {
+    s32 y0, y1, z0, z1;
+    real32 y, z, v, w;
+};
+
+noise_yz noise_prepare_yz(real32 y, real32 z) {
+    noise_yz rv;
+    s32 py = stb__perlin_fastfloor(y);
+    s32 pz = stb__perlin_fastfloor(z);
+    rv.y0 = py & 255; rv.y1 = (py + 1) & 255;
+    rv.z0 = pz & 255; rv.z1 = (pz + 1) & 255;
+    y -= py; rv.v = stb__perlin_ease(y);
+    z -= pz; rv.w = stb__perlin_ease(z);
+    rv.y = y;
+    rv.z = z;
+    return rv;
+}
+
+void noise_fbm3_scalar(real32 *out, real32 *xs, u32 count, real32 y, real32 z,
+                       real32 lacunarity, real32 gain, u32 octaves) {
+    for (u32 i = 0; i < count; ++i) {
+        out[i] = stb_perlin_fbm_noise3(xs[i], y, z, lacunarity, gain, octaves);
+    }
+}
+
+#ifdef NOISE_X86
+__m128 noise_perlin3_sse2(__m128 x, noise_yz *yz, s32 seed) {
+    __m128i px = _mm_cvttps_epi32(x);
+    __m128 fx = _mm_cvtepi32_ps(px);
+    px = _mm_add_epi32(px, _mm_castps_si128(_mm_cmplt_ps(x, fx)));
+    x = _mm_sub_ps(x, _mm_cvtepi32_ps(px));
+
+    __m128 u = _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_sub_ps(_mm_mul_ps(x, _mm_set1_ps(6)), _mm_set1_ps(15)), x), _mm_set1_ps(10)), x), x), x);
+
+    // NOTE: SSE2 has no gather, the hashing goes through memory lane by lane
+    alignas(16) s32 x0[4];
+    _mm_store_si128((__m128i *)x0, px);
+    alignas(16) real32 g[3][8][4];
+    for (u32 lane = 0; lane < 4; ++lane) {
+        s32 r0 = noise_perm[((x0[lane]) & 255) + seed];
+        s32 r1 = noise_perm[((x0[lane] + 1) & 255) + seed];
+        s32 hashes[8] = {
+            noise_perm[r0 + yz->y0] + yz->z0, noise_perm[r0 + yz->y0] + yz->z1,
+            noise_perm[r0 + yz->y1] + yz->z0, noise_perm[r0 + yz->y1] + yz->z1,
+            noise_perm[r1 + yz->y0] + yz->z0, noise_perm[r1 + yz->y0] + yz->z1,
+            noise_perm[r1 + yz->y1] + yz->z0, noise_perm[r1 + yz->y1] + yz->z1,
+        };
+        for (u32 c = 0; c < 8; ++c) {
+            g[0][c][lane] = noise_grad_x[hashes[c]];
+            g[1][c][lane] = noise_grad_y[hashes[c]];
+            g[2][c][lane] = noise_grad_z[hashes[c]];
+        }
+    }
+
+    __m128 n[8];
+    for (u32 c = 0; c < 8; ++c) {
+        __m128 cx = (c & 4) ? _mm_sub_ps(x, _mm_set1_ps(1)) : x;
+        __m128 cy = _mm_set1_ps((c & 2) ? yz->y - 1 : yz->y);
+        __m128 cz = _mm_set1_ps((c & 1) ? yz->z - 1 : yz->z);
+        n[c] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_load_ps(g[0][c]), cx),
+                                     _mm_mul_ps(_mm_load_ps(g[1][c]), cy)),
+                          _mm_mul_ps(_mm_load_ps(g[2][c]), cz));
+    }
+
+    __m128 v = _mm_set1_ps(yz->v), w = _mm_set1_ps(yz->w);
+#define NOISE_LERP4(a, b, t) _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), t))
+    __m128 n00 = NOISE_LERP4(n[0], n[1], w);
+    __m128 n01 = NOISE_LERP4(n[2], n[3], w);
+    __m128 n10 = NOISE_LERP4(n[4], n[5], w);
+    __m128 n11 = NOISE_LERP4(n[6], n[7], w);
+    __m128 n0 = NOISE_LERP4(n00, n01, v);
+    __m128 n1 = NOISE_LERP4(n10, n11, v);
+    return NOISE_LERP4(n0, n1, u);
+#undef NOISE_LERP4
+}
+
+void noise_fbm3_sse2(real32 *out, real32 *xs, u32 count, real32 y, real32 z,
+                     real32 lacunarity, real32 gain, u32 octaves) {
+    u32 i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 x = _mm_loadu_ps(xs + i);
+        __m128 sum = _mm_setzero_ps();
+        real32 frequency = 1.0f, amplitude = 1.0f;
+        for (u32 octave = 0; octave < octaves; ++octave) {
+            noise_yz yz = noise_prepare_yz(y * frequency, z * frequency);
+            __m128 n = noise_perlin3_sse2(_mm_mul_ps(x, _mm_set1_ps(frequency)), &yz, (u8)octave);
+            sum = _mm_add_ps(sum, _mm_mul_ps(n, _mm_set1_ps(amplitude)));
+            frequency *= lacunarity;
+            amplitude *= gain;
+        }
+        _mm_storeu_ps(out + i, sum);
+    }
+    noise_fbm3_scalar(out + i, xs + i, count - i, y, z, lacunarity, gain, octaves);
+}
+
+// NOTE: The corner gradients of every lattice cell a batch touches. A row
+// of noise only spans a handful of cells per octave, and neighbouring lanes
+// almost always share one, so lanes pick from a few table entries with a
+// permute instead of walking the hash chain with gathers.
+#define NOISE_TABLE_CELLS 256
+
+struct noise_cell_table {
+    s32 first;
+    u32 cells;
+    // NOTE: Padded so 8 entries can always be loaded from any cell
+    real32 grad[3][8][NOISE_TABLE_CELLS + 8];
+};
+
+void noise_cell_table_build(noise_cell_table *table, s32 first, u32 cells, noise_yz *yz, s32 seed) {
+    table->first = first;
+    table->cells = cells;
+    for (u32 k = 0; k < cells + 8; ++k) {
+        s32 px = first + (s32)MIN(k, cells - 1);
+        s32 r0 = noise_perm[(px & 255) + seed];
+        s32 r1 = noise_perm[((px + 1) & 255) + seed];
+        s32 hashes[8] = {
+            noise_perm[r0 + yz->y0] + yz->z0, noise_perm[r0 + yz->y0] + yz->z1,
+            noise_perm[r0 + yz->y1] + yz->z0, noise_perm[r0 + yz->y1] + yz->z1,
+            noise_perm[r1 + yz->y0] + yz->z0, noise_perm[r1 + yz->y0] + yz->z1,
+            noise_perm[r1 + yz->y1] + yz->z0, noise_perm[r1 + yz->y1] + yz->z1,
+        };
+        for (u32 c = 0; c < 8; ++c) {
+            table->grad[0][c][k] = noise_grad_x[hashes[c]];
+            table->grad[1][c][k] = noise_grad_y[hashes[c]];
+            table->grad[2][c][k] = noise_grad_z[hashes[c]];
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+__m256 noise_perlin3_avx2(__m256 x, noise_yz *yz, noise_cell_table *table) {
+    __m256i px = _mm256_cvttps_epi32(x);
+    __m256 fx = _mm256_cvtepi32_ps(px);
+    px = _mm256_add_epi32(px, _mm256_castps_si256(_mm256_cmp_ps(x, fx, _CMP_LT_OQ)));
+    x = _mm256_sub_ps(x, _mm256_cvtepi32_ps(px));
+
+    __m256 u = _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_mul_ps(x, _mm256_set1_ps(6)), _mm256_set1_ps(15)), x), _mm256_set1_ps(10)), x), x), x);
+
+    __m256i k = _mm256_sub_epi32(px, _mm256_set1_epi32(table->first));
+    s32 base = _mm256_cvtsi256_si32(k);
+    __m256i rel = _mm256_sub_epi32(k, _mm256_set1_epi32(base));
+    __m256i seven = _mm256_set1_epi32(7);
+    bool close = _mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_min_epu32(rel, seven), rel)) == -1;
+
+    __m256 n[8];
+    for (u32 c = 0; c < 8; ++c) {
+        __m256 g[3];
+        for (u32 axis = 0; axis < 3; ++axis) {
+            real32 *grad = table->grad[axis][c];
+            if (close)
+                g[axis] = _mm256_permutevar8x32_ps(_mm256_loadu_ps(grad + base), rel);
+            else
+                g[axis] = _mm256_i32gather_ps(grad, k, 4);
+        }
+
+        __m256 cx = (c & 4) ? _mm256_sub_ps(x, _mm256_set1_ps(1)) : x;
+        __m256 cy = _mm256_set1_ps((c & 2) ? yz->y - 1 : yz->y);
+        __m256 cz = _mm256_set1_ps((c & 1) ? yz->z - 1 : yz->z);
+        n[c] = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(g[0], cx), _mm256_mul_ps(g[1], cy)),
+                             _mm256_mul_ps(g[2], cz));
+    }
+
+    __m256 v = _mm256_set1_ps(yz->v), w = _mm256_set1_ps(yz->w);
+#define NOISE_LERP8(a, b, t) _mm256_add_ps(a, _mm256_mul_ps(_mm256_sub_ps(b, a), t))
+    __m256 n00 = NOISE_LERP8(n[0], n[1], w);
+    __m256 n01 = NOISE_LERP8(n[2], n[3], w);
+    __m256 n10 = NOISE_LERP8(n[4], n[5], w);
+    __m256 n11 = NOISE_LERP8(n[6], n[7], w);
+    __m256 n0 = NOISE_LERP8(n00, n01, v);
+    __m256 n1 = NOISE_LERP8(n10, n11, v);
+    return NOISE_LERP8(n0, n1, u);
+#undef NOISE_LERP8
+}
+
+__attribute__((target("avx2")))
+void noise_fbm3_avx2(real32 *out, real32 *xs, u32 count, real32 y, real32 z,
+                     real32 lacunarity, real32 gain, u32 octaves) {
+    u32 batched = count & ~7u;
+    real32 x_min = 0, x_max = 0;
+    for (u32 i = 0; i < batched; ++i) {
+        x_min = i ? MIN(x_min, xs[i]) : xs[i];
+        x_max = i ? MAX(x_max, xs[i]) : xs[i];
+    }
+
+    noise_cell_table table;
+    for (u32 i = 0; i < batched; ++i) {
+        out[i] = 0;
+    }
+
+    real32 frequency = 1.0f, amplitude = 1.0f;
+    for (u32 octave = 0; octave < octaves && batched; ++octave) {
+        s32 first = stb__perlin_fastfloor(x_min * frequency);
+        s32 last = stb__perlin_fastfloor(x_max * frequency);
+        if ((u32)(last - first) >= NOISE_TABLE_CELLS) {
+            // NOTE: Too spread out for a table, which no map row ever is
+            noise_fbm3_sse2(out, xs, count, y, z, lacunarity, gain, octaves);
+            return;
+        }
+
+        noise_yz yz = noise_prepare_yz(y * frequency, z * frequency);
+        noise_cell_table_build(&table, first, last - first + 1, &yz, (u8)octave);
+
+        __m256 f = _mm256_set1_ps(frequency), a = _mm256_set1_ps(amplitude);
+        for (u32 i = 0; i < batched; i += 8) {
+            __m256 n = noise_perlin3_avx2(_mm256_mul_ps(_mm256_loadu_ps(xs + i), f), &yz, &table);
+            _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(out + i), _mm256_mul_ps(n, a)));
+        }
+        frequency *= lacunarity;
+        amplitude *= gain;
+    }
+    noise_fbm3_sse2(out + batched, xs + batched, count - batched, y, z, lacunarity, gain, octaves);
+}
+#endif
+
+// NOTE: out[i] = stb_perlin_fbm_noise3(xs[i], y, z, lacunarity, gain, octaves).
+// One octave is plain stb_perlin_noise3.
+void noise_fbm3_with(noise_path_names path, real32 *out, real32 *xs, u32 count, real32 y, real32 z,
+                     real32 lacunarity, real32 gain, u32 octaves) {
+    switch (path) {
+#ifdef NOISE_X86
+        case noise_path_names::AVX2:
+            noise_fbm3_avx2(out, xs, count, y, z, lacunarity, gain, octaves);
+            break;
+        case noise_path_names::SSE2:
+            noise_fbm3_sse2(out, xs, count, y, z, lacunarity, gain, octaves);
+            break;
+#endif
+        default:
+            noise_fbm3_scalar(out, xs, count, y, z, lacunarity, gain, octaves);
+            break;
+    }
+}
+
+void noise_fbm3(real32 *out, real32 *xs, u32 count, real32 y, real32 z,
+                real32 lacunarity, real32 gain, u32 octaves) {
+    noise_fbm3_with(noise_path, out, xs, count, y, z, lacunarity, gain, octaves);
+}
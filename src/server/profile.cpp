@@ -0,0 +1,157 @@
+// NOTE: Where the ticks of a match go. Stages of server_update and every
+// client message are timed with CLOCK_MONOTONIC_RAW into log-linear
+// histograms, eight buckets per power of two of nanoseconds, so a
+// percentile read back is at most an eighth too high. Times include
+// whatever the stage calls, vision inside a move counts for both. With
+// config.profile off a stage costs one branch.
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+#define PROFILE_SUB_BITS 3
+#define PROFILE_BUCKETS 368
+
+enum profile_names : u32 {
+    PROFILE_TICK = 0,
+    PROFILE_RECEIVE,
+    PROFILE_HANDLE,
+    PROFILE_TURN_ROLLOVER,
+    PROFILE_VISION,
+    PROFILE_MOVE,
+    PROFILE_KEYFRAME,
+    PROFILE_JOURNAL_COMMIT,
+    PROFILE_SEND,
+
+    // NOTE: One per comm_client_msg_names from here
+    PROFILE_MESSAGES
+};
+
+#define PROFILE_NUM_MESSAGES ((u32)comm_client_msg_names::MOVE_PATH + 1)
+#define PROFILE_COUNT (PROFILE_MESSAGES + PROFILE_NUM_MESSAGES)
+
+char *profile_strings[PROFILE_COUNT] = {
+    "tick", "receive", "handle", "turn rollover", "vision", "move", "keyframe", "journal commit", "send",
+    "CONNECT", "START", "PONG", "ADMIN_DISCOVER_ENTIRE_MAP", "ADMIN_ADD_UNIT", "END_TURN",
+    "SET_CONSTRUCTION", "MOVE_UNIT", "LOAD_UNIT", "UNLOAD_UNIT", "SYNC_ACK", "MOVE_PATH"
+};
+
+struct profile_histogram {
+    u32 counts[PROFILE_BUCKETS];
+    u32 count;
+    u64 total_ns, max_ns;
+};
+
+struct server_profile {
+    // NOTE: Follows config.profile, set at the start of every tick
+    bool enabled;
+    profile_histogram histograms[PROFILE_COUNT];
+};
+
+u64 profile_now() {
+#ifndef _WIN32
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#else
+    return 0;
+#endif
+}
+
+u32 profile_bucket(u64 ns) {
+    if (ns < (2u << PROFILE_SUB_BITS))
+        return (u32)ns;
+    u32 shift = find_most_significant_set_bit(ns) - PROFILE_SUB_BITS;
+    u64 bucket = ((u64)shift << PROFILE_SUB_BITS) + (ns >> shift);
+    return (u32)MIN(bucket, (u64)PROFILE_BUCKETS - 1);
+}
+
+// NOTE: The largest time that lands in the bucket
+u64 profile_bucket_limit(u32 bucket) {
+    if (bucket < (2u << PROFILE_SUB_BITS))
+        return bucket;
+    u32 shift = (bucket >> PROFILE_SUB_BITS) - 1;
+    u64 mantissa = (bucket & ((1u << PROFILE_SUB_BITS) - 1)) + (1u << PROFILE_SUB_BITS);
+    return ((mantissa + 1) << shift) - 1;
+}
+
+// NOTE: 0 when disabled, which profile_end then ignores
+u64 profile_begin(server_profile *p) {
+    return p->enabled ? profile_now() : 0;
+}
+
+void profile_end(server_profile *p, u32 id, u64 start) {
+    if (!start)
+        return;
+
+    u64 ns = profile_now() - start;
+    profile_histogram *h = &p->histograms[id];
+    ++h->counts[profile_bucket(ns)];
+    ++h->count;
+    h->total_ns += ns;
+    h->max_ns = MAX(h->max_ns, ns);
+}
+
+// NOTE: Times the rest of the enclosing block
+struct profile_scope {
+    server_profile *p;
+    u32 id;
+    u64 start;
+
+    profile_scope(server_profile *p, u32 id) : p(p), id(id), start(profile_begin(p)) {}
+    ~profile_scope() { profile_end(p, id, start); }
+};
+
+#define PROFILE_SCOPE(p, id) profile_scope profile_scope_##id((p), (id))
+
+u64 profile_percentile(profile_histogram *h, real32 q) {
+    u64 target = (u64)ceilf(q * h->count);
+    u64 seen = 0;
+    for (u32 b = 0; b < PROFILE_BUCKETS; ++b) {
+        seen += h->counts[b];
+        if (seen >= MAX(target, 1))
+            return MIN(profile_bucket_limit(b), h->max_ns);
+    }
+    return h->max_ns;
+}
+
+// NOTE: Histograms add up, so several matches report as one
+void profile_merge(server_profile *into, server_profile *from) {
+    for (u32 i = 0; i < PROFILE_COUNT; ++i) {
+        profile_histogram *a = &into->histograms[i], *b = &from->histograms[i];
+        for (u32 k = 0; k < PROFILE_BUCKETS; ++k) {
+            a->counts[k] += b->counts[k];
+        }
+        a->count += b->count;
+        a->total_ns += b->total_ns;
+        a->max_ns = MAX(a->max_ns, b->max_ns);
+    }
+}
+
+void profile_reset(server_profile *p) {
+    memset(p->histograms, 0, sizeof(p->histograms));
+}
+
+// NOTE: Heaviest first by total time, with each one's share of the ticks
+void profile_report(server_profile *p) {
+    u32 order[PROFILE_COUNT];
+    u32 num = 0;
+    for (u32 i = 0; i < PROFILE_COUNT; ++i) {
+        if (p->histograms[i].count == 0)
+            continue;
+
+        u32 at = num++;
+        for (; at > 0 && p->histograms[order[at - 1]].total_ns < p->histograms[i].total_ns; --at) {
+            order[at] = order[at - 1];
+        }
+        order[at] = i;
+    }
+
+    u64 tick_ns = p->histograms[PROFILE_TICK].total_ns;
+    for (u32 i = 0; i < num; ++i) {
+        profile_histogram *h = &p->histograms[order[i]];
+        sitrep(SITREP_INFO, "  %-26s %9u x  p50 %9.1f us  p99 %9.1f us  max %9.1f us  %5.1f%% of ticks",
+               profile_strings[order[i]], h->count,
+               profile_percentile(h, 0.5f) / 1000.0f, profile_percentile(h, 0.99f) / 1000.0f,
+               h->max_ns / 1000.0f, tick_ns ? 100.0f * h->total_ns / tick_ns : 0.0f);
+    }
+}
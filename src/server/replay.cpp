@@ -0,0 +1,269 @@
+// NOTE: Runs a journal headless, as fast as the commands go. The match is
+// loaded from the last keyframe at or before the wanted turn and every
+// command journaled after it and before that turn is handled again, with
+// whatever the server says going nowhere.
+#define REPLAY_COMM_BUFFER_SIZE MB(4)
+#define REPLAY_KEYFRAME_FALLBACKS 8
+
+COMM_SEND(replay_send) {
+}
+
+COMM_RECV(replay_recv) {
+    return 0;
+}
+
+// NOTE: Stops at the start of turn, 0xFFFFFFFF runs the whole journal.
+// With a save_path the state it ends in is saved there.
+bool server_replay(char *journal_path, u32 turn, char *save_path) {
+#ifndef _WIN32
+    s32 fd = open(journal_path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (umax)st.st_size < sizeof(journal_header)) {
+        sitrep(SITREP_ERROR, "Could not read journal '%s'", journal_path);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    u8 *base = (u8 *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return false;
+
+    umax size = st.st_size;
+    journal_header *header = (journal_header *)base;
+    if (header->magic != JOURNAL_MAGIC || header->version != JOURNAL_VERSION) {
+        sitrep(SITREP_ERROR, "'%s' is not a journal", journal_path);
+        munmap(base, size);
+        return false;
+    }
+
+    // NOTE: A record cut short by a crash ends the journal. The last few
+    // keyframes are kept in case the newest ones never got written.
+    umax starts[REPLAY_KEYFRAME_FALLBACKS];
+    u32 keyframe_turns[REPLAY_KEYFRAME_FALLBACKS];
+    u32 num_keyframes = 0;
+    for (umax at = sizeof(*header); at + sizeof(journal_record) <= size;) {
+        journal_record *record = (journal_record *)(base + at);
+        if (at + sizeof(*record) + record->size > size || record->turn > turn)
+            break;
+        at += sizeof(*record) + record->size;
+        if (record->name == JOURNAL_KEYFRAME) {
+            starts[num_keyframes % REPLAY_KEYFRAME_FALLBACKS] = at;
+            keyframe_turns[num_keyframes % REPLAY_KEYFRAME_FALLBACKS] = record->turn;
+            ++num_keyframes;
+        }
+    }
+
+    memory_arena mem = {0};
+    mem.name = "replay_memory";
+    server_config config = {0};
+    umax start = 0;
+    u32 keyframe_turn = 0;
+    real32 load_start = match_host_now_in_ms();
+    for (u32 k = num_keyframes; k > 0 && num_keyframes - k < REPLAY_KEYFRAME_FALLBACKS; --k) {
+        char keyframe_path[512];
+        keyframe_turn = keyframe_turns[(k - 1) % REPLAY_KEYFRAME_FALLBACKS];
+        journal_keyframe_path(keyframe_path, sizeof(keyframe_path), journal_path, keyframe_turn);
+        if (server_load(&mem, keyframe_path, header->num_clients, config)) {
+            start = starts[(k - 1) % REPLAY_KEYFRAME_FALLBACKS];
+            break;
+        }
+        sitrep(SITREP_WARNING, "Could not load keyframe '%s'", keyframe_path);
+    }
+    if (!start) {
+        sitrep(SITREP_ERROR, "Journal '%s' has no keyframe before turn %u", journal_path, turn);
+        munmap(base, size);
+        return false;
+    }
+    real32 load_ms = match_host_now_in_ms() - load_start;
+
+    server_context *ctx = (server_context *)mem.base;
+    for (u32 i = 1; i < ctx->clients.used; ++i) {
+        communication *comm = &ctx->clients.comms[i];
+        memset(comm, 0, sizeof(*comm));
+        comm->send = replay_send;
+        comm->recv = replay_recv;
+        comm->buffer.name = "replay_comm";
+        comm->buffer.max = REPLAY_COMM_BUFFER_SIZE;
+        comm->buffer.base = (u8 *)malloc(REPLAY_COMM_BUFFER_SIZE);
+        comm->buffer.used = sizeof(comm_shared_header);
+        assert(comm->buffer.base);
+        ctx->clients.connecteds[i] = true;
+    }
+    ctx->reattach = false;
+    ctx->resumed = false;
+    ctx->current_state = server_state_names::LOOP;
+
+    u8 packet[sizeof(comm_shared_header) + KB(1)] = {0};
+    u32 num_commands = 0;
+    real32 replay_start = match_host_now_in_ms();
+    for (umax at = start; at + sizeof(journal_record) <= size;) {
+        journal_record *record = (journal_record *)(base + at);
+        if (at + sizeof(*record) + record->size > size || record->turn >= turn)
+            break;
+        at += sizeof(*record) + record->size;
+        if (record->name != JOURNAL_COMMAND || record->size > sizeof(packet) - sizeof(comm_shared_header) ||
+            record->client == 0 || record->client >= ctx->clients.used)
+            continue;
+
+        memcpy(packet + sizeof(comm_shared_header), record + 1, record->size);
+        server_handle_packet(ctx, &mem, record->client, packet, sizeof(comm_shared_header) + record->size);
+        ++num_commands;
+
+        for (u32 i = 1; i < ctx->clients.used; ++i) {
+            outbound_flush(ctx, i);
+            ctx->clients.comms[i].buffer.used = sizeof(comm_shared_header);
+        }
+        ctx->temp_buffer.used = 0;
+    }
+    real32 replay_ms = match_host_now_in_ms() - replay_start;
+
+    u32 num_entities = ctx->map.entities.length();
+    sitrep(SITREP_INFO, "Keyframe of turn %u loaded in %.2f ms", keyframe_turn, load_ms);
+    sitrep(SITREP_INFO, "Replayed %u commands in %.2f ms (%.0f/s), now at turn %u with %u entities",
+           num_commands, replay_ms, replay_ms > 0 ? num_commands / (replay_ms / 1000.0f) : 0.0f,
+           ctx->turn_number, num_entities);
+
+    bool ok = true;
+    if (save_path) {
+        ok = server_save(&mem, save_path);
+        if (ok)
+            sitrep(SITREP_INFO, "Saved to '%s'", save_path);
+    }
+
+    for (u32 i = 1; i < ctx->clients.used; ++i) {
+        free(ctx->clients.comms[i].buffer.base);
+    }
+    server_unload(&mem);
+    munmap(base, size);
+    return ok;
+#else
+    return false;
+#endif
+}
+
+// NOTE: Feeds what clients sent in a --capture back to fresh matches and
+// times the handlers on that mix of packets. Every num_clients captured
+// connections make a match, in the order they started, so the matches
+// need the --seed, --map and --clients of the captured run to see the
+// same world. At maximum speed the server's clock is the capture's and a
+// tick runs whenever the next packet is due, otherwise ticks run
+// tick_rate times a second of wall clock.
+bool server_replay_capture(char *path, bool max_speed, server_config config, u32 num_clients,
+                           u32 tick_rate, job_pool *pool) {
+#ifndef _WIN32
+    memory_arena mem = {0};
+    mem.name = "replay_capture_memory";
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        sitrep(SITREP_ERROR, "Could not open capture file '%s'", path);
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    umax capture_size = ftell(file);
+    fclose(file);
+
+    comm_replay replay;
+    comm_replay_speeds speed = max_speed ? comm_replay_speeds::MAXIMUM : comm_replay_speeds::ORIGINAL;
+    mem.max = capture_size * 2 + MB(1);
+    mem.base = (u8 *)calloc(1, mem.max);
+    assert(mem.base);
+    if (!comm_replay_open(&replay, path, speed, &mem)) {
+        free(mem.base);
+        return false;
+    }
+
+    u32 num_matches = (replay.num_connections + num_clients - 1) / num_clients;
+    if (num_matches == 0) {
+        sitrep(SITREP_ERROR, "'%s' holds no received packets", path);
+        free(mem.base);
+        return false;
+    }
+
+    // NOTE: Handler time comes from the profile
+    config.profile = true;
+    if (num_matches == 1)
+        config.pool = pool;
+
+    match_host host;
+    match_host_init(&host, num_matches, pool);
+    comm_replay_link *links = (comm_replay_link *)calloc(num_matches * num_clients, sizeof(*links));
+    u8 *buffers = (u8 *)calloc(num_matches * num_clients, REPLAY_COMM_BUFFER_SIZE);
+    assert(links && buffers);
+    for (u32 m = 0; m < num_matches; ++m) {
+        communication comms[SERVER_CLIENT_SLOTS] = {0};
+        for (u32 i = 0; i < num_clients; ++i) {
+            u32 id = m * num_clients + i;
+            memory_arena buffer = {buffers + (umax)id * REPLAY_COMM_BUFFER_SIZE, REPLAY_COMM_BUFFER_SIZE, 0, "replay_comm"};
+            comm_replay_init(&comms[i], &links[id], &replay, (u16)id, buffer);
+        }
+        if (match_host_add(&host, comms, num_clients, config) < 0) {
+            sitrep(SITREP_ERROR, "No room for match %u of the capture", m);
+            match_host_release(&host);
+            free(buffers);
+            free(links);
+            free(mem.base);
+            return false;
+        }
+    }
+
+    if (max_speed)
+        comm_sim_virtual_clock = true;
+
+    u32 tick_us = 1000000 / tick_rate;
+    real32 start = match_host_now_in_ms();
+    u32 ticks = 0;
+    for (;;) {
+        comm_replay_step(&replay);
+        if (max_speed)
+            comm_sim_now = replay.now;
+
+        bool running = false;
+        for (u32 m = 0; m < num_matches; ++m) {
+            if (!host.matches[m].finished) {
+                match_host_mark_pending(&host, m);
+                running = true;
+            }
+        }
+        if (!running || comm_replay_done(&replay))
+            break;
+
+        match_host_tick(&host);
+        ++ticks;
+        if (!max_speed)
+            usleep(tick_us);
+    }
+    real32 elapsed_ms = match_host_now_in_ms() - start;
+    comm_sim_virtual_clock = false;
+
+    real32 tick_ms = 0;
+    for (u32 m = 0; m < num_matches; ++m) {
+        tick_ms += host.matches[m].stats.total_tick_ms;
+    }
+
+    comm_replay_stats stats = {0};
+    for (u32 i = 0; i < num_matches * num_clients; ++i) {
+        stats.packets += links[i].stats.packets;
+        stats.bytes += links[i].stats.bytes;
+        stats.sent_packets += links[i].stats.sent_packets;
+        stats.sent_bytes += links[i].stats.sent_bytes;
+    }
+
+    match_host_report(&host);
+    real32 handle_ms = host.profile.histograms[PROFILE_HANDLE].total_ns / 1.0e6f;
+    sitrep(SITREP_INFO, "Replayed %u packets (%u KB) to %u matches in %u ticks, %.1f s of capture in %.1f ms",
+           stats.packets, stats.bytes / 1024, num_matches, ticks, replay.now / 1000.0f, elapsed_ms);
+    sitrep(SITREP_INFO, "  ticks %.1f ms, %.0f packets/s, handlers %.1f ms, %.0f packets/s, %u packets sent back",
+           tick_ms, tick_ms > 0 ? stats.packets / (tick_ms / 1000.0f) : 0.0f,
+           handle_ms, handle_ms > 0 ? stats.packets / (handle_ms / 1000.0f) : 0.0f,
+           stats.sent_packets);
+
+    match_host_release(&host);
+    free(buffers);
+    free(links);
+    free(mem.base);
+    return true;
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,386 @@
+// NOTE: A saved match is its arena as it was between two ticks. The file is
+// a page sized header, the arena image up to what was used and then the
+// offsets of the entities in list order. The tick scratch is left out as a
+// hole. Pointers in the image still hold the addresses of the saving
+// process, loading maps the image as a new arena and moves every pointer
+// by the distance between the two bases, nothing is parsed per entity.
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#endif
+
+#define SAVE_MAGIC 0x5341414D
+#define SAVE_VERSION 1
+#define SAVE_PAGE_SIZE KB(4)
+
+struct save_header {
+    u32 magic;
+    u32 version;
+
+    // NOTE: A different build may lay the structs out differently
+    u32 context_size, unit_size, structure_size;
+    u32 num_entities;
+
+    u64 base;
+    u64 used, max;
+    u64 temp_offset, temp_size;
+    u64 entities_offset;
+};
+
+struct save_relocation {
+    u8 *old_base, *new_base;
+};
+
+template <class T>
+void save_relocate(save_relocation *r, T **pointer) {
+    if (*pointer)
+        *pointer = (T *)(r->new_base + ((u8 *)*pointer - r->old_base));
+}
+
+void save_relocate_timers(save_relocation *r, timer_event **list) {
+    save_relocate(r, list);
+    for (timer_event *event = *list; event; event = event->next) {
+        save_relocate(r, &event->prev);
+        save_relocate(r, &event->next);
+        save_relocate(r, &event->list);
+        save_relocate(r, &event->data);
+    }
+}
+
+umax save_align(umax size) {
+    return (size + SAVE_PAGE_SIZE - 1) & ~(umax)(SAVE_PAGE_SIZE - 1);
+}
+
+#ifndef _WIN32
+bool save_write(s32 fd, void *data, umax size, umax offset) {
+    u8 *bytes = (u8 *)data;
+    while (size > 0) {
+        ssize_t written = pwrite(fd, bytes, size, offset);
+        if (written <= 0)
+            return false;
+        bytes += written;
+        size -= written;
+        offset += written;
+    }
+    return true;
+}
+#endif
+
+// NOTE: Call between ticks. Written under a temporary name and renamed into
+// place, so a crash mid save keeps the previous one.
+bool server_save(memory_arena *mem, char *path) {
+#ifndef _WIN32
+    server_context *ctx = (server_context *)mem->base;
+    if (!ctx->is_init)
+        return false;
+
+    char tmp_path[520];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+    s32 fd = mkstemp(tmp_path);
+    if (fd < 0) {
+        sitrep(SITREP_WARNING, "Could not create save '%s'", tmp_path);
+        return false;
+    }
+    fchmod(fd, 0644);
+
+    save_header header = {0};
+    header.magic = SAVE_MAGIC;
+    header.version = SAVE_VERSION;
+    header.context_size = sizeof(server_context);
+    header.unit_size = sizeof(unit);
+    header.structure_size = sizeof(structure);
+    header.base = (u64)(uintptr_t)mem->base;
+    header.used = mem->used;
+    header.max = mem->max;
+    header.temp_offset = ctx->temp_buffer.base - mem->base;
+    header.temp_size = ctx->temp_buffer.max;
+    header.num_entities = ctx->map.entities.length();
+    header.entities_offset = SAVE_PAGE_SIZE + save_align(mem->used);
+
+    umax temp_end = header.temp_offset + header.temp_size;
+    bool ok = save_write(fd, &header, sizeof(header), 0) &&
+              save_write(fd, mem->base, header.temp_offset, SAVE_PAGE_SIZE) &&
+              save_write(fd, mem->base + temp_end, mem->used - temp_end, SAVE_PAGE_SIZE + temp_end);
+
+    // NOTE: Terrain from the map cache goes where the arena kept room for it
+    if (ok && ctx->map.cache.base) {
+        umax terrain_size = (umax)ctx->map.chunks_x * ctx->map.chunks_y * MAP_CHUNK_TILES;
+        ok = save_write(fd, ctx->map.terrain, terrain_size,
+                        SAVE_PAGE_SIZE + ((u8 *)ctx->map.terrain_storage - mem->base));
+    }
+
+    if (ok) {
+        u64 *offsets = (u64 *)malloc(sizeof(*offsets) * MAX(header.num_entities, 1));
+        assert(offsets);
+        u32 num = 0;
+        for (auto iter = ctx->map.entities.first; iter; iter = iter->next) {
+            offsets[num++] = (u8 *)iter->payload - mem->base;
+        }
+        ok = save_write(fd, offsets, sizeof(*offsets) * num, header.entities_offset);
+        free(offsets);
+    }
+
+    ok = fsync(fd) == 0 && ok;
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(tmp_path, path) != 0) {
+        sitrep(SITREP_WARNING, "Could not write save '%s'", path);
+        unlink(tmp_path);
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+// NOTE: Saves from a forked child, whose copy-on-write view of the arena
+// stays as it was at the fork while the caller keeps ticking. Only the
+// pages either side writes to meanwhile get copied. Returns the child's
+// pid, -1 if it could not fork.
+s32 server_save_fork(memory_arena *mem, char *path) {
+#ifndef _WIN32
+    pid_t pid = fork();
+    if (pid == 0) {
+        bool ok = server_save(mem, path);
+        journal_sync_dir(path);
+        _exit(ok ? 0 : 1);
+    }
+    return pid;
+#else
+    return -1;
+#endif
+}
+
+// NOTE: 0 while the child is still writing, 1 once the save is in place,
+// -1 if it failed
+s32 server_save_fork_done(s32 pid, bool wait) {
+#ifndef _WIN32
+    int status;
+    pid_t rv = waitpid(pid, &status, wait ? 0 : WNOHANG);
+    if (rv == 0)
+        return 0;
+    return rv == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 1 : -1;
+#else
+    return -1;
+#endif
+}
+
+// NOTE: Minor faults of the whole process so far. While a child shares
+// the arena they include its copied pages, but also the faults of every
+// other match and thread and first touches of fresh arena pages.
+u64 save_minor_faults() {
+#ifndef _WIN32
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt;
+#else
+    return 0;
+#endif
+}
+
+// NOTE: How big the arena of the saved match is, 0 if it is not a save
+umax server_save_memory_size(char *path) {
+#ifndef _WIN32
+    s32 fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    save_header header;
+    bool ok = pread(fd, &header, sizeof(header), 0) == sizeof(header);
+    close(fd);
+    if (!ok || header.magic != SAVE_MAGIC || header.version != SAVE_VERSION)
+        return 0;
+    return header.max;
+#else
+    return 0;
+#endif
+}
+
+// NOTE: Maps the save privately as the match's arena, so only the pages
+// the fixups and later ticks touch are read or copied. The match needs as
+// many clients as it was saved with, the next server_update takes their
+// comms. Free the arena with server_unload.
+bool server_load(memory_arena *mem, char *path, u32 num_comms, server_config config) {
+#ifndef _WIN32
+    s32 fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    save_header header;
+    struct stat st;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || fstat(fd, &st) != 0 ||
+        header.magic != SAVE_MAGIC || header.version != SAVE_VERSION ||
+        header.context_size != sizeof(server_context) || header.unit_size != sizeof(unit) ||
+        header.structure_size != sizeof(structure) ||
+        header.used > header.max || header.temp_offset + header.temp_size > header.used ||
+        header.entities_offset != SAVE_PAGE_SIZE + save_align(header.used) ||
+        (umax)st.st_size < header.entities_offset + sizeof(u64) * header.num_entities) {
+        sitrep(SITREP_WARNING, "'%s' is not a save of this build", path);
+        close(fd);
+        return false;
+    }
+
+    // NOTE: The room past the image stays anonymous, so the arena still
+    // hands out zeroed memory
+    u8 *base = (u8 *)mmap(NULL, header.max, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    if (header.used > 0 &&
+        mmap(base, save_align(header.used), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+             fd, SAVE_PAGE_SIZE) == MAP_FAILED) {
+        munmap(base, header.max);
+        close(fd);
+        return false;
+    }
+
+    umax offsets_size = sizeof(u64) * MAX(header.num_entities, 1);
+    u64 *offsets = (u64 *)mmap(NULL, offsets_size, PROT_READ, MAP_PRIVATE, fd, header.entities_offset);
+    close(fd);
+    if (offsets == MAP_FAILED) {
+        munmap(base, header.max);
+        return false;
+    }
+
+    server_context *ctx = (server_context *)base;
+    if (ctx->clients.used != num_comms + 1) {
+        sitrep(SITREP_WARNING, "Save '%s' has %u clients, not %u", path, ctx->clients.used - 1, num_comms);
+        munmap(offsets, offsets_size);
+        munmap(base, header.max);
+        return false;
+    }
+
+    mem->base = base;
+    mem->max = header.max;
+    mem->used = header.used;
+
+    save_relocation r = {(u8 *)(uintptr_t)header.base, base};
+    ctx->memory = mem;
+    save_relocate(&r, &ctx->temp_buffer.base);
+    ctx->temp_buffer.used = 0;
+    ctx->temp_buffer.name = "server_memory_temp";
+
+    // NOTE: Everything about the map comes from the save, the rest of the
+    // config belongs to the process loading it
+    config.map_width = ctx->config.map_width;
+    config.map_height = ctx->config.map_height;
+    config.map_seed = ctx->config.map_seed;
+    config.delta_sync = ctx->config.delta_sync;
+    config.max_packets_per_tick = ctx->config.max_packets_per_tick;
+    memcpy(config.sight_radius, ctx->config.sight_radius, sizeof(config.sight_radius));
+    ctx->config = config;
+
+    save_relocate(&r, &ctx->map.terrain_storage);
+    if (ctx->map.cache.base) {
+        ctx->map.terrain = ctx->map.terrain_storage;
+        memset(&ctx->map.cache, 0, sizeof(ctx->map.cache));
+    } else {
+        save_relocate(&r, &ctx->map.terrain);
+    }
+    save_relocate(&r, &ctx->map.chunk_generated);
+    save_relocate(&r, &ctx->map.islands);
+    save_relocate(&r, &ctx->map.chunk_island_offsets);
+    save_relocate(&r, &ctx->map.chunk_islands);
+    save_relocate(&r, &ctx->map.chunk_num_towns);
+    save_relocate(&r, &ctx->map.chunk_towns);
+    save_relocate(&r, &ctx->map.chunk_units);
+    save_relocate(&r, &ctx->map.observers);
+    u32 num_chunks = ctx->map.chunks_x * ctx->map.chunks_y;
+    for (u32 c = 0; c < num_chunks; ++c) {
+        save_relocate(&r, &ctx->map.chunk_units[c]);
+        structure **towns = ctx->map.chunk_towns + (umax)c * ctx->map.towns_per_chunk;
+        for (u32 t = 0; t < ctx->map.chunk_num_towns[c]; ++t) {
+            save_relocate(&r, &towns[t]);
+        }
+    }
+
+    // NOTE: Rebuilt back to front, so push_front keeps the saved order
+    ctx->map.entities.first = NULL;
+    for (u32 i = header.num_entities; i > 0; --i) {
+        entity *ent = (entity *)(base + offsets[i - 1]);
+        save_relocate(&r, &ent->owned_prev);
+        save_relocate(&r, &ent->owned_next);
+        if (ent->type == entity_types::UNIT) {
+            save_relocate(&r, &ent->chunk_prev);
+            save_relocate(&r, &ent->chunk_next);
+            save_relocate(&r, &((unit *)ent)->slot);
+            save_relocate(&r, &((unit *)ent)->loaded_by);
+        } else {
+            save_relocate(&r, &((structure *)ent)->construction_event);
+        }
+        ctx->map.entities.push_front(ent);
+    }
+    munmap(offsets, offsets_size);
+
+    save_relocate(&r, &ctx->clients.discovered_map);
+    save_relocate(&r, &ctx->clients.vision);
+    save_relocate(&r, &ctx->clients.sync);
+    save_relocate(&r, &ctx->clients.comms);
+    save_relocate(&r, &ctx->clients.inbound);
+    save_relocate(&r, &ctx->clients.outbound);
+    save_relocate(&r, &ctx->clients.admins);
+    save_relocate(&r, &ctx->clients.connecteds);
+    save_relocate(&r, &ctx->clients.owned_units);
+    save_relocate(&r, &ctx->clients.owned_towns);
+    for (u32 i = 0; i < ctx->clients.max; ++i) {
+        save_relocate(&r, &ctx->clients.owned_units[i]);
+        save_relocate(&r, &ctx->clients.owned_towns[i]);
+        save_relocate(&r, &ctx->clients.discovered_map[i]);
+        save_relocate(&r, &ctx->clients.vision[i]);
+        save_relocate(&r, &ctx->clients.inbound[i].buffer);
+        save_relocate(&r, &ctx->clients.inbound[i].lens);
+        ctx->clients.inbound[i].num_packets = 0;
+
+        // NOTE: A keyframe taken mid tick may hold news for the old
+        // connections, the reconnected clients are sent everything anyway
+        server_outbound *outbound = &ctx->clients.outbound[i];
+        save_relocate(&r, &outbound->staged);
+        save_relocate(&r, &outbound->table);
+        for (u32 k = 0; k < outbound->num_staged; ++k) {
+            outbound->table[outbound->staged[k].slot] = 0;
+        }
+        outbound->num_staged = 0;
+
+        // NOTE: Snapshots live on the heap of the saving process, the
+        // reconnected clients start over without a baseline
+        memset(&ctx->clients.sync[i], 0, sizeof(ctx->clients.sync[i]));
+        ctx->clients.sync[i].next_id = COMM_SYNC_NO_BASELINE + 1;
+    }
+    ctx->reattach = true;
+
+    timer_wheel *timers = &ctx->timers;
+    for (u32 i = 0; i < TIMER_WHEEL_SLOTS; ++i) {
+        save_relocate_timers(&r, &timers->near[i]);
+        save_relocate_timers(&r, &timers->far[i]);
+    }
+    save_relocate_timers(&r, &timers->overflow);
+    save_relocate_timers(&r, &timers->free);
+
+    // NOTE: The journal belongs to the process that saved
+    memset(&ctx->journal, 0, sizeof(ctx->journal));
+    profile_reset(&ctx->profile);
+
+    if (ctx->current_state == server_state_names::LOOP) {
+        ctx->current_state = server_state_names::AWAITING_CONNECTIONS;
+        ctx->resumed = true;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+// NOTE: Frees an arena that server_load mapped
+void server_unload(memory_arena *mem) {
+#ifndef _WIN32
+    server_release(mem);
+    munmap(mem->base, mem->max);
+    mem->base = NULL;
+#endif
+}
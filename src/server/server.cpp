@@ -1,24 +1,116 @@
 #define _USE_MATH_DEFINES
 #include <math.h>
-#define STB_PERLIN_IMPLEMENTATION
-#include "stb_perlin.h"
 
-#define MAP_GRID_WIDTH 10
-#define MAP_GRID_HEIGHT 10
+#define MAP_DEFAULT_WIDTH 10
+#define MAP_DEFAULT_HEIGHT 10
+#define MAP_MIN_SIZE 8
+#define MAP_MAX_SIZE 8192
+#define MAP_MIN_ISLANDS 50
+#define MAP_TILES_PER_ISLAND 512
+#define MAP_ISLAND_RADIUS 3.0f
+#define MAP_TOWN_SPACING 4
+// NOTE: Small enough that a cell never holds two spaced towns
+#define MAP_TOWN_GRID_CELL MAX(1, (s32)(MAP_TOWN_SPACING / 1.41421356f))
+// NOTE: Terrain is generated and stored in square chunks of one page each
+#define MAP_CHUNK_SHIFT 6
+#define MAP_CHUNK_SIZE (1 << MAP_CHUNK_SHIFT)
+#define MAP_CHUNK_TILES (MAP_CHUNK_SIZE * MAP_CHUNK_SIZE)
+// NOTE: Towns keep this far from chunk borders inside the map
+#define MAP_CHUNK_MARGIN 2
+#define MAP_START_ATTEMPTS 64
+#define MAP_NOISE_FREQUENCY 9.0f
+#define MAP_NOISE_OCTAVES 1
+#define MAP_NOISE_LACUNARITY 2.0f
+#define MAP_NOISE_GAIN 0.5f
+
+#define SERVER_CLIENT_SLOTS 32
+#define SERVER_CLIENT_READ_SIZE KB(64)
+#define SERVER_DEFAULT_PACKETS_PER_TICK 8
+#define SERVER_RESUME_FLUSH_SIZE KB(32)
+// NOTE: A client that heard nothing for this long gets a PING
+#define SERVER_PING_MS 300
+// NOTE: Units with news for one client in one tick before the oldest get
+// written early, the table is twice that so probes stay short
+#define SERVER_OUTBOUND_MAX_STAGED 1024
+#define SERVER_OUTBOUND_TABLE_BITS 11
+
+// NOTE: Sight is symmetric shadowcasting out to a radius per unit type,
+// dunes block it
+#define VISION_MAX_RADIUS 16
+#define VISION_DEFAULT_TOWN_RADIUS 2
+#define VISION_DEFAULT_SOLDIER_RADIUS 2
+#define VISION_DEFAULT_CARAVAN_RADIUS 3
+
+// NOTE: Packets drained from one connection this tick, packet k lives at
+// k * SERVER_CLIENT_READ_SIZE in buffer
+struct server_inbound {
+    u8 *buffer;
+    u32 *lens;
+    u32 num_packets;
+};
+
+enum outbound_ops : u8 {
+    OUTBOUND_ADD = 1,
+    OUTBOUND_MOVE,
+    OUTBOUND_REMOVE
+};
+
+struct outbound_unit {
+    unit *u;
+    u16 slot;
+    // NOTE: The first op says whether the client knew the unit at the
+    // start of the tick, the last whether it still does
+    outbound_ops first, last;
+};
+
+// NOTE: Unit news for one client this tick, in the order the units first
+// had any. Only the net effect goes out when the client is flushed.
+struct server_outbound {
+    outbound_unit *staged;
+    // NOTE: Index into staged plus one by hashed server_id, 0 is free
+    u16 *table;
+    u32 num_staged;
+};
+
+struct sync_state {
+    comm_sync_snapshot history[COMM_SYNC_HISTORY];
+    u32 next_id, acked_id, sent_id;
+
+    // NOTE: Per client, so states can be captured on any thread
+    comm_sync_entity *scratch;
+    u32 scratch_max;
+};
 
 enum server_state_names {
     AWAITING_CONNECTIONS = 0,
     INIT_EVERYBODY,
+    RESUME_EVERYBODY,
     LOOP
 };
 
 struct server_context {
     bool is_init;
 
-    memory_arena temp_buffer, read_buffer;
+    // NOTE: The arena this context lives in, towns of new chunks go there
+    memory_arena *memory;
+    memory_arena temp_buffer;
+    server_config config;
     server_state_names current_state;
     u32 current_turn_id;
 
+    // NOTE: Counts the accepted END_TURNs, the journal's clock
+    u32 turn_number;
+    match_journal journal;
+
+    // NOTE: Events waiting on a later turn_number, such as constructions
+    timer_wheel timers;
+
+    server_profile profile;
+
+    // NOTE: Loaded from a save, the next update takes over the comms it
+    // is given and START resumes the match instead of setting it up
+    bool reattach, resumed;
+
     u32 ent_id_counter;
 
     struct {
@@ -26,28 +118,728 @@ struct server_context {
         u32 terrain_width,
             terrain_height;
         doubly_linked_list<entity*> entities;
+
+        // NOTE: Chunk layout and the islands reaching into every chunk,
+        // enough to generate any chunk on its own
+        u32 chunks_x, chunks_y;
+        u32 towns_per_chunk;
+        bool *chunk_generated;
+        v2<u32> *islands;
+        u32 *chunk_island_offsets;
+        u32 *chunk_islands;
+        u32 *chunk_num_towns;
+        structure **chunk_towns;
+
+        // NOTE: The units standing in every chunk, newest first
+        entity **chunk_units;
+
+        // NOTE: One bit per client that currently has vision of the tile,
+        // which is why clients.max can not go above 32
+        u32 *observers;
+
+        // NOTE: When the map came from disk, terrain points into it and
+        // the arena room for it stays untouched
+        map_cache cache;
+        terrain_names *terrain_storage;
     } map;
 
     struct {
         bool **discovered_map;
+        u16 **vision;
+        sync_state *sync;
         communication *comms;
+        server_inbound *inbound;
+        server_outbound *outbound;
+        u32 max_packets_per_tick;
+        u32 round_robin_start;
         bool *admins;
         bool *connecteds;
         u32 max, used;
+
+        // NOTE: Newest first, so walking one visits entities in the same
+        // order as the entity list does. Slot 0 holds the unowned towns.
+        entity **owned_units;
+        entity **owned_towns;
     } clients;
 };
 
-void add_unit(communication *comm, server_context *ctx, v2<u32> pos, unit_names name, u32 owner, memory_arena *mem) {
+entity **owned_list(server_context *ctx, entity *ent) {
+    entity **lists = ent->type == entity_types::UNIT ? ctx->clients.owned_units : ctx->clients.owned_towns;
+    return &lists[ent->owner];
+}
+
+void owned_link(server_context *ctx, entity *ent) {
+    entity **first = owned_list(ctx, ent);
+    ent->owned_prev = NULL;
+    ent->owned_next = *first;
+    if (*first)
+        (*first)->owned_prev = ent;
+    *first = ent;
+}
+
+void owned_unlink(server_context *ctx, entity *ent) {
+    if (ent->owned_prev)
+        ent->owned_prev->owned_next = ent->owned_next;
+    else
+        *owned_list(ctx, ent) = ent->owned_next;
+    if (ent->owned_next)
+        ent->owned_next->owned_prev = ent->owned_prev;
+    ent->owned_prev = ent->owned_next = NULL;
+}
+
+// NOTE: Every change of hands goes through here to keep the index right
+void entity_set_owner(server_context *ctx, entity *ent, s32 owner) {
+    owned_unlink(ctx, ent);
+    ent->owner = owner;
+    owned_link(ctx, ent);
+}
+
+entity **chunk_list(server_context *ctx, entity *ent) {
+    u32 chunk = (ent->position.y >> MAP_CHUNK_SHIFT) * ctx->map.chunks_x + (ent->position.x >> MAP_CHUNK_SHIFT);
+    return &ctx->map.chunk_units[chunk];
+}
+
+void chunk_link(server_context *ctx, entity *ent) {
+    entity **first = chunk_list(ctx, ent);
+    ent->chunk_prev = NULL;
+    ent->chunk_next = *first;
+    if (*first)
+        (*first)->chunk_prev = ent;
+    *first = ent;
+}
+
+void chunk_unlink(server_context *ctx, entity *ent) {
+    if (ent->chunk_prev)
+        ent->chunk_prev->chunk_next = ent->chunk_next;
+    else
+        *chunk_list(ctx, ent) = ent->chunk_next;
+    if (ent->chunk_next)
+        ent->chunk_next->chunk_prev = ent->chunk_prev;
+    ent->chunk_prev = ent->chunk_next = NULL;
+}
+
+// NOTE: Every move of a unit goes through here to keep the index right
+void unit_set_position(server_context *ctx, unit *u, v2<u32> pos) {
+    chunk_unlink(ctx, u);
+    u->position = pos;
+    chunk_link(ctx, u);
+}
+
+unit *find_owned_unit(server_context *ctx, s32 owner, u32 id) {
+    for (entity *ent = ctx->clients.owned_units[owner]; ent; ent = ent->owned_next) {
+        if (ent->server_id == id)
+            return (unit *)ent;
+    }
+    return NULL;
+}
+
+real32 interpolate(real32 a, real32 b, real32 w) {
+    return (1.0f - w) * a + w * b;
+}
+
+// NOTE: Islands scale with the map area, the small default map keeps the
+// old fixed count
+u32 map_num_islands(u32 width, u32 height) {
+    return MAX(MAP_MIN_ISLANDS, (u32)(((umax)width * height) / MAP_TILES_PER_ISLAND));
+}
+
+u32 map_num_chunks(u32 width, u32 height) {
+    return ((width + MAP_CHUNK_SIZE - 1) >> MAP_CHUNK_SHIFT) * ((height + MAP_CHUNK_SIZE - 1) >> MAP_CHUNK_SHIFT);
+}
+
+// NOTE: Towns a full chunk aims for, so the whole map still gets about one
+// per island
+u32 map_towns_per_chunk(u32 width, u32 height) {
+    umax area = (umax)width * height;
+    return (u32)(((umax)map_num_islands(width, height) * MIN(area, MAP_CHUNK_TILES) + area - 1) / area);
+}
+
+// NOTE: Terrain is stored chunk by chunk, every chunk is MAP_CHUNK_TILES
+// tiles even when it hangs over the map edge
+u32 map_tile_index(server_context *ctx, u32 x, u32 y) {
+    u32 chunk = (y >> MAP_CHUNK_SHIFT) * ctx->map.chunks_x + (x >> MAP_CHUNK_SHIFT);
+    return chunk * MAP_CHUNK_TILES + ((y & (MAP_CHUNK_SIZE - 1)) << MAP_CHUNK_SHIFT) + (x & (MAP_CHUNK_SIZE - 1));
+}
+
+// NOTE: Samples the chunk's grass in random order and keeps the tiles at
+// least MAP_TOWN_SPACING away from every town so far, with a spatial grid
+// answering that. Tiles within MAP_CHUNK_MARGIN of a neighbouring chunk are
+// skipped, which keeps towns of different chunks apart without either
+// chunk knowing about the other. A map of a single chunk needs every town
+// it can get for the starting towns, so there the rejected tiles fill up
+// the rest. Returns the town count.
+u32 place_towns(server_context *ctx, u32 chunk, random_series *series, v2<u32> *towns, u32 max_towns) {
+    u32 x0 = (chunk % ctx->map.chunks_x) << MAP_CHUNK_SHIFT;
+    u32 y0 = (chunk / ctx->map.chunks_x) << MAP_CHUNK_SHIFT;
+    u32 width = MIN(MAP_CHUNK_SIZE, ctx->map.terrain_width - x0);
+    u32 height = MIN(MAP_CHUNK_SIZE, ctx->map.terrain_height - y0);
+    u32 x_min = x0 > 0 ? MAP_CHUNK_MARGIN : 0;
+    u32 y_min = y0 > 0 ? MAP_CHUNK_MARGIN : 0;
+    u32 x_max = x0 + MAP_CHUNK_SIZE < ctx->map.terrain_width ? width - MAP_CHUNK_MARGIN : width;
+    u32 y_max = y0 + MAP_CHUNK_SIZE < ctx->map.terrain_height ? height - MAP_CHUNK_MARGIN : height;
+    terrain_names *terrain = ctx->map.terrain + (umax)chunk * MAP_CHUNK_TILES;
+
+    u32 candidates[MAP_CHUNK_TILES];
+    u32 num_candidates = 0;
+    for (u32 y = y_min; y < y_max; ++y) {
+        for (u32 x = x_min; x < x_max; ++x) {
+            u32 local = (y << MAP_CHUNK_SHIFT) + x;
+            if (terrain[local] == terrain_names::GRASS)
+                candidates[num_candidates++] = local;
+        }
+    }
+
+    // NOTE: Holds town index + 1, 0 is an empty cell
+    const s32 cell = MAP_TOWN_GRID_CELL;
+    const s32 grid_size = (MAP_CHUNK_SIZE + cell - 1) / cell;
+    s32 reach = (MAP_TOWN_SPACING + cell - 1) / cell;
+    u32 grid[grid_size * grid_size];
+    memset(grid, 0, sizeof(grid));
+
+    // NOTE: Partial shuffle, [0, num_towns) are the accepted candidates
+    // and [num_towns, k) the rejected ones
+    u32 num_towns = 0;
+    u32 k = 0;
+    for (; k < num_candidates && num_towns < max_towns; ++k) {
+        u32 j = k + random_next_u32(series) % (num_candidates - k);
+        u32 local = candidates[j];
+        candidates[j] = candidates[k];
+        candidates[k] = local;
+
+        s32 x = local & (MAP_CHUNK_SIZE - 1), y = local >> MAP_CHUNK_SHIFT;
+        s32 gx = x / cell, gy = y / cell;
+        bool spaced = true;
+        for (s32 cy = MAX(0, gy - reach); spaced && cy <= MIN(grid_size - 1, gy + reach); ++cy) {
+            for (s32 cx = MAX(0, gx - reach); cx <= MIN(grid_size - 1, gx + reach); ++cx) {
+                u32 other = grid[cy * grid_size + cx];
+                if (!other)
+                    continue;
+                s32 dx = (s32)(towns[other - 1].x - x0) - x, dy = (s32)(towns[other - 1].y - y0) - y;
+                if (dx * dx + dy * dy < MAP_TOWN_SPACING * MAP_TOWN_SPACING) {
+                    spaced = false;
+                    break;
+                }
+            }
+        }
+        if (!spaced)
+            continue;
+
+        candidates[k] = candidates[num_towns];
+        candidates[num_towns] = local;
+        towns[num_towns].x = x0 + x;
+        towns[num_towns].y = y0 + y;
+        grid[gy * grid_size + gx] = ++num_towns;
+    }
+
+    bool fill = ctx->map.chunks_x * ctx->map.chunks_y == 1;
+    for (u32 i = num_towns; fill && i < k && num_towns < max_towns; ++i) {
+        towns[num_towns].x = x0 + (candidates[i] & (MAP_CHUNK_SIZE - 1));
+        towns[num_towns].y = y0 + (candidates[i] >> MAP_CHUNK_SHIFT);
+        ++num_towns;
+    }
+
+    return num_towns;
+}
+
+// NOTE: Terrain and town positions of one chunk. Only depends on the seed
+// and the island layout, so chunks come out the same in any order and on
+// any thread. Returns the town count.
+u32 generate_chunk(server_context *ctx, u32 chunk, v2<u32> *towns) {
+    u32 x0 = (chunk % ctx->map.chunks_x) << MAP_CHUNK_SHIFT;
+    u32 y0 = (chunk / ctx->map.chunks_x) << MAP_CHUNK_SHIFT;
+    u32 width = MIN(MAP_CHUNK_SIZE, ctx->map.terrain_width - x0);
+    u32 height = MIN(MAP_CHUNK_SIZE, ctx->map.terrain_height - y0);
+
+    // NOTE: Islands are stamped in their global order, so where two overlap
+    // the later one wins like it would on a whole map
+    real32 circles_map[MAP_CHUNK_TILES] = {0};
+    real32 radius = MAP_ISLAND_RADIUS;
+    s32 reach = (s32)ceilf(radius);
+    for (u32 i = ctx->map.chunk_island_offsets[chunk]; i < ctx->map.chunk_island_offsets[chunk + 1]; ++i) {
+        v2<u32> center = ctx->map.islands[ctx->map.chunk_islands[i]];
+        s32 cx = center.x, cy = center.y;
+        s32 y_min = MAX((s32)y0, cy - reach), y_max = MIN((s32)(y0 + height) - 1, cy + reach);
+        s32 x_min = MAX((s32)x0, cx - reach), x_max = MIN((s32)(x0 + width) - 1, cx + reach);
+        for (s32 y = y_min; y <= y_max; ++y) {
+            for (s32 x = x_min; x <= x_max; ++x) {
+                u32 local = ((y - y0) << MAP_CHUNK_SHIFT) + (x - x0);
+                s32 dx = x - cx, dy = y - cy;
+                real32 mag = sqrtf((real32)(dx * dx + dy * dy));
+                if (mag <= radius) {
+                    if (mag == 0)
+                        circles_map[local] = 1.0f;
+                    else
+                        circles_map[local] = 1.0f - mag/radius;
+                }
+            }
+        }
+    }
+
+    terrain_names *terrain = ctx->map.terrain + (umax)chunk * MAP_CHUNK_TILES;
+    real32 xs[MAP_CHUNK_SIZE], noise[MAP_CHUNK_SIZE];
+    for (u32 x = 0; x < width; ++x) {
+        real32 nx = (real32)(x0 + x) / ctx->map.terrain_width - 0.5;
+        xs[x] = nx * MAP_NOISE_FREQUENCY;
+    }
+    for (u32 y = 0; y < height; ++y) {
+        real32 ny = (real32)(y0 + y) / ctx->map.terrain_height - 0.5;
+        noise_fbm3(noise, xs, width, ny * MAP_NOISE_FREQUENCY, 0,
+                   MAP_NOISE_LACUNARITY, MAP_NOISE_GAIN, MAP_NOISE_OCTAVES);
+
+        for (u32 x = 0; x < width; ++x) {
+            u32 local = (y << MAP_CHUNK_SHIFT) + x;
+            real32 perlin = noise[x] / 2.0 + 0.5;
+            real32 value = interpolate(perlin, circles_map[local], 1.0);
+            if (value > 0.6) {
+                terrain[local] = terrain_names::WATER;
+            } else if (value > 0.0) {
+                terrain[local] = terrain_names::GRASS;
+            } else {
+                terrain[local] = terrain_names::DESERT;
+            }
+        }
+    }
+
+    // NOTE: Seeds 0 and 1 past the map seed are the islands and the owners
+    random_series series = random_seed(ctx->config.map_seed + 2 + chunk);
+    umax area = (umax)ctx->map.terrain_width * ctx->map.terrain_height;
+    umax islands = map_num_islands(ctx->map.terrain_width, ctx->map.terrain_height);
+    u32 max_towns = (u32)((islands * width * height + area - 1) / area);
+    return place_towns(ctx, chunk, &series, towns, max_towns);
+}
+
+void map_add_chunk_towns(server_context *ctx, u32 chunk, v2<u32> *towns, u32 num_towns) {
+    structure **chunk_towns = ctx->map.chunk_towns + (umax)chunk * ctx->map.towns_per_chunk;
+    for (u32 i = 0; i < num_towns; ++i) {
+        structure *town = (structure *)memory_arena_use(ctx->memory, sizeof(*town));
+        ctx->map.entities.push_front(town);
+        town->type = entity_types::STRUCTURE;
+        town->position = towns[i];
+        town->owner = 0;
+        town->construction = unit_names::NONE;
+        town->construction_event = NULL;
+        town->server_id = ctx->ent_id_counter++;
+        owned_link(ctx, town);
+        chunk_towns[i] = town;
+    }
+    ctx->map.chunk_num_towns[chunk] = num_towns;
+    ctx->map.chunk_generated[chunk] = true;
+}
+
+void map_ensure_chunk(server_context *ctx, u32 chunk) {
+    if (ctx->map.chunk_generated[chunk])
+        return;
+
+    v2<u32> *towns = (v2<u32> *)memory_arena_use(&ctx->temp_buffer, sizeof(*towns) * ctx->map.towns_per_chunk);
+    u32 num_towns = generate_chunk(ctx, chunk, towns);
+    map_add_chunk_towns(ctx, chunk, towns, num_towns);
+}
+
+// NOTE: Generates the chunk on first use, x and y must be on the map
+terrain_names map_terrain_at(server_context *ctx, u32 x, u32 y) {
+    map_ensure_chunk(ctx, (y >> MAP_CHUNK_SHIFT) * ctx->map.chunks_x + (x >> MAP_CHUNK_SHIFT));
+    return ctx->map.terrain[map_tile_index(ctx, x, y)];
+}
+
+void send_add_unit(server_context *ctx, communication *comm, unit *u) {
+    if (ctx->config.delta_sync) return;
+
     comm_server_header header;
     header.name = comm_server_msg_names::ADD_UNIT;
     comm_write(comm, &header, sizeof(header));
 
+    comm_server_add_unit_body body;
+    body.unit_id = u->server_id;
+    body.owner = u->owner;
+    body.action_points = u->action_points;
+    body.unit_name = u->name;
+    body.position = u->position;
+    comm_write(comm, &body, sizeof(body));
+}
+
+void send_move_unit(server_context *ctx, communication *comm, unit *u) {
+    if (ctx->config.delta_sync) return;
+
+    comm_server_header header;
+    header.name = comm_server_msg_names::MOVE_UNIT;
+    comm_write(comm, &header, sizeof(header));
+
+    comm_server_move_unit_body body;
+    body.unit_id = u->server_id;
+    body.action_points_left = u->action_points;
+    body.new_position = u->position;
+    comm_write(comm, &body, sizeof(body));
+}
+
+void send_remove_unit(server_context *ctx, communication *comm, unit *u) {
+    if (ctx->config.delta_sync) return;
+
+    comm_server_header header;
+    header.name = comm_server_msg_names::REMOVE_UNIT;
+    comm_write(comm, &header, sizeof(header));
+
+    comm_server_remove_unit_body body;
+    body.unit_id = u->server_id;
+    comm_write(comm, &body, sizeof(body));
+}
+
+// NOTE: Writes what is staged for the client and empties the stage
+void outbound_flush(server_context *ctx, u32 client_id) {
+    server_outbound *out = &ctx->clients.outbound[client_id];
+    communication *comm = &ctx->clients.comms[client_id];
+    for (u32 i = 0; i < out->num_staged; ++i) {
+        outbound_unit *staged = &out->staged[i];
+        out->table[staged->slot] = 0;
+
+        bool known_before = staged->first != OUTBOUND_ADD;
+        bool known_after = staged->last != OUTBOUND_REMOVE;
+        if (!known_before && known_after) {
+            send_add_unit(ctx, comm, staged->u);
+        } else if (known_before && known_after) {
+            send_move_unit(ctx, comm, staged->u);
+        } else if (known_before) {
+            send_remove_unit(ctx, comm, staged->u);
+        }
+    }
+    out->num_staged = 0;
+}
+
+void outbound_stage(server_context *ctx, u32 client_id, unit *u, outbound_ops op) {
+    if (ctx->config.delta_sync) return;
+
+    server_outbound *out = &ctx->clients.outbound[client_id];
+    u32 mask = (1u << SERVER_OUTBOUND_TABLE_BITS) - 1;
+    u32 slot = (u->server_id * 2654435761u) >> (32 - SERVER_OUTBOUND_TABLE_BITS);
+    for (; out->table[slot]; slot = (slot + 1) & mask) {
+        outbound_unit *staged = &out->staged[out->table[slot] - 1];
+        if (staged->u == u) {
+            staged->last = op;
+            return;
+        }
+    }
+
+    if (out->num_staged == SERVER_OUTBOUND_MAX_STAGED) {
+        outbound_flush(ctx, client_id);
+        outbound_stage(ctx, client_id, u, op);
+        return;
+    }
+
+    outbound_unit *staged = &out->staged[out->num_staged++];
+    staged->u = u;
+    staged->slot = (u16)slot;
+    staged->first = staged->last = op;
+    out->table[slot] = (u16)out->num_staged;
+}
+
+void broadcast_unit_added(server_context *ctx, unit *u, u32 already_told) {
+    u32 idx = u->position.y * ctx->map.terrain_width + u->position.x;
+    u32 interested = ctx->map.observers[idx] & ~already_told & ~(1u << u->owner);
+
+    while (interested) {
+        u32 client_id = find_least_significant_set_bit(interested);
+        interested &= interested - 1;
+        outbound_stage(ctx, client_id, u, OUTBOUND_ADD);
+    }
+}
+
+// NOTE: Tells every other client that sees either end of the step what
+// happened to the unit. The cost follows the number of observers of the
+// two tiles, not the number of clients.
+void broadcast_unit_moved(server_context *ctx, unit *u, v2<u32> prev_pos) {
+    u32 idx = u->position.y * ctx->map.terrain_width + u->position.x;
+    u32 prev_idx = prev_pos.y * ctx->map.terrain_width + prev_pos.x;
+    u32 seen_after = ctx->map.observers[idx];
+    u32 seen_before = ctx->map.observers[prev_idx];
+    u32 interested = (seen_before | seen_after) & ~(1u << u->owner);
+
+    while (interested) {
+        u32 client_id = find_least_significant_set_bit(interested);
+        u32 bit = 1u << client_id;
+        interested &= interested - 1;
+
+        if ((seen_before & bit) && (seen_after & bit)) {
+            outbound_stage(ctx, client_id, u, OUTBOUND_MOVE);
+        } else if (seen_after & bit) {
+            outbound_stage(ctx, client_id, u, OUTBOUND_ADD);
+        } else {
+            outbound_stage(ctx, client_id, u, OUTBOUND_REMOVE);
+        }
+    }
+}
+
+bool has_vision(server_context *ctx, u32 client_id) {
+    return client_id > 0 && client_id < ctx->clients.used;
+}
+
+// NOTE: Towns see with the radius of unit_names::NONE
+u32 sight_radius(server_context *ctx, unit_names name) {
+    u32 radius = ctx->config.sight_radius[(u32)name];
+    if (!radius) {
+        if (name == unit_names::SOLDIER) radius = VISION_DEFAULT_SOLDIER_RADIUS;
+        else if (name == unit_names::CARAVAN) radius = VISION_DEFAULT_CARAVAN_RADIUS;
+        else radius = VISION_DEFAULT_TOWN_RADIUS;
+    }
+    return MIN(radius, VISION_MAX_RADIUS);
+}
+
+bool terrain_blocks_sight(terrain_names terrain) {
+    return terrain == terrain_names::DESERT;
+}
+
+// NOTE: The part of the map a vision change can touch, one byte per tile.
+// The field of view before the change sets VISION_BEFORE and the one after
+// sets VISION_AFTER, only tiles with one of the two change sight. Points
+// walked past on the way set VISION_PASSED.
+#define VISION_BEFORE 1
+#define VISION_AFTER 2
+#define VISION_PASSED 4
+
+struct vision_window {
+    s32 x0, y0;
+    s32 width, height;
+    u8 *tiles;
+};
+
+struct vision_scan {
+    server_context *ctx;
+    vision_window *window;
+    s32 cx, cy;
+    s32 radius;
+    u32 quadrant;
+    u8 bit;
+};
+
+s32 floor_div(s32 a, s32 b) {
+    return a / b - (a % b != 0 && (a < 0) != (b < 0));
+}
+
+s32 ceil_div(s32 a, s32 b) {
+    return -floor_div(-a, b);
+}
+
+void vision_scan_tile(vision_scan *scan, s32 depth, s32 col, s32 *x, s32 *y) {
+    switch (scan->quadrant) {
+        case 0: *x = scan->cx + col; *y = scan->cy - depth; break;
+        case 1: *x = scan->cx + depth; *y = scan->cy + col; break;
+        case 2: *x = scan->cx + col; *y = scan->cy + depth; break;
+        default: *x = scan->cx - depth; *y = scan->cy + col; break;
+    }
+}
+
+void vision_mark(vision_scan *scan, s32 x, s32 y) {
+    vision_window *w = scan->window;
+    if (x < w->x0 || y < w->y0 || x >= w->x0 + w->width || y >= w->y0 + w->height)
+        return;
+    w->tiles[(y - w->y0) * w->width + (x - w->x0)] |= scan->bit;
+}
+
+// NOTE: One row of a quadrant, between the slopes start_num / start_den
+// and end_num / end_den. Every slope is a fraction with a positive
+// denominator, so the rounding at the edges is exact.
+void vision_scan_row(vision_scan *scan, s32 depth, s32 start_num, s32 start_den, s32 end_num, s32 end_den) {
+    if (depth > scan->radius)
+        return;
+
+    s32 min_col = floor_div(2 * depth * start_num + start_den, 2 * start_den);
+    s32 max_col = ceil_div(2 * depth * end_num - end_den, 2 * end_den);
+    s32 limit = scan->radius * scan->radius + scan->radius;
+    s32 prev_wall = -1;
+    for (s32 col = min_col; col <= max_col; ++col) {
+        s32 x, y;
+        vision_scan_tile(scan, depth, col, &x, &y);
+        bool in_map = x >= 0 && y >= 0 && x < (s32)scan->ctx->map.terrain_width && y < (s32)scan->ctx->map.terrain_height;
+        bool wall = !in_map || terrain_blocks_sight(map_terrain_at(scan->ctx, x, y));
+        bool symmetric = col * start_den >= depth * start_num && col * end_den <= depth * end_num;
+        if (in_map && (wall || symmetric) && depth * depth + col * col <= limit)
+            vision_mark(scan, x, y);
+
+        if (prev_wall == 1 && !wall) {
+            start_num = 2 * col - 1;
+            start_den = 2 * depth;
+        }
+        if (prev_wall == 0 && wall)
+            vision_scan_row(scan, depth + 1, start_num, start_den, 2 * col - 1, 2 * depth);
+        prev_wall = wall;
+    }
+    if (prev_wall == 0)
+        vision_scan_row(scan, depth + 1, start_num, start_den, end_num, end_den);
+}
+
+void vision_field(server_context *ctx, vision_window *window, v2<u32> center, u32 radius, u8 bit) {
+    vision_scan scan = {ctx, window, (s32)center.x, (s32)center.y, (s32)radius, 0, bit};
+    vision_mark(&scan, scan.cx, scan.cy);
+    for (scan.quadrant = 0; scan.quadrant < 4; ++scan.quadrant) {
+        vision_scan_row(&scan, 1, -1, 1, 1, 1);
+    }
+}
+
+// NOTE: What a tile of the window became for the client after applying.
+// A glimpsed tile was only in sight somewhere along a path.
+enum vision_change_names : u8 {
+    VISION_UNCHANGED = 0,
+    VISION_HIDDEN,
+    VISION_SEEN,
+    VISION_DISCOVERED,
+    VISION_GLIMPSED
+};
+
+// NOTE: Tells the client about an entity on a tile of the window that
+// changed for it
+void vision_tell(server_context *ctx, u32 client_id, vision_window *window, entity *ent) {
+    s32 x = (s32)ent->position.x - window->x0, y = (s32)ent->position.y - window->y0;
+    if (x < 0 || y < 0 || x >= window->width || y >= window->height)
+        return;
+
+    u8 change = window->tiles[y * window->width + x];
+    if (change == VISION_UNCHANGED)
+        return;
+
+    if (ent->type == entity_types::STRUCTURE) {
+        if (change != VISION_DISCOVERED && change != VISION_GLIMPSED) return;
+
+        communication *comm = &ctx->clients.comms[client_id];
+        comm_server_header header;
+        header.name = comm_server_msg_names::DISCOVER_TOWN;
+        comm_write(comm, &header, sizeof(header));
+
+        comm_server_discover_town_body discover_town_body;
+        discover_town_body.id = ent->server_id;
+        discover_town_body.owner = ent->owner;
+        discover_town_body.position = ent->position;
+        comm_write(comm, &discover_town_body, sizeof(discover_town_body));
+    } else if (ent->type == entity_types::UNIT) {
+        if (ent->owner == (s32)client_id || change == VISION_GLIMPSED) return;
+
+        outbound_stage(ctx, client_id, (unit *)ent, change == VISION_HIDDEN ? OUTBOUND_REMOVE : OUTBOUND_ADD);
+    }
+}
+
+// NOTE: Moves the client's sight from the field around from to the one
+// around the last point of path, from may be NULL and so may path with a
+// length of 0. Only tiles in one field and not the other change counts,
+// the points before the last only discover. Whatever the client gains or
+// loses sight of is found in the chunks under the window.
+void vision_update(u32 client_id, server_context *ctx, v2<u32> *from, v2<u32> *path, u32 path_length, u32 radius) {
+    if (!has_vision(ctx, client_id)) return;
+    PROFILE_SCOPE(&ctx->profile, PROFILE_VISION);
+
+    v2<u32> lo = from ? *from : path[0], hi = lo;
+    for (u32 i = 0; i < path_length; ++i) {
+        lo.x = MIN(lo.x, path[i].x); lo.y = MIN(lo.y, path[i].y);
+        hi.x = MAX(hi.x, path[i].x); hi.y = MAX(hi.y, path[i].y);
+    }
+    vision_window window;
+    window.x0 = MAX((s32)lo.x - (s32)radius, 0);
+    window.y0 = MAX((s32)lo.y - (s32)radius, 0);
+    window.width = MIN((s32)(hi.x + radius), (s32)ctx->map.terrain_width - 1) - window.x0 + 1;
+    window.height = MIN((s32)(hi.y + radius), (s32)ctx->map.terrain_height - 1) - window.y0 + 1;
+    u32 window_size = window.width * window.height;
+    window.tiles = (u8 *)memory_arena_use(&ctx->temp_buffer, window_size);
+    memset(window.tiles, 0, window_size);
+
+    if (from) vision_field(ctx, &window, *from, radius, VISION_BEFORE);
+    for (u32 i = 0; i + 1 < path_length; ++i) {
+        vision_field(ctx, &window, path[i], radius, VISION_PASSED);
+    }
+    if (path_length) vision_field(ctx, &window, path[path_length - 1], radius, VISION_AFTER);
+
+    communication *comm = &ctx->clients.comms[client_id];
+    comm_server_header header;
+    comm_server_discover_body discover_body;
+    comm_server_discover_body_tile *discover_body_tiles = (comm_server_discover_body_tile *)memory_arena_use(
+                                                              &ctx->temp_buffer, sizeof(*discover_body_tiles) * window_size);
+    u16 *vision = ctx->clients.vision[client_id];
+    bool *discovered = ctx->clients.discovered_map[client_id];
+    u32 num = 0;
+    bool any_change = false;
+    for (s32 y = 0; y < window.height; ++y) {
+        for (s32 x = 0; x < window.width; ++x) {
+            u8 *tile = &window.tiles[y * window.width + x];
+            u32 X = window.x0 + x, Y = window.y0 + y;
+            u32 idx = Y * ctx->map.terrain_width + X;
+
+            u8 fields = *tile & (VISION_BEFORE | VISION_AFTER);
+            if (fields != VISION_AFTER && (*tile & VISION_PASSED) && !discovered[idx]) {
+                discovered[idx] = true;
+                discover_body_tiles[num].position.x = X;
+                discover_body_tiles[num].position.y = Y;
+                discover_body_tiles[num].name = map_terrain_at(ctx, X, Y);
+                ++num;
+                *tile = VISION_GLIMPSED;
+                any_change = true;
+                continue;
+            }
+
+            if (fields == VISION_AFTER) {
+                *tile = VISION_UNCHANGED;
+                if (vision[idx]++ > 0) continue;
+
+                ctx->map.observers[idx] |= 1u << client_id;
+                *tile = VISION_SEEN;
+                if (!discovered[idx]) {
+                    discovered[idx] = true;
+                    *tile = VISION_DISCOVERED;
+                    discover_body_tiles[num].position.x = X;
+                    discover_body_tiles[num].position.y = Y;
+                    discover_body_tiles[num].name = map_terrain_at(ctx, X, Y);
+                    ++num;
+                }
+                any_change = true;
+            } else if (fields == VISION_BEFORE) {
+                *tile = VISION_UNCHANGED;
+                if (--vision[idx] > 0) continue;
+
+                ctx->map.observers[idx] &= ~(1u << client_id);
+                *tile = VISION_HIDDEN;
+                any_change = true;
+            } else {
+                *tile = VISION_UNCHANGED;
+            }
+        }
+    }
+
+    // NOTE: Only the chunks under the window can hold what changed. A
+    // chunk that was never generated has no towns yet.
+    u32 cx_min = (u32)window.x0 >> MAP_CHUNK_SHIFT, cx_max = (u32)(window.x0 + window.width - 1) >> MAP_CHUNK_SHIFT;
+    u32 cy_min = (u32)window.y0 >> MAP_CHUNK_SHIFT, cy_max = (u32)(window.y0 + window.height - 1) >> MAP_CHUNK_SHIFT;
+    for (u32 cy = cy_min; any_change && cy <= cy_max; ++cy) {
+        for (u32 cx = cx_min; cx <= cx_max; ++cx) {
+            u32 chunk = cy * ctx->map.chunks_x + cx;
+            structure **chunk_towns = ctx->map.chunk_towns + (umax)chunk * ctx->map.towns_per_chunk;
+            for (u32 t = 0; ctx->map.chunk_generated[chunk] && t < ctx->map.chunk_num_towns[chunk]; ++t) {
+                vision_tell(ctx, client_id, &window, chunk_towns[t]);
+            }
+            for (entity *ent = ctx->map.chunk_units[chunk]; ent; ent = ent->chunk_next) {
+                vision_tell(ctx, client_id, &window, ent);
+            }
+        }
+    }
+
+    if (num > 0) {
+        header.name = comm_server_msg_names::DISCOVER;
+        comm_write(comm, &header, sizeof(header));
+        discover_body.num = num;
+        comm_write(comm, &discover_body, sizeof(discover_body));
+        comm_write(comm, discover_body_tiles, sizeof(*discover_body_tiles) * num);
+    }
+}
+
+void vision_add(u32 client_id, server_context *ctx, v2<u32> center, u32 radius) {
+    vision_update(client_id, ctx, NULL, &center, 1, radius);
+}
+
+void vision_remove(u32 client_id, server_context *ctx, v2<u32> center, u32 radius) {
+    vision_update(client_id, ctx, &center, NULL, 0, radius);
+}
+
+void add_unit(communication *comm, server_context *ctx, v2<u32> pos, unit_names name, u32 owner, memory_arena *mem) {
     unit *u = (unit *)memory_arena_use(mem, sizeof(*u));
     u->server_id = ctx->ent_id_counter++;
     u->position = pos;
     u->name = name;
     u->owner = owner;
     u->slot = NULL;
+    u->loaded_by = NULL;
     u->type = entity_types::UNIT;
 
     if (name == unit_names::SOLDIER) {
@@ -58,324 +850,263 @@ void add_unit(communication *comm, server_context *ctx, v2<u32> pos, unit_names
     }
 
     ctx->map.entities.push_front(u);
+    owned_link(ctx, u);
+    chunk_link(ctx, u);
+
+    u32 told = (u32)(comm - ctx->clients.comms);
+    assert(told > 0 && told < ctx->clients.used);
+    outbound_stage(ctx, told, u, OUTBOUND_ADD);
+    broadcast_unit_added(ctx, u, 1u << told);
 
-    comm_server_add_unit_body add_unit_body;
-    add_unit_body.unit_id = u->server_id;
-    add_unit_body.action_points = u->action_points;
-    add_unit_body.position = u->position;
-    add_unit_body.unit_name = u->name;
-    add_unit_body.owner = u->owner;
-    comm_write(comm, &add_unit_body, sizeof(add_unit_body));
+    vision_add(owner, ctx, pos, sight_radius(ctx, name));
 }
 
-void discover_3x3(u32 client_id, server_context *ctx, v2<u32> center) {
-    communication *comm = &ctx->clients.comms[client_id];
-    comm_server_header header;
-    comm_server_discover_body discover_body;
-    comm_server_discover_body_tile *discover_body_tiles;
+// NOTE: Of the owner's turns, 0 for what a town can not build
+u32 construction_turns(unit_names name) {
+    if (name == unit_names::SOLDIER) {
+        return 3;
+    } else if (name == unit_names::CARAVAN) {
+        return 5;
+    }
+    return 0;
+}
 
-    u32 max_tiles = 9;
-    u32 num = 0;
-    v2<u32> pos;
-    discover_body_tiles = (comm_server_discover_body_tile *)memory_arena_use(
-                            &ctx->temp_buffer, sizeof(*discover_body_tiles) * max_tiles);
+// NOTE: Called during the owner's turn. The unit comes at the start of
+// the owner's turn that many rounds later, a round being one turn_number
+// per player.
+void set_construction(server_context *ctx, structure *town, unit_names name) {
+    if (town->construction_event) {
+        timer_wheel_cancel(&ctx->timers, town->construction_event);
+        town->construction_event = NULL;
+    }
 
-    for (s32 Y = center.y - 1; Y <= center.y + 1; ++Y) {
-        if (Y < 0) continue;
-        if (Y > ctx->map.terrain_height - 1) continue;
-        for (s32 X = center.x - 1; X <= center.x + 1; ++X) {
-            if (X < 0) continue;
-            if (X > ctx->map.terrain_width - 1) continue;
+    u32 turns = construction_turns(name);
+    town->construction = turns ? name : unit_names::NONE;
+    if (turns) {
+        u32 due = ctx->turn_number + turns * (ctx->clients.used - 1);
+        town->construction_event = timer_wheel_schedule(&ctx->timers, ctx->memory, due, TIMER_CONSTRUCTION, town);
+    }
+}
 
-            u32 idx = Y * ctx->map.terrain_width + X;
-            
-            bool previously_discovered = ctx->clients.discovered_map[client_id][idx];
-
-            if (!previously_discovered) {
-                ctx->clients.discovered_map[client_id][idx] = true;
-                pos.x = X;
-                pos.y = Y;
-                u32 num_entities;
-                entity **entities = find_entities_at_position(ctx->map.entities, pos, &ctx->temp_buffer, &num_entities);
-
-                for (u32 i = 0; i < num_entities; ++i) {
-                    if (entities[i]->type == entity_types::STRUCTURE) {
-                        header.name = comm_server_msg_names::DISCOVER_TOWN;
-                        comm_write(comm, &header, sizeof(header));
-
-                        comm_server_discover_town_body discover_town_body;
-                        discover_town_body.id = entities[i]->server_id;
-                        discover_town_body.owner = entities[i]->owner;
-                        discover_town_body.position = entities[i]->position;
-                        comm_write(comm, &discover_town_body, sizeof(discover_town_body));
-                    } else if (entities[i]->type == entity_types::UNIT) {
-                        unit *u = (unit *)entities[i];
-                        header.name = comm_server_msg_names::ADD_UNIT;
-                        comm_write(comm, &header, sizeof(header));
-
-                        comm_server_add_unit_body add_unit_body;
-                        add_unit_body.unit_id = u->server_id;
-                        add_unit_body.owner = u->owner;
-                        add_unit_body.position = u->position;
-                        add_unit_body.action_points = u->action_points;
-                        add_unit_body.unit_name = u->name;
-                        comm_write(comm, &add_unit_body, sizeof(add_unit_body));
-                    }
-                }
+u32 construction_turns_left(server_context *ctx, structure *town) {
+    if (!town->construction_event)
+        return 0;
+    u32 num_players = ctx->clients.used - 1;
+    return (town->construction_event->due - ctx->turn_number + num_players - 1) / num_players;
+}
 
-                discover_body_tiles[num].position = pos;
-                discover_body_tiles[num].name = ctx->map.terrain[idx];
-                ++num;
-            }
-        }
+// NOTE: Stepping off the map is treated like stepping into water
+bool unit_can_enter(server_context *ctx, unit *u, v2<u32> pos) {
+    bool in_map = pos.x < ctx->map.terrain_width && pos.y < ctx->map.terrain_height;
+    terrain_names terrain = in_map ? map_terrain_at(ctx, pos.x, pos.y) : terrain_names::WATER;
+    if (u->name == unit_names::SOLDIER) {
+        return terrain == terrain_names::GRASS;
+    } else if (u->name == unit_names::CARAVAN) {
+        return terrain == terrain_names::GRASS || terrain == terrain_names::DESERT;
     }
-
-    header.name = comm_server_msg_names::DISCOVER;
-    comm_write(comm, &header, sizeof(header));
-    discover_body.num = num;
-    comm_write(comm, &discover_body, sizeof(discover_body));
-    comm_write(comm, discover_body_tiles, sizeof(*discover_body_tiles) * num);
+    return false;
 }
 
-void move_unit_delta(communication *comm, server_context *ctx, unit *u, v2<s32> delta) {
-    u32 action_points = u->action_points;
-    if (action_points > 0) {
-        action_points--;
-
-        v2<s32> d = delta;
-        v2<u32> pos = u->position;
-        v2<u32> prev_pos = pos;
-        pos.x += d.x;
-        pos.y += d.y;
-
-        u32 idx = pos.y * ctx->map.terrain_width + pos.x;
-        bool passable = false;
-        unit_names name = u->name;
-        terrain_names terrain = ctx->map.terrain[idx];
-        if (name == unit_names::SOLDIER) {
-            if (terrain == terrain_names::GRASS) {
-                passable = true;
-            }
-        } else if (name == unit_names::CARAVAN) {
-            if (terrain == terrain_names::GRASS ||
-                terrain == terrain_names::DESERT) {
-                passable = true;
-            }
-        }
+// NOTE: Everybody hears about a walk once, however long it was. The
+// owner gets the end of it and what it saw on the way, every observer of
+// either end one message about the unit and its cargo.
+void move_unit_path(communication *comm, server_context *ctx, unit *u, v2<u32> *path, u32 path_length) {
+    PROFILE_SCOPE(&ctx->profile, PROFILE_MOVE);
+    v2<u32> prev_pos = u->position;
+    v2<u32> pos = path[path_length - 1];
+    unit_set_position(ctx, u, pos);
 
-        if (passable) {
-            u->action_points = action_points;
-            u->position = pos;
-
-            comm_server_header head;
-            head.name = comm_server_msg_names::MOVE_UNIT;
-            comm_server_move_unit_body b;
-            b.unit_id = u->server_id;
-            b.action_points_left = u->action_points;
-            b.new_position = pos;
-            comm_write(comm, &head, sizeof(head));
-            comm_write(comm, &b, sizeof(b));
-
-            discover_3x3(u->owner, ctx, pos);
-
-            if (u->slot != NULL) {
-                u->slot->position = pos;
-                head.name = comm_server_msg_names::MOVE_UNIT;
-                b.unit_id = u->slot->server_id;
-                b.action_points_left = u->slot->action_points;
-                b.new_position = pos;
-                comm_write(comm, &head, sizeof(head));
-                comm_write(comm, &b, sizeof(b));
-            }
+    outbound_stage(ctx, u->owner, u, OUTBOUND_MOVE);
 
-            for (u32 client_id = 1; client_id < ctx->clients.used; ++client_id) {
-                if (client_id == u->owner) continue;
+    vision_update(u->owner, ctx, &prev_pos, path, path_length, sight_radius(ctx, u->name));
 
-                u32 prev_idx = prev_pos.y * ctx->map.terrain_width + prev_pos.x;
-                if (ctx->clients.discovered_map[client_id][idx]) {
-                    if (ctx->clients.discovered_map[client_id][prev_idx]) {
-                        head.name = comm_server_msg_names::MOVE_UNIT;
-                        b.unit_id = u->server_id;
-                        b.action_points_left = u->action_points;
-                        b.new_position = pos;
-                        comm_write(&ctx->clients.comms[client_id], &head, sizeof(head));
-                        comm_write(&ctx->clients.comms[client_id], &b, sizeof(b));
-                    } else {
-                        head.name = comm_server_msg_names::ADD_UNIT;
-                        comm_server_add_unit_body add_unit_body;
-                        add_unit_body.unit_id = u->server_id;
-                        add_unit_body.action_points = u->action_points;
-                        add_unit_body.position = u->position;
-                        add_unit_body.unit_name = u->name;
-                        add_unit_body.owner = u->owner;
-                        comm_write(&ctx->clients.comms[client_id], &head, sizeof(head));
-                        comm_write(&ctx->clients.comms[client_id], &add_unit_body, sizeof(add_unit_body));
-                    }
-                } else {
-                    if (ctx->clients.discovered_map[client_id][prev_idx]) {
-                        head.name = comm_server_msg_names::REMOVE_UNIT;
-                        comm_server_remove_unit_body remove_unit_body;
-                        remove_unit_body.unit_id = u->server_id;
-                        comm_write(&ctx->clients.comms[client_id], &head, sizeof(head));
-                        comm_write(&ctx->clients.comms[client_id], &remove_unit_body, sizeof(remove_unit_body));
-                    }
-                }
-            }
-        }
+    if (u->slot != NULL) {
+        unit_set_position(ctx, u->slot, pos);
+        outbound_stage(ctx, u->owner, u->slot, OUTBOUND_MOVE);
+    }
+
+    broadcast_unit_moved(ctx, u, prev_pos);
+    if (u->slot != NULL) {
+        broadcast_unit_moved(ctx, u->slot, prev_pos);
     }
 }
 
+void move_unit_delta(communication *comm, server_context *ctx, unit *u, v2<s32> delta) {
+    if (u->action_points == 0)
+        return;
+
+    v2<u32> pos = u->position;
+    pos.x += delta.x;
+    pos.y += delta.y;
+    if (unit_can_enter(ctx, u, pos)) {
+        u->action_points--;
+        move_unit_path(comm, ctx, u, &pos, 1);
+    }
+}
 
+// NOTE: Takes steps until one is blocked or the action points run out
+void move_unit_steps(communication *comm, server_context *ctx, unit *u, u8 *steps, u32 num_steps) {
+    v2<u32> path[COMM_MOVE_PATH_MAX_STEPS];
+    u32 path_length = 0;
+    v2<u32> pos = u->position;
+    num_steps = MIN(num_steps, COMM_MOVE_PATH_MAX_STEPS);
+    for (u32 i = 0; i < num_steps && path_length < u->action_points; ++i) {
+        if (steps[i] >= COMM_PATH_NUM_DIRECTIONS)
+            break;
+
+        v2<u32> next = pos;
+        next.x += comm_path_directions[steps[i]].x;
+        next.y += comm_path_directions[steps[i]].y;
+        if (!unit_can_enter(ctx, u, next))
+            break;
+        path[path_length++] = pos = next;
+    }
 
-real32 interpolate(real32 a, real32 b, real32 w) {
-    return (1.0f - w) * a + w * b;
+    if (path_length > 0) {
+        u->action_points -= path_length;
+        move_unit_path(comm, ctx, u, path, path_length);
+    }
 }
 
+struct map_chunk_job {
+    server_context *ctx;
+    v2<u32> *towns;
+    u32 *num_towns;
+};
+
+JOB_FN(generate_chunk_job) {
+    map_chunk_job *job = (map_chunk_job *)data;
+    job->num_towns[index] = generate_chunk(job->ctx, index, job->towns + (umax)index * job->ctx->map.towns_per_chunk);
+}
+
+// NOTE: Lays out the islands and hands every client a starting town.
+// Terrain and the remaining towns come chunk by chunk as they are
+// discovered, unless there is a map cache, which holds every chunk.
 void generate_map(server_context *ctx, memory_arena *mem) {
-    real32 *noise_map = (real32 *)memory_arena_use(&ctx->temp_buffer, sizeof(*noise_map)
-                                                            * ctx->map.terrain_height
-                                                            * ctx->map.terrain_width
-                                                    );
-    for (u32 y = 0; y < ctx->map.terrain_height; ++y) {
-        for (u32 x = 0; x < ctx->map.terrain_width; ++x) {
-            u32 idx = y * ctx->map.terrain_height + x;
-            real32 nx = (real32)x / ctx->map.terrain_width - 0.5;
-            real32 ny = (real32)y / ctx->map.terrain_height - 0.5;
-            real32 freq = 9.0f;
-            real32 perlin = stb_perlin_noise3(nx * freq, ny * freq, 0, 0, 0, 0) / 2.0 + 0.5;
-            noise_map[idx] = perlin;
-        }
-    }
-
-    // TODO: Find some better way to determine how many islands should be generated
-    u32 num_islands = 50;
-    real32 min_radius = 4;
-    v2<u32> *island_centers = (v2<u32> *)memory_arena_use(&ctx->temp_buffer, sizeof(*island_centers)
-                                                            * num_islands);
-    for (u32 i = 0; i < num_islands; ++i) {
-        bool too_close = false;
-        v2<u32> center;
-        center.x = rand() % ctx->map.terrain_width;
-        center.y = rand() % ctx->map.terrain_height;
-
-        island_centers[i] = center;
-    }
-
-    u32 size_of_circles_map = sizeof(*noise_map) * ctx->map.terrain_height * ctx->map.terrain_width;
-    real32 *circles_map = (real32 *)memory_arena_use(&ctx->temp_buffer, size_of_circles_map);
-    memset(circles_map, 0, size_of_circles_map);
-
-    real32 radius = 3.0f;
-    for (u32 i = 0; i < num_islands; ++i) {
-        for (u32 y = 0; y < ctx->map.terrain_height; ++y) {
-            for (u32 x = 0; x < ctx->map.terrain_height; ++x) {
-                u32 idx = y * ctx->map.terrain_height + x;
-                v2<u32> pos = {.x = x, .y = y};
-                v2<u32> d = (pos - island_centers[i]);
-                real32 mag = d.length();
-                if (mag <= radius) {
-                    if (mag == 0)
-                        circles_map[idx] = 1.0f;
-                    else
-                        circles_map[idx] = 1.0f - mag/radius;
-                }
+    u32 width = ctx->map.terrain_width;
+    u32 height = ctx->map.terrain_height;
+    u64 seed = ctx->config.map_seed;
+    u32 num_chunks = map_num_chunks(width, height);
+
+    ctx->map.chunks_x = (width + MAP_CHUNK_SIZE - 1) >> MAP_CHUNK_SHIFT;
+    ctx->map.chunks_y = (height + MAP_CHUNK_SIZE - 1) >> MAP_CHUNK_SHIFT;
+    ctx->map.towns_per_chunk = map_towns_per_chunk(width, height);
+    ctx->map.chunk_generated = (bool *)memory_arena_use(mem, sizeof(*ctx->map.chunk_generated) * num_chunks);
+    ctx->map.chunk_num_towns = (u32 *)memory_arena_use(mem, sizeof(*ctx->map.chunk_num_towns) * num_chunks);
+    ctx->map.chunk_towns = (structure **)memory_arena_use(mem, sizeof(*ctx->map.chunk_towns)
+                                                          * num_chunks * ctx->map.towns_per_chunk);
+    ctx->map.chunk_units = (entity **)memory_arena_use(mem, sizeof(*ctx->map.chunk_units) * num_chunks);
+    memset(ctx->map.chunk_generated, 0, sizeof(*ctx->map.chunk_generated) * num_chunks);
+    memset(ctx->map.chunk_units, 0, sizeof(*ctx->map.chunk_units) * num_chunks);
+
+    // NOTE: Every island goes into the bucket of each chunk it reaches into
+    random_series series = random_seed(seed);
+    u32 num_islands = map_num_islands(width, height);
+    s32 reach = (s32)ceilf(MAP_ISLAND_RADIUS);
+    ctx->map.islands = (v2<u32> *)memory_arena_use(mem, sizeof(*ctx->map.islands) * num_islands);
+    ctx->map.chunk_island_offsets = (u32 *)memory_arena_use(mem, sizeof(*ctx->map.chunk_island_offsets) * (num_chunks + 1));
+    memset(ctx->map.chunk_island_offsets, 0, sizeof(*ctx->map.chunk_island_offsets) * (num_chunks + 1));
+    for (u32 pass = 0; pass < 2; ++pass) {
+        if (pass == 1) {
+            u32 total = 0;
+            for (u32 c = 0; c <= num_chunks; ++c) {
+                u32 count = ctx->map.chunk_island_offsets[c];
+                ctx->map.chunk_island_offsets[c] = total;
+                total += count;
             }
+            ctx->map.chunk_islands = (u32 *)memory_arena_use(mem, sizeof(*ctx->map.chunk_islands) * total);
         }
-    }
 
-    for (u32 y = 0; y < ctx->map.terrain_height; ++y) {
-        for (u32 x = 0; x < ctx->map.terrain_height; ++x) {
-            u32 idx = y * ctx->map.terrain_height + x;
-            real32 value = interpolate(noise_map[idx], circles_map[idx], 1.0);
-            if (value > 0.6) {
-                ctx->map.terrain[idx] = terrain_names::WATER;
-            } else if (value > 0.0) {
-                ctx->map.terrain[idx] = terrain_names::GRASS;
-            } else {
-                ctx->map.terrain[idx] = terrain_names::DESERT;
+        for (u32 i = 0; i < num_islands; ++i) {
+            if (pass == 0) {
+                ctx->map.islands[i].x = random_next_u32(&series) % width;
+                ctx->map.islands[i].y = random_next_u32(&series) % height;
+            }
+            v2<u32> center = ctx->map.islands[i];
+            u32 cx_min = (u32)MAX(0, (s32)center.x - reach) >> MAP_CHUNK_SHIFT;
+            u32 cx_max = MIN(width - 1, center.x + reach) >> MAP_CHUNK_SHIFT;
+            u32 cy_min = (u32)MAX(0, (s32)center.y - reach) >> MAP_CHUNK_SHIFT;
+            u32 cy_max = MIN(height - 1, center.y + reach) >> MAP_CHUNK_SHIFT;
+            for (u32 cy = cy_min; cy <= cy_max; ++cy) {
+                for (u32 cx = cx_min; cx <= cx_max; ++cx) {
+                    u32 c = cy * ctx->map.chunks_x + cx;
+                    if (pass == 0)
+                        ctx->map.chunk_island_offsets[c]++;
+                    else
+                        ctx->map.chunk_islands[ctx->map.chunk_island_offsets[c]++] = i;
+                }
             }
         }
     }
 
-    u32 prev_num_of_entities = ctx->map.entities.length();
-
-    for (u32 i = 0; i < num_islands; ++i) {
-        real32 direction_rad = ((real32)rand() / RAND_MAX) * (M_PI * 2);
-        real32 direction_x = cosf(direction_rad);
-        real32 direction_y = sinf(direction_rad);
-        s32 dir_x = 0;
-        s32 dir_y = 0;
-        if (direction_x > 0.5)
-            dir_x = 1;
-        else if (direction_x < -0.5)
-            dir_x = -1;
-
-        if (direction_y > 0.5)
-            dir_y = 1;
-        else if (direction_y < -0.5)
-            dir_y = -1;
-
-        u32 iter_x = island_centers[i].x;
-        u32 iter_y = island_centers[i].y;
-        
-        bool stuck = false;
-        bool found = false;
-        while (!found && !stuck) {
-            if (dir_x == 1)
-                if(iter_x == ctx->map.terrain_width - 1)
-                    stuck = true;
-                else
-                    iter_x += dir_x;
-            if (dir_x == -1)
-                if (iter_x == 0)
-                    stuck = true;
-                else
-                    iter_x += dir_x;
-            if (dir_y == 1)
-                if (iter_y == ctx->map.terrain_height - 1)
-                    stuck = true;
-                else
-                    iter_y += dir_y;
-            if (dir_y == -1)
-                if (iter_y == 0)
-                    stuck = true;
-                else
-                    iter_y += dir_y;
-
-            u32 idx = iter_y * ctx->map.terrain_width + iter_x;
-            if (ctx->map.terrain[idx] == terrain_names::GRASS) {
-                found = true;
-            }
+    // NOTE: Filling moved every offset to the end of its chunk, which is
+    // where the next chunk starts
+    for (u32 c = num_chunks; c > 0; --c) {
+        ctx->map.chunk_island_offsets[c] = ctx->map.chunk_island_offsets[c - 1];
+    }
+    ctx->map.chunk_island_offsets[0] = 0;
+
+    umax terrain_size = sizeof(*ctx->map.terrain) * num_chunks * MAP_CHUNK_TILES;
+    ctx->map.terrain_storage = (terrain_names *)memory_arena_use(mem, terrain_size);
+    ctx->map.terrain = ctx->map.terrain_storage;
+    map_cache *cache = &ctx->map.cache;
+    if (ctx->config.map_cache_dir && map_cache_open(cache, ctx->config.map_cache_dir, seed, width, height, num_chunks, terrain_size)) {
+        ctx->map.terrain = cache->terrain;
+        u32 first = 0;
+        for (u32 c = 0; c < num_chunks; ++c) {
+            map_add_chunk_towns(ctx, c, cache->towns + first, cache->chunk_num_towns[c]);
+            first += cache->chunk_num_towns[c];
         }
-
-        if (stuck) {
-            --i;
-            continue;
+    } else if (ctx->config.map_cache_dir) {
+        // NOTE: The cache needs the whole map, so it is generated up front,
+        // every chunk on its own worker
+        v2<u32> *towns = (v2<u32> *)memory_arena_use(&ctx->temp_buffer, sizeof(*towns) * num_chunks * ctx->map.towns_per_chunk);
+        u32 *num_towns = (u32 *)memory_arena_use(&ctx->temp_buffer, sizeof(*num_towns) * num_chunks);
+        map_chunk_job job = {ctx, towns, num_towns};
+        job_pool_parallel_for(ctx->config.pool, generate_chunk_job, &job, num_chunks);
+
+        // NOTE: Packed in chunk order for the file
+        u32 total = 0;
+        for (u32 c = 0; c < num_chunks; ++c) {
+            v2<u32> *chunk_towns = towns + (umax)c * ctx->map.towns_per_chunk;
+            map_add_chunk_towns(ctx, c, chunk_towns, num_towns[c]);
+            memmove(towns + total, chunk_towns, sizeof(*towns) * num_towns[c]);
+            total += num_towns[c];
         }
-
-        v2<u32> pos = {.x = iter_x, .y = iter_y};
-        structure *town = (structure *)memory_arena_use(mem, sizeof(*town));
-        ctx->map.entities.push_front(town);
-        town->type = entity_types::STRUCTURE;
-        town->position = pos;
-        town->owner = 0;
-        town->construction = unit_names::NONE;
-        town->server_id = ctx->ent_id_counter++;
+        map_cache_store(ctx->config.map_cache_dir, seed, width, height, num_chunks,
+                        terrain_size, ctx->map.terrain, num_towns, towns, total);
     }
 
-    u32 curr_num_of_entities = ctx->map.entities.length();
-    for (u32 i = 0; i < ctx->clients.used; ++i) {
-        for (;;) {
-            u32 town_id = (rand() % (curr_num_of_entities - prev_num_of_entities));
-            entity **ent_iter = ctx->map.entities.get(town_id);
-            if (ent_iter) {
-                auto ent = *ent_iter;
-                if (ent->owner == 0) {
-                    ent->owner = i;
+    // NOTE: Owners depend on the number of clients, so they are not part of
+    // the cached map and come from their own series. Every client tries a
+    // few random chunks for a free town before walking the chunks in order.
+    series = random_seed(seed + 1);
+    for (u32 i = 1; i < ctx->clients.used; ++i) {
+        structure *start = NULL;
+        u32 first_chunk = random_next_u32(&series) % num_chunks;
+        for (u32 attempt = 0; !start && attempt < MAP_START_ATTEMPTS + num_chunks; ++attempt) {
+            u32 chunk = attempt < MAP_START_ATTEMPTS
+                        ? random_next_u32(&series) % num_chunks
+                        : (first_chunk + attempt - MAP_START_ATTEMPTS) % num_chunks;
+            map_ensure_chunk(ctx, chunk);
+
+            u32 num_towns = ctx->map.chunk_num_towns[chunk];
+            structure **chunk_towns = ctx->map.chunk_towns + (umax)chunk * ctx->map.towns_per_chunk;
+            u32 offset = num_towns ? random_next_u32(&series) % num_towns : 0;
+            for (u32 t = 0; t < num_towns; ++t) {
+                structure *town = chunk_towns[(offset + t) % num_towns];
+                if (town->owner == 0) {
+                    start = town;
                     break;
                 }
             }
         }
+
+        if (!start) {
+            sitrep(SITREP_WARNING, "No free town left for client %u", i);
+            break;
+        }
+        entity_set_owner(ctx, start, i);
     }
 }
 
@@ -393,16 +1124,13 @@ void send_entire_map(communication *comm, server_context *ctx) {
     comm_server_discover_body_tile *tiles =
         (comm_server_discover_body_tile *)memory_arena_use(&ctx->temp_buffer,
                                             size_of_tiles);
-    u32 X = 0, Y = 0;
-    for (u32 i = 0; i < ctx->map.terrain_width * ctx->map.terrain_height; ++i) {
-        tiles[i].name = ctx->map.terrain[i];
-        tiles[i].position.x = X;
-        tiles[i].position.y = Y;
-
-        ++X;
-        if (X == ctx->map.terrain_width) {
-            ++Y;
-            X = 0;
+    u32 i = 0;
+    for (u32 Y = 0; Y < ctx->map.terrain_height; ++Y) {
+        for (u32 X = 0; X < ctx->map.terrain_width; ++X) {
+            tiles[i].name = map_terrain_at(ctx, X, Y);
+            tiles[i].position.x = X;
+            tiles[i].position.y = Y;
+            ++i;
         }
     }
     comm_write(comm, tiles, size_of_tiles);
@@ -421,41 +1149,645 @@ void send_entire_map(communication *comm, server_context *ctx) {
             discover_town_body.position = town->position;
             comm_write(comm, &discover_town_body, sizeof(discover_town_body));
         } else if (ent->type == entity_types::UNIT) {
-            auto u = (unit *)ent;
-            header.name = comm_server_msg_names::ADD_UNIT;
-            comm_write(comm, &header, sizeof(header));
+            send_add_unit(ctx, comm, (unit *)ent);
+        }
+        ent_iter = ent_iter->next;
+    }
+}
 
-            comm_server_add_unit_body body;
-            body.unit_id = u->server_id;
-            body.owner = u->owner;
-            body.action_points = u->action_points;
-            body.unit_name = u->name;
-            body.position = u->position;
-            comm_write(comm, &body, sizeof(body));
+// NOTE: Every unit the client owns or has vision of, sorted by id
+comm_sync_entity *sync_capture(server_context *ctx, u32 client_id, u32 *num) {
+    sync_state *sync = &ctx->clients.sync[client_id];
+    u32 bit = 1u << client_id;
+    *num = 0;
+
+    auto ent_iter = ctx->map.entities.first;
+    while (ent_iter) {
+        auto ent = ent_iter->payload;
+        if (ent->type == entity_types::UNIT) {
+            unit *u = (unit *)ent;
+            u32 idx = u->position.y * ctx->map.terrain_width + u->position.x;
+            if (u->owner == client_id || (ctx->map.observers[idx] & bit)) {
+                if (*num == sync->scratch_max) {
+                    sync->scratch_max = MAX(64, sync->scratch_max * 2);
+                    sync->scratch = (comm_sync_entity *)realloc(sync->scratch, sizeof(*sync->scratch) * sync->scratch_max);
+                    assert(sync->scratch);
+                }
+                comm_sync_entity *e = &sync->scratch[*num];
+                e->id = u->server_id;
+                e->owner = u->owner;
+                e->name = u->name;
+                e->action_points = u->action_points;
+                e->position = u->position;
+                (*num)++;
+            }
         }
         ent_iter = ent_iter->next;
     }
+
+    qsort(sync->scratch, *num, sizeof(*sync->scratch), comm_sync_entity_compare);
+    return sync->scratch;
+}
+
+// NOTE: Deltas are always taken against the newest state the client has
+// acknowledged, so a lost packet costs nothing but the bytes; the next
+// delta already carries whatever it held.
+void sync_write_delta(server_context *ctx, u32 client_id) {
+    sync_state *sync = &ctx->clients.sync[client_id];
+    communication *comm = &ctx->clients.comms[client_id];
+
+    u32 num_current;
+    comm_sync_entity *current = sync_capture(ctx, client_id, &num_current);
+
+    if (sync->sent_id != COMM_SYNC_NO_BASELINE) {
+        comm_sync_snapshot *sent = &sync->history[sync->sent_id % COMM_SYNC_HISTORY];
+        if (sent->num == num_current &&
+            (num_current == 0 || memcmp(sent->entities, current, sizeof(*current) * num_current) == 0)) {
+            return;
+        }
+    }
+
+    u32 id = sync->next_id++;
+
+    comm_sync_snapshot *baseline = NULL;
+    u32 baseline_id = COMM_SYNC_NO_BASELINE;
+    if (sync->acked_id != COMM_SYNC_NO_BASELINE && id - sync->acked_id < COMM_SYNC_HISTORY) {
+        baseline = &sync->history[sync->acked_id % COMM_SYNC_HISTORY];
+        baseline_id = sync->acked_id;
+    }
+
+    comm_write_entity_delta(comm, id, baseline_id,
+                            baseline ? baseline->entities : NULL, baseline ? baseline->num : 0,
+                            current, num_current);
+
+    comm_sync_store(&sync->history[id % COMM_SYNC_HISTORY], id, current, num_current);
+    sync->sent_id = id;
+}
+
+// NOTE: Drains everything the connection has, up to the per-tick budget,
+// so a burst is not stretched over one tick per packet
+JOB_FN(server_receive_one) {
+    server_context *ctx = (server_context *)data;
+    u32 i = index + 1;
+    server_inbound *inbound = &ctx->clients.inbound[i];
+
+    // NOTE: Dropped packets count against the budget too, so a flood of
+    // garbage can not keep the loop going
+    inbound->num_packets = 0;
+    for (u32 reads = 0; reads < ctx->clients.max_packets_per_tick; ++reads) {
+        u8 *buffer = inbound->buffer + inbound->num_packets * SERVER_CLIENT_READ_SIZE;
+        s32 len = comm_read(&ctx->clients.comms[i], buffer, SERVER_CLIENT_READ_SIZE);
+        if (len == 0)
+            break;
+        if (len < 0)
+            continue;
+
+        inbound->lens[inbound->num_packets++] = comm_client_validate(buffer, len);
+    }
 }
 
-void server_update(memory_arena *mem, communication *comms, u32 num_comms, server_input input, server_output *output) {
+JOB_FN(server_send_one) {
+    server_context *ctx = (server_context *)data;
+    u32 i = index + 1;
+
+    if (ctx->clients.connecteds[i]) {
+        communication *comm = &ctx->clients.comms[i];
+        outbound_flush(ctx, i);
+        if (ctx->config.delta_sync && ctx->current_state == server_state_names::LOOP) {
+            sync_write_delta(ctx, i);
+        }
+
+        if (time_get_now_in_ms() - comm->last_sent_time > SERVER_PING_MS) {
+            comm_server_header header;
+            header.name = comm_server_msg_names::PING;
+            comm_write(comm, &header, sizeof(header));
+        }
+
+        bool success = comm_flush(comm);
+        if (!success) {
+            ctx->clients.connecteds[i] = false;
+            sitrep(SITREP_INFO, "DISCONNECT");
+        }
+    }
+}
+
+// NOTE: When client i next needs a tick without any input, for its PING
+// or a retransmit. False once it is gone.
+bool server_wake_at(server_context *ctx, u32 i, u32 *when) {
+    if (i >= ctx->clients.used || !ctx->clients.connecteds[i])
+        return false;
+
+    communication *comm = &ctx->clients.comms[i];
+    *when = comm->last_sent_time + SERVER_PING_MS + 1;
+    u32 retransmit_at;
+    if (comm_retransmit_at(comm, &retransmit_at) && (s32)(retransmit_at - *when) < 0)
+        *when = retransmit_at;
+    return true;
+}
+
+// NOTE: In save.cpp, which needs all of server_context
+bool server_save(memory_arena *mem, char *path);
+s32 server_save_fork(memory_arena *mem, char *path);
+s32 server_save_fork_done(s32 pid, bool wait);
+u64 save_minor_faults();
+
+bool server_journal_open(server_context *ctx) {
+    journal_header header = {0};
+    header.map_seed = ctx->config.map_seed;
+    header.map_width = ctx->map.terrain_width;
+    header.map_height = ctx->map.terrain_height;
+    header.num_clients = ctx->clients.used - 1;
+    header.keyframe_turns = ctx->config.keyframe_turns ? ctx->config.keyframe_turns : JOURNAL_DEFAULT_KEYFRAME_TURNS;
+    return journal_open(&ctx->journal, ctx->config.journal_path, &header, ctx->config.journal_sync);
+}
+
+// NOTE: Saves the match as it is at this point of the journal. Written in
+// the tick, the record only goes in once the save is in place. Forked, it
+// goes in right away and a replay falls back to an earlier keyframe when
+// the child never finished.
+void server_keyframe(server_context *ctx) {
+    PROFILE_SCOPE(&ctx->profile, PROFILE_KEYFRAME);
+    match_journal *j = &ctx->journal;
+    char path[512];
+    journal_keyframe_path(path, sizeof(path), j->path, ctx->turn_number);
+
+    if (!ctx->config.fork_keyframes) {
+        if (server_save(ctx->memory, path)) {
+            if (j->sync)
+                journal_sync_dir(path);
+            journal_write(j, JOURNAL_KEYFRAME, 0, ctx->turn_number, NULL, 0);
+        }
+        return;
+    }
+
+    if (j->keyframe_pid > 0) {
+        sitrep(SITREP_WARNING, "Skipping keyframe of turn %u, turn %u is still being written",
+               ctx->turn_number, j->keyframe_turn);
+        return;
+    }
+
+    // NOTE: What reaches the disk after the fork is left to the parent
+    fflush(j->file);
+    u64 faults = save_minor_faults();
+    u64 start = profile_now();
+    s32 pid = server_save_fork(ctx->memory, path);
+    u64 fork_ns = profile_now() - start;
+    if (pid < 0) {
+        sitrep(SITREP_WARNING, "Could not fork for keyframe of turn %u", ctx->turn_number);
+        return;
+    }
+
+    j->keyframe_pid = pid;
+    j->keyframe_turn = ctx->turn_number;
+    j->keyframe_start = time_get_now_in_ms();
+    j->keyframe_fork_ms = fork_ns / 1000000.0f;
+    j->keyframe_faults = faults;
+    journal_write(j, JOURNAL_KEYFRAME, 0, ctx->turn_number, NULL, 0);
+}
+
+// NOTE: Collects the child writing a keyframe once it is done, waiting for
+// it if asked to
+void server_keyframe_reap(server_context *ctx, bool wait) {
+    match_journal *j = &ctx->journal;
+    if (j->keyframe_pid <= 0)
+        return;
+
+    s32 done = server_save_fork_done(j->keyframe_pid, wait);
+    if (done == 0)
+        return;
+
+    if (done > 0) {
+        sitrep(SITREP_INFO, "Keyframe of turn %u written in %u ms, fork took %.2f ms, %llu minor faults (process-wide)",
+               j->keyframe_turn, time_get_now_in_ms() - j->keyframe_start, j->keyframe_fork_ms,
+               (unsigned long long)(save_minor_faults() - j->keyframe_faults));
+    } else {
+        sitrep(SITREP_WARNING, "Could not write keyframe of turn %u", j->keyframe_turn);
+    }
+    j->keyframe_pid = 0;
+}
+
+// NOTE: Handles one validated packet from client i
+void server_handle_packet(server_context *ctx, memory_arena *mem, u32 i, u8 *read_buffer, u32 len) {
+    comm_client_header *header;
+    communication *comm = &ctx->clients.comms[i];
+    u32 read_it = sizeof(comm_shared_header);
+
+    if (ctx->current_state == server_state_names::AWAITING_CONNECTIONS) {
+        while (read_it < len) {
+            header = (comm_client_header *)(read_buffer + read_it);
+            if (header->name == comm_client_msg_names::START) {
+                if (ctx->clients.admins[i]) {
+                    ctx->current_state = ctx->resumed
+                                         ? server_state_names::RESUME_EVERYBODY
+                                         : server_state_names::INIT_EVERYBODY;
+                    sitrep(SITREP_DEBUG, "STARTING");
+                }
+            }
+            read_it += sizeof(*header) + comm_client_body_size(header->name);
+        }
+        return;
+    }
+
+    if (ctx->current_state != server_state_names::LOOP)
+        return;
+
+    while (read_it < len) {
+        if (len - read_it >= sizeof(*header)) {
+            header = (comm_client_header *)(read_buffer + read_it);
+            if (header->name != comm_client_msg_names::PONG &&
+                header->name != comm_client_msg_names::SYNC_ACK) {
+                journal_write(&ctx->journal, JOURNAL_COMMAND, i, ctx->turn_number, header,
+                              sizeof(*header) + comm_client_body_size(header->name));
+            }
+            read_it += sizeof(*header);
+            u64 message_start = profile_begin(&ctx->profile);
+            if (header->name == comm_client_msg_names::PONG) {
+            } else if (header->name == comm_client_msg_names::SYNC_ACK) {
+                comm_client_sync_ack_body *body =
+                    (comm_client_sync_ack_body *)(read_buffer + read_it);
+                read_it += sizeof(*body);
+
+                sync_state *sync = &ctx->clients.sync[i];
+                if (body->snapshot_id > sync->acked_id && body->snapshot_id < sync->next_id) {
+                    sync->acked_id = body->snapshot_id;
+                }
+            } else if (header->name == comm_client_msg_names::ADMIN_DISCOVER_ENTIRE_MAP) {
+                if (ctx->clients.admins[i]) {
+                    outbound_flush(ctx, i);
+                    send_entire_map(comm, ctx);
+                    for (u32 j = 0; j < ctx->map.terrain_width * ctx->map.terrain_height; ++j) {
+                        ctx->clients.discovered_map[i][j] = true;
+                    }
+                }
+            } else if (header->name == comm_client_msg_names::ADMIN_ADD_UNIT) {
+                comm_client_admin_add_unit_body *body =
+                    (comm_client_admin_add_unit_body *)(read_buffer + read_it);
+                read_it += sizeof(*body);
+
+                if (ctx->clients.admins[i] &&
+                    body->position.x < ctx->map.terrain_width &&
+                    body->position.y < ctx->map.terrain_height &&
+                    body->owner_id < ctx->clients.used) {
+                    add_unit(comm, ctx, body->position, body->name, body->owner_id, mem);
+                }
+            } else if (header->name == comm_client_msg_names::END_TURN) {
+                if ((s32)i == ctx->current_turn_id) {
+                    u64 rollover_start = profile_begin(&ctx->profile);
+                    ++ctx->turn_number;
+                    ctx->current_turn_id = (ctx->current_turn_id + 1) % ctx->clients.used;
+                    if (ctx->current_turn_id == 0)
+                        ctx->current_turn_id = 1;
+                    communication *c = &ctx->clients.comms[ctx->current_turn_id];
+                    
+                    comm_server_header head;
+                    head.name = comm_server_msg_names::YOUR_TURN;
+                    comm_write(c, &head, sizeof(head));
+                    
+
+                    s32 owner = ctx->current_turn_id;
+                    for (entity *ent = ctx->clients.owned_units[owner]; ent; ent = ent->owned_next) {
+                        unit *u = (unit *)ent;
+                        if (u->name == unit_names::SOLDIER) {
+                            u->action_points = 1;
+                        } else if (u->name == unit_names::CARAVAN) {
+                            u->action_points = 5;
+                        }
+
+                        if (!ctx->config.delta_sync) {
+                            head.name = comm_server_msg_names::SET_UNIT_ACTION_POINTS;
+                            comm_write(c, &head, sizeof(head));
+
+                            comm_server_set_unit_action_points_body body;
+                            body.unit_id = u->server_id;
+                            body.new_action_points = u->action_points;
+                            comm_write(c, &body, sizeof(body));
+                        }
+                    }
+
+                    // NOTE: Only the events of this turn come out, which are
+                    // all the owner's since every turn_number is one player's
+                    timer_event *event = timer_wheel_advance(&ctx->timers, ctx->turn_number);
+                    while (event) {
+                        timer_event *next = event->next;
+                        if (event->kind == TIMER_CONSTRUCTION) {
+                            auto town = (structure *)event->data;
+                            assert(town->owner == owner);
+                            add_unit(c, ctx, town->position, town->construction, owner, mem);
+
+                            event->due += construction_turns(town->construction) * (ctx->clients.used - 1);
+                            timer_wheel_insert(&ctx->timers, event);
+                        }
+                        event = next;
+                    }
+                    profile_end(&ctx->profile, PROFILE_TURN_ROLLOVER, rollover_start);
+
+                    if (ctx->journal.file && ctx->turn_number % ctx->journal.keyframe_turns == 0)
+                        server_keyframe(ctx);
+                }
+            } else if (header->name == comm_client_msg_names::SET_CONSTRUCTION) {
+                comm_client_set_construction_body *body =
+                    (comm_client_set_construction_body *)(read_buffer + read_it);
+                read_it += sizeof(*body);
+                if (ctx->current_turn_id == i) {
+                    for (entity *ent = ctx->clients.owned_towns[i]; ent; ent = ent->owned_next) {
+                        if (ent->server_id != body->town_id)
+                            continue;
+
+                        auto town = (structure *)ent;
+                        set_construction(ctx, town, body->unit_name);
+
+                        comm_server_header head;
+                        head.name = comm_server_msg_names::CONSTRUCTION_SET;
+                        comm_write(comm, &head, sizeof(head));
+
+                        comm_server_construction_set_body b;
+                        b.construction_timer = construction_turns(body->unit_name);
+                        b.town_id = body->town_id;
+                        b.unit_name = town->construction;
+                        comm_write(comm, &b, sizeof(b));
+                        break;
+                    }
+                }
+            } else if (header->name == comm_client_msg_names::MOVE_UNIT) {
+                comm_client_move_unit_body *body =
+                    (comm_client_move_unit_body *)(read_buffer + read_it);
+                read_it += sizeof(*body);
+                unit *u = find_owned_unit(ctx, i, body->unit_id);
+                if (u)
+                    move_unit_delta(comm, ctx, u, body->delta);
+            } else if (header->name == comm_client_msg_names::MOVE_PATH) {
+                comm_client_move_path_body *body =
+                    (comm_client_move_path_body *)(read_buffer + read_it);
+                read_it += sizeof(*body);
+                unit *u = find_owned_unit(ctx, i, body->unit_id);
+                if (u && u->loaded_by == NULL)
+                    move_unit_steps(comm, ctx, u, body->steps, body->num_steps);
+            } else if (header->name == comm_client_msg_names::LOAD_UNIT) {
+                comm_client_load_unit_body *body =
+                    (comm_client_load_unit_body *)(read_buffer + read_it);
+                read_it += sizeof(*body);
+                unit *unit_that_loads = find_owned_unit(ctx, i, body->unit_that_loads);
+                unit *u = find_owned_unit(ctx, i, body->unit_to_load);
+                if (u && unit_that_loads && u->action_points > 0) {
+                    u32 action_points = u->action_points - 1;
+
+                    v2<u32> prev_pos = u->position;
+                    vision_remove(i, ctx, prev_pos, sight_radius(ctx, u->name));
+
+                    u->action_points = action_points;
+                    unit_set_position(ctx, u, unit_that_loads->position);
+
+                    // NOTE: Either unit may only be staged so far
+                    outbound_flush(ctx, i);
+
+                    comm_server_header head;
+                    head.name = comm_server_msg_names::LOAD_UNIT;
+                    comm_write(comm, &head, sizeof(head));
+                    comm_server_load_unit_body b;
+                    b.unit_that_loads = unit_that_loads->server_id;
+                    b.unit_to_load = u->server_id;
+                    b.action_points_left = action_points;
+                    b.new_position = unit_that_loads->position;
+                    comm_write(comm, &b, sizeof(b));
+
+                    unit_that_loads->slot = u;
+                    u->loaded_by = unit_that_loads;
+
+                    broadcast_unit_moved(ctx, u, prev_pos);
+                }
+            } else if (header->name == comm_client_msg_names::UNLOAD_UNIT) {
+                comm_client_unload_unit_body *body =
+                    (comm_client_unload_unit_body *)(read_buffer + read_it);
+                read_it += sizeof(*body);
+                unit *u = find_owned_unit(ctx, i, body->unit_id);
+                if (u && u->loaded_by && u->action_points > 0) {
+                    v2<u32> pos = u->position;
+                    pos.x += body->delta.x;
+                    pos.y += body->delta.y;
+
+                    if (unit_can_enter(ctx, u, pos)) {
+                        v2<u32> prev_pos = u->position;
+                        u->action_points = u->action_points - 1;
+                        unit_set_position(ctx, u, pos);
+                        u->loaded_by->slot = NULL;
+                        u->loaded_by = NULL;
+
+                        outbound_flush(ctx, i);
+
+                        comm_server_header head;
+                        head.name = comm_server_msg_names::UNLOAD_UNIT;
+                        comm_server_unload_unit_body b;
+                        b.unit_id = u->server_id;
+                        b.action_points_left = u->action_points;
+                        b.new_position = pos;
+                        comm_write(comm, &head, sizeof(head));
+                        comm_write(comm, &b, sizeof(b));
+
+                        vision_add(i, ctx, pos, sight_radius(ctx, u->name));
+                        broadcast_unit_moved(ctx, u, prev_pos);
+                    }
+                }
+            }
+            if ((u32)header->name < PROFILE_NUM_MESSAGES)
+                profile_end(&ctx->profile, PROFILE_MESSAGES + (u32)header->name, message_start);
+        }
+    }
+}
+
+// NOTE: Hands out the drained packets one round at a time, the first
+// packet of every client before anyone's second, and starts each tick's
+// rounds at the next client so nobody is always served first
+void server_handle_inbound(server_context *ctx, memory_arena *mem) {
+    u32 num_clients = ctx->clients.used - 1;
+    if (num_clients == 0)
+        return;
+
+    for (u32 round = 0; round < ctx->clients.max_packets_per_tick; ++round) {
+        bool any = false;
+        for (u32 k = 0; k < num_clients; ++k) {
+            u32 i = 1 + (ctx->clients.round_robin_start + k) % num_clients;
+            server_inbound *inbound = &ctx->clients.inbound[i];
+            if (round < inbound->num_packets) {
+                server_handle_packet(ctx, mem, i, inbound->buffer + round * SERVER_CLIENT_READ_SIZE, inbound->lens[round]);
+                any = true;
+            }
+        }
+        if (!any)
+            break;
+    }
+
+    ctx->clients.round_robin_start = (ctx->clients.round_robin_start + 1) % num_clients;
+}
+
+// NOTE: Brings a client that reconnected to a loaded match up to date:
+// everything it discovered, the towns and units it can see and its
+// constructions. Sent in packets of about SERVER_RESUME_FLUSH_SIZE.
+void server_resume_client(server_context *ctx, u32 client_id) {
+    communication *comm = &ctx->clients.comms[client_id];
+    comm_server_header header;
+
+    header.name = comm_server_msg_names::STARTING;
+    comm_write(comm, &header, sizeof(header));
+    comm_flush(comm);
+
+    header.name = comm_server_msg_names::INIT_MAP;
+    comm_write(comm, &header, sizeof(header));
+    comm_server_init_map_body init_map_body;
+    init_map_body.num_clients = ctx->clients.used;
+    init_map_body.your_id = client_id;
+    init_map_body.width = ctx->map.terrain_width;
+    init_map_body.height = ctx->map.terrain_height;
+    init_map_body.flags = ctx->config.delta_sync ? COMM_INIT_MAP_DELTA_SYNC : 0;
+    comm_write(comm, &init_map_body, sizeof(init_map_body));
+    comm_flush(comm);
+
+    u32 max_tiles = SERVER_RESUME_FLUSH_SIZE / sizeof(comm_server_discover_body_tile);
+    comm_server_discover_body_tile *tiles = (comm_server_discover_body_tile *)memory_arena_use(
+                                                &ctx->temp_buffer, sizeof(*tiles) * max_tiles);
+    bool *discovered = ctx->clients.discovered_map[client_id];
+    comm_server_discover_body discover_body;
+    discover_body.num = 0;
+    u32 idx = 0;
+    for (u32 Y = 0; Y < ctx->map.terrain_height; ++Y) {
+        for (u32 X = 0; X < ctx->map.terrain_width; ++X, ++idx) {
+            if (!discovered[idx])
+                continue;
+
+            tiles[discover_body.num].position.x = X;
+            tiles[discover_body.num].position.y = Y;
+            tiles[discover_body.num].name = map_terrain_at(ctx, X, Y);
+            if (++discover_body.num == max_tiles) {
+                header.name = comm_server_msg_names::DISCOVER;
+                comm_write(comm, &header, sizeof(header));
+                comm_write(comm, &discover_body, sizeof(discover_body));
+                comm_write(comm, tiles, sizeof(*tiles) * discover_body.num);
+                comm_flush(comm);
+                discover_body.num = 0;
+            }
+        }
+    }
+    if (discover_body.num > 0) {
+        header.name = comm_server_msg_names::DISCOVER;
+        comm_write(comm, &header, sizeof(header));
+        comm_write(comm, &discover_body, sizeof(discover_body));
+        comm_write(comm, tiles, sizeof(*tiles) * discover_body.num);
+        comm_flush(comm);
+    }
+
+    // NOTE: Every unit is added before any is loaded into another
+    for (u32 pass = 0; pass < 2; ++pass) {
+        for (auto iter = ctx->map.entities.first; iter; iter = iter->next) {
+            entity *ent = iter->payload;
+            u32 idx = ent->position.y * ctx->map.terrain_width + ent->position.x;
+            bool own = ent->owner == (s32)client_id;
+
+            if (ent->type == entity_types::STRUCTURE) {
+                structure *town = (structure *)ent;
+                if (pass == 0 && discovered[idx]) {
+                    header.name = comm_server_msg_names::DISCOVER_TOWN;
+                    comm_write(comm, &header, sizeof(header));
+                    comm_server_discover_town_body discover_town_body;
+                    discover_town_body.id = town->server_id;
+                    discover_town_body.owner = town->owner;
+                    discover_town_body.position = town->position;
+                    comm_write(comm, &discover_town_body, sizeof(discover_town_body));
+                }
+                if (pass == 1 && own && town->construction != unit_names::NONE) {
+                    header.name = comm_server_msg_names::CONSTRUCTION_SET;
+                    comm_write(comm, &header, sizeof(header));
+                    comm_server_construction_set_body b;
+                    b.town_id = town->server_id;
+                    b.construction_timer = construction_turns_left(ctx, town);
+                    b.unit_name = town->construction;
+                    comm_write(comm, &b, sizeof(b));
+                }
+            } else {
+                unit *u = (unit *)ent;
+                if (pass == 0 && (own || (ctx->map.observers[idx] & (1u << client_id)))) {
+                    send_add_unit(ctx, comm, u);
+                }
+                if (pass == 1 && own && u->loaded_by && !ctx->config.delta_sync) {
+                    header.name = comm_server_msg_names::LOAD_UNIT;
+                    comm_write(comm, &header, sizeof(header));
+                    comm_server_load_unit_body b;
+                    b.unit_that_loads = u->loaded_by->server_id;
+                    b.unit_to_load = u->server_id;
+                    b.action_points_left = u->action_points;
+                    b.new_position = u->position;
+                    comm_write(comm, &b, sizeof(b));
+                }
+            }
+
+            if (comm->buffer.used >= SERVER_RESUME_FLUSH_SIZE)
+                comm_flush(comm);
+        }
+    }
+
+    if ((s32)client_id == ctx->current_turn_id) {
+        header.name = comm_server_msg_names::YOUR_TURN;
+        comm_write(comm, &header, sizeof(header));
+    }
+    comm_flush(comm);
+}
+
+void map_dimensions(server_config config, u32 *width, u32 *height) {
+    *width = config.map_width ? config.map_width : MAP_DEFAULT_WIDTH;
+    *height = config.map_height ? config.map_height : MAP_DEFAULT_HEIGHT;
+    *width = MIN(MAP_MAX_SIZE, MAX(MAP_MIN_SIZE, *width));
+    *height = MIN(MAP_MAX_SIZE, MAX(MAP_MIN_SIZE, *height));
+}
+
+// NOTE: Room for a tick's scratch, or for generating every chunk at once
+// when the map goes to the cache
+umax server_temp_size(u32 width, u32 height) {
+    umax num_chunks = map_num_chunks(width, height);
+    umax generation = (sizeof(v2<u32>) * map_towns_per_chunk(width, height) + sizeof(u32)) * num_chunks;
+    return MB(80) + generation;
+}
+
+// NOTE: What server_update carves out of its arena for this config, plus
+// room for the units built during a match. Callers size the arena with it.
+umax server_memory_size(server_config config, u32 num_comms) {
+    u32 width, height;
+    map_dimensions(config, &width, &height);
+    umax area = (umax)width * height;
+    umax packets = config.max_packets_per_tick ? config.max_packets_per_tick : SERVER_DEFAULT_PACKETS_PER_TICK;
+
+    umax rv = sizeof(server_context) + server_temp_size(width, height);
+    umax num_chunks = map_num_chunks(width, height);
+    umax num_towns = num_chunks * map_towns_per_chunk(width, height);
+    rv += sizeof(terrain_names) * num_chunks * MAP_CHUNK_TILES + sizeof(u32) * area;
+    rv += (sizeof(bool) + sizeof(u32) * 2 + sizeof(entity *)) * num_chunks + sizeof(u32);
+    rv += (sizeof(v2<u32>) + sizeof(u32) * 4) * map_num_islands(width, height);
+    rv += (sizeof(structure) + sizeof(structure *) + sizeof(timer_event)) * num_towns;
+    rv += SERVER_CLIENT_SLOTS * (sizeof(communication) + sizeof(bool) * 2 + sizeof(bool *) + sizeof(u16 *)
+                                + sizeof(server_inbound) + sizeof(server_outbound) + sizeof(sync_state)
+                                + sizeof(entity *) * 2);
+    rv += num_comms * ((sizeof(bool) + sizeof(u16)) * area
+                       + (SERVER_CLIENT_READ_SIZE + sizeof(u32)) * packets
+                       + sizeof(outbound_unit) * SERVER_OUTBOUND_MAX_STAGED
+                       + (sizeof(u16) << SERVER_OUTBOUND_TABLE_BITS));
+    rv += MB(32);
+    return rv;
+}
+
+void server_update(memory_arena *mem, communication *comms, u32 num_comms, server_config config, server_input input, server_output *output) {
     struct server_context *ctx = (struct server_context *)mem->base;
+    ctx->memory = mem;
 
     if (!ctx->is_init) {
         memory_arena_use(mem, sizeof(*ctx));
 
-        ctx->temp_buffer = memory_arena_child(mem, MB(80), "server_memory_temp");
-        ctx->read_buffer = memory_arena_child(mem, MB(10), "server_memory_read");
+        u32 width, height;
+        map_dimensions(config, &width, &height);
+        ctx->temp_buffer = memory_arena_child(mem, server_temp_size(width, height), "server_memory_temp");
+        ctx->config = config;
 
-        ctx->map.terrain_width = MAP_GRID_WIDTH;
-        ctx->map.terrain_height = MAP_GRID_HEIGHT;
-        ctx->map.terrain = (terrain_names *)memory_arena_use(mem,
-                                                sizeof(*ctx->map.terrain)
-                                                * ctx->map.terrain_width
-                                                * ctx->map.terrain_height
-                                                );
+        ctx->map.terrain_width = width;
+        ctx->map.terrain_height = height;
 
         ctx->clients.used = 1;
-        ctx->clients.max = 32;
+        ctx->clients.max = SERVER_CLIENT_SLOTS;
         ctx->clients.comms = (communication *)memory_arena_use(mem,
                                                 sizeof(*ctx->clients.comms)
                                                 * ctx->clients.max
@@ -472,12 +1804,50 @@ void server_update(memory_arena *mem, communication *comms, u32 num_comms, serve
                                                 sizeof(*ctx->clients.discovered_map)
                                                 * ctx->clients.max
                                                 );
+        ctx->clients.vision = (u16 **)memory_arena_use(mem,
+                                                sizeof(*ctx->clients.vision)
+                                                * ctx->clients.max
+                                                );
+        ctx->clients.inbound = (server_inbound *)memory_arena_use(mem,
+                                                sizeof(*ctx->clients.inbound)
+                                                * ctx->clients.max
+                                                );
+        ctx->clients.outbound = (server_outbound *)memory_arena_use(mem,
+                                                sizeof(*ctx->clients.outbound)
+                                                * ctx->clients.max
+                                                );
+        memset(ctx->clients.outbound, 0, sizeof(*ctx->clients.outbound) * ctx->clients.max);
+        ctx->clients.max_packets_per_tick = config.max_packets_per_tick
+                                            ? config.max_packets_per_tick
+                                            : SERVER_DEFAULT_PACKETS_PER_TICK;
+        ctx->clients.round_robin_start = 0;
+        ctx->clients.sync = (sync_state *)memory_arena_use(mem,
+                                                sizeof(*ctx->clients.sync)
+                                                * ctx->clients.max
+                                                );
+        ctx->clients.owned_units = (entity **)memory_arena_use(mem, sizeof(*ctx->clients.owned_units) * ctx->clients.max);
+        ctx->clients.owned_towns = (entity **)memory_arena_use(mem, sizeof(*ctx->clients.owned_towns) * ctx->clients.max);
+        memset(ctx->clients.sync, 0, sizeof(*ctx->clients.sync) * ctx->clients.max);
+        for (u32 i = 0; i < ctx->clients.max; ++i) {
+            ctx->clients.sync[i].next_id = COMM_SYNC_NO_BASELINE + 1;
+        }
 
         u32 terrain_size = ctx->map.terrain_width * ctx->map.terrain_height;
+        ctx->map.observers = (u32 *)memory_arena_use(mem, sizeof(*ctx->map.observers) * terrain_size);
         for (u32 i = 0; i < num_comms; ++i) {
             ctx->clients.connecteds[i + 1] = true;
             ctx->clients.comms[i + 1] = comms[i];
             ctx->clients.discovered_map[i + 1] = (bool *)memory_arena_use(mem, sizeof(**ctx->clients.discovered_map) * terrain_size);
+            ctx->clients.vision[i + 1] = (u16 *)memory_arena_use(mem, sizeof(**ctx->clients.vision) * terrain_size);
+            server_inbound *inbound = &ctx->clients.inbound[i + 1];
+            inbound->buffer = memory_arena_use(mem, SERVER_CLIENT_READ_SIZE * ctx->clients.max_packets_per_tick);
+            inbound->lens = (u32 *)memory_arena_use(mem, sizeof(*inbound->lens) * ctx->clients.max_packets_per_tick);
+            inbound->num_packets = 0;
+            server_outbound *outbound = &ctx->clients.outbound[i + 1];
+            outbound->staged = (outbound_unit *)memory_arena_use(mem, sizeof(*outbound->staged) * SERVER_OUTBOUND_MAX_STAGED);
+            outbound->table = (u16 *)memory_arena_use(mem, sizeof(*outbound->table) << SERVER_OUTBOUND_TABLE_BITS);
+            memset(outbound->table, 0, sizeof(*outbound->table) << SERVER_OUTBOUND_TABLE_BITS);
+            outbound->num_staged = 0;
             ++ctx->clients.used;
         }
         ctx->clients.connecteds[0] = false;
@@ -486,34 +1856,42 @@ void server_update(memory_arena *mem, communication *comms, u32 num_comms, serve
         generate_map(ctx, mem);
 
         ctx->current_turn_id = 0;
+
+        if (config.journal_path)
+            server_journal_open(ctx);
         
         ctx->is_init = true;
     }
 
+    if (ctx->reattach) {
+        for (u32 i = 0; i < num_comms; ++i) {
+            ctx->clients.comms[i + 1] = comms[i];
+            ctx->clients.connecteds[i + 1] = true;
+        }
+        ctx->reattach = false;
+
+        // NOTE: A loaded match journals from a keyframe of where it is
+        if (ctx->config.journal_path && server_journal_open(ctx))
+            server_keyframe(ctx);
+    }
+
+    ctx->profile.enabled = ctx->config.profile;
+    u64 tick_start = profile_begin(&ctx->profile);
+
     output->current_turn_id = ctx->current_turn_id;
+    server_keyframe_reap(ctx, false);
+
+    // NOTE: Receiving, ack processing and validation only touch their own
+    // connection, so they run in parallel. Handling the messages mutates
+    // the game and stays serial.
+    if (ctx->current_state != server_state_names::INIT_EVERYBODY &&
+        ctx->current_state != server_state_names::RESUME_EVERYBODY) {
+        u64 start = profile_begin(&ctx->profile);
+        job_pool_parallel_for(ctx->config.pool, server_receive_one, ctx, ctx->clients.used - 1);
+        profile_end(&ctx->profile, PROFILE_RECEIVE, start);
+    }
 
-    if (ctx->current_state == server_state_names::AWAITING_CONNECTIONS) {
-        for (u32 i = 1; i < ctx->clients.used; ++i) {
-            comm_client_header *header;
-            communication *comm = &ctx->clients.comms[i];
-            s32 len = comm_read(comm, ctx->read_buffer.base, ctx->read_buffer.max);
-			u32 read_it = sizeof(comm_shared_header);
-            
-			while (read_it < len) {
-				if (len - read_it >= sizeof(*header)) {
-					header = (comm_client_header *)(ctx->read_buffer.base + read_it);
-					if(header->name == comm_client_msg_names::START) {
-						if (ctx->clients.admins[i]) {
-							ctx->current_state = server_state_names::INIT_EVERYBODY;
-							sitrep(SITREP_DEBUG, "STARTING");
-						}
-					}
-					read_it += sizeof(*header);
-				} else
-					break;
-            }
-        }
-    } else if (ctx->current_state == server_state_names::INIT_EVERYBODY) {
+    if (ctx->current_state == server_state_names::INIT_EVERYBODY) {
         for (u32 i = 1; i < ctx->clients.used; ++i) {
             comm_server_header header;
             communication *comm = &ctx->clients.comms[i];
@@ -530,31 +1908,28 @@ void server_update(memory_arena *mem, communication *comms, u32 num_comms, serve
             init_map_body.your_id = i;
             init_map_body.width = ctx->map.terrain_width;
             init_map_body.height = ctx->map.terrain_height;
+            init_map_body.flags = ctx->config.delta_sync ? COMM_INIT_MAP_DELTA_SYNC : 0;
             comm_write(comm, &init_map_body, sizeof(init_map_body));
 
             comm_flush(comm);
 
-            auto ent_iter = ctx->map.entities.first;
-            while (ent_iter) {
-                auto ent = ent_iter->payload;
-                if (ent->owner == i && ent->type == entity_types::STRUCTURE) {
-                    auto town = (structure *)ent;
-                    discover_3x3(i, ctx, town->position);
+            for (entity *ent = ctx->clients.owned_towns[i]; ent; ent = ent->owned_next) {
+                auto town = (structure *)ent;
+                vision_add(i, ctx, town->position, sight_radius(ctx, unit_names::NONE));
 
-                    comm_server_discover_town_body discover_town_body;
+                comm_server_discover_town_body discover_town_body;
 
-                    header.name = comm_server_msg_names::DISCOVER_TOWN;
-                    comm_write(comm, &header, sizeof(header));
-                    discover_town_body.position = town->position;
-                    discover_town_body.id = town->server_id;
-                    discover_town_body.owner = town->owner;
-                    comm_write(comm, &discover_town_body, sizeof(discover_town_body));
+                header.name = comm_server_msg_names::DISCOVER_TOWN;
+                comm_write(comm, &header, sizeof(header));
+                discover_town_body.position = town->position;
+                discover_town_body.id = town->server_id;
+                discover_town_body.owner = town->owner;
+                comm_write(comm, &discover_town_body, sizeof(discover_town_body));
 
-                    add_unit(comm, ctx, town->position, unit_names::SOLDIER, i, mem);
+                add_unit(comm, ctx, town->position, unit_names::SOLDIER, i, mem);
 
-                    comm_flush(comm);
-                }
-                ent_iter = ent_iter->next;
+                outbound_flush(ctx, i);
+                comm_flush(comm);
             }
 
 			if (i == 1) {
@@ -566,260 +1941,53 @@ void server_update(memory_arena *mem, communication *comms, u32 num_comms, serve
         }
 
         ctx->current_state = server_state_names::LOOP;
-    } else if (ctx->current_state == server_state_names::LOOP) {
+        if (ctx->journal.file)
+            server_keyframe(ctx);
+    } else if (ctx->current_state == server_state_names::RESUME_EVERYBODY) {
         for (u32 i = 1; i < ctx->clients.used; ++i) {
-            comm_client_header *header;
-            communication *comm = &ctx->clients.comms[i];
-            s32 len = comm_read(comm, ctx->read_buffer.base, ctx->read_buffer.max);
-            u32 read_it = sizeof(comm_shared_header);
-
-            while (read_it < len) {
-				if (len - read_it >= sizeof(*header)) {
-                    header = (comm_client_header *)(ctx->read_buffer.base + read_it);
-                    read_it += sizeof(*header);
-                    if (header->name == comm_client_msg_names::PONG) {
-                    } else if (header->name == comm_client_msg_names::ADMIN_DISCOVER_ENTIRE_MAP) {
-                        if (ctx->clients.admins[i]) {
-                            send_entire_map(comm, ctx);
-                            for (u32 j = 0; j < ctx->map.terrain_width * ctx->map.terrain_height; ++j) {
-                                ctx->clients.discovered_map[i][j] = true;
-                            }
-                        }
-                    } else if (header->name == comm_client_msg_names::ADMIN_ADD_UNIT) {
-                        if (ctx->clients.admins[i]) {
-                            comm_client_admin_add_unit_body *body =
-                                (comm_client_admin_add_unit_body *)(ctx->read_buffer.base + read_it);
-                            read_it += sizeof(*body);
-
-                            add_unit(comm, ctx, body->position, body->name, body->owner_id, mem);
-                        }
-                    } else if (header->name == comm_client_msg_names::END_TURN) {
-                        if ((s32)i == ctx->current_turn_id) {
-                            ctx->current_turn_id = (ctx->current_turn_id + 1) % ctx->clients.used;
-                            if (ctx->current_turn_id == 0)
-                                ctx->current_turn_id = 1;
-                            communication *c = &ctx->clients.comms[ctx->current_turn_id];
-                            
-                            comm_server_header head;
-                            head.name = comm_server_msg_names::YOUR_TURN;
-                            comm_write(c, &head, sizeof(head));
-                            
-
-                            auto iter = ctx->map.entities.first;
-                            while (iter) {
-                                auto ent = iter->payload;
-                                if (ent->type == entity_types::UNIT) {
-                                    unit *u = (unit *)ent;
-                                    if (u->owner == ctx->current_turn_id) {
-                                        if (u->name == unit_names::SOLDIER) {
-                                            u->action_points = 1;
-                                        } else if (u->name == unit_names::CARAVAN) {
-                                            u->action_points = 5;
-                                        }
-
-                                        head.name = comm_server_msg_names::SET_UNIT_ACTION_POINTS;
-                                        comm_write(c, &head, sizeof(head));
-
-                                        comm_server_set_unit_action_points_body body;
-                                        body.unit_id = u->server_id;
-                                        body.new_action_points = u->action_points;
-                                        comm_write(c, &body, sizeof(body));
-                                    }
-                                }
-                                iter = iter->next;
-                            }
-
-                            iter = ctx->map.entities.first;
-                            while (iter) {
-                                auto ent = iter->payload;
-                                if (ent->type == entity_types::STRUCTURE) {
-                                    auto town = (structure *)ent;
-                                    if (town->owner == ctx->current_turn_id) {
-                                        unit_names name = town->construction;
-                                        if (name != unit_names::NONE) {
-                                            u32 timer = --town->construction_timer;
-                                            if (timer == 0) {
-                                                if (name == unit_names::SOLDIER) {
-                                                    timer = 3;
-                                                } else if (name == unit_names::CARAVAN) {
-                                                    timer = 5;
-                                                }
-
-                                                add_unit(c, ctx, town->position, name, ctx->current_turn_id, mem);
-
-                                                town->construction_timer = timer;
-                                            }
-                                        }
-                                    }
-                                }
-                                iter = iter->next;
-                            }
-                        }
-                    } else if (header->name == comm_client_msg_names::SET_CONSTRUCTION) {
-                        if (ctx->current_turn_id == i) {
-                            comm_client_set_construction_body *body =
-                                (comm_client_set_construction_body *)(ctx->read_buffer.base + read_it);
-                            read_it += sizeof(*body);
-                            auto ent_iter = ctx->map.entities.first;
-                            while (ent_iter) {
-                                auto ent = ent_iter->payload;
-                                s32 owner = ent->owner;
-                                if (owner == i && ent->type == entity_types::STRUCTURE) {
-                                    auto town = (structure *)ent;
-                                    town->construction = body->unit_name;
-
-                                    if (body->unit_name == unit_names::SOLDIER) {
-                                        town->construction_timer = 3;
-                                    } else if (body->unit_name == unit_names::CARAVAN) {
-                                        town->construction_timer = 5;
-                                    }
-
-                                    comm_server_header head;
-                                    head.name = comm_server_msg_names::CONSTRUCTION_SET;
-                                    comm_write(comm, &head, sizeof(head));
-
-                                    comm_server_construction_set_body b;
-                                    b.construction_timer = town->construction_timer;
-                                    b.town_id = body->town_id;
-                                    b.unit_name = body->unit_name;
-                                    comm_write(comm, &b, sizeof(b));
-                                }
-                                ent_iter = ent_iter->next;
-                            }
-                        }
-                    } else if (header->name == comm_client_msg_names::MOVE_UNIT) {
-                        comm_client_move_unit_body *body =
-                            (comm_client_move_unit_body *)(ctx->read_buffer.base + read_it);
-                        read_it += sizeof(*body);
-                        auto ent_iter = ctx->map.entities.first;
-                        while (ent_iter) {
-                            auto ent = ent_iter->payload;
-                            if (ent->type == entity_types::UNIT &&
-                                i == ent->owner &&
-                                body->unit_id == ent->server_id) {
-                                auto u = (unit *)ent;
-
-                                move_unit_delta(comm, ctx, u, body->delta);
-                                break;
-                            }
-                            ent_iter = ent_iter->next;
-                        }
-                    } else if (header->name == comm_client_msg_names::LOAD_UNIT) {
-                        comm_client_load_unit_body *body =
-                            (comm_client_load_unit_body *)(ctx->read_buffer.base + read_it);
-                        read_it += sizeof(*body);
-                        auto ent_that_loads = find_entity_by_server_id(ctx->map.entities, body->unit_that_loads);
-                        auto ent = find_entity_by_server_id(ctx->map.entities, body->unit_to_load);
-                        if (ent && ent->type == entity_types::UNIT && ent_that_loads && ent_that_loads->type == entity_types::UNIT) {
-                            auto unit_that_loads = (unit *)ent_that_loads;
-                            auto u = (unit *)ent;
-                            s32 owner_that_loads = unit_that_loads->owner;
-                            s32 owner = ent->owner;
-                            if (owner == i && i == owner_that_loads) {
-                                u32 action_points = u->action_points;
-                                if (action_points > 0) {
-                                    --action_points;
-
-                                    u->action_points = action_points;
-                                    u->position = unit_that_loads->position;
-
-                                    comm_server_header head;
-                                    head.name = comm_server_msg_names::LOAD_UNIT;
-                                    comm_write(comm, &head, sizeof(head));
-                                    comm_server_load_unit_body b;
-                                    b.unit_that_loads = unit_that_loads->server_id;
-                                    b.unit_to_load = u->server_id;
-                                    b.action_points_left = action_points;
-                                    b.new_position = unit_that_loads->position;
-                                    comm_write(comm, &b, sizeof(b));
-
-                                    unit_that_loads->slot = u;
-                                    u->loaded_by = unit_that_loads;
-                                }
-                            }
-                        }
-                    } else if (header->name == comm_client_msg_names::UNLOAD_UNIT) {
-                        comm_client_unload_unit_body *body =
-                            (comm_client_unload_unit_body *)(ctx->read_buffer.base + read_it);
-                        read_it += sizeof(*body);
-                        auto ent_iter = ctx->map.entities.first;
-                        while (ent_iter) {
-                            auto ent = ent_iter->payload;
-                            s32 owner = ent->owner;
-                            if (owner == i && ent->type == entity_types::UNIT &&
-                                body->unit_id == ent->server_id) {
-                                auto u = (unit *)ent;
-                                if (u->loaded_by) {
-                                    v2<s32> d = body->delta;
-                                    u32 action_points = u->action_points;
-                                    if (action_points > 0) {
-                                        action_points--;
-
-                                        v2<u32> pos = u->position;
-                                        pos.x += d.x;
-                                        pos.y += d.y;
-
-                                        u32 idx = pos.y * ctx->map.terrain_width + pos.x;
-                                        bool passable = false;
-                                        unit_names name = u->name;
-                                        terrain_names terrain = ctx->map.terrain[idx];
-                                        if (name == unit_names::SOLDIER) {
-                                            if (terrain == terrain_names::GRASS) {
-                                                passable = true;
-                                            }
-                                        } else if (name == unit_names::CARAVAN) {
-                                            if (terrain == terrain_names::GRASS ||
-                                                terrain == terrain_names::DESERT) {
-                                                passable = true;
-                                            }
-                                        }
-
-                                        if (passable) {
-                                            u->action_points = action_points;
-                                            u->position = pos;
-                                            u->loaded_by->slot = NULL;
-                                            u->loaded_by = NULL;
-
-                                            comm_server_header head;
-                                            head.name = comm_server_msg_names::UNLOAD_UNIT;
-                                            comm_server_unload_unit_body b;
-                                            b.unit_id = u->server_id;
-                                            b.action_points_left = u->action_points;
-                                            b.new_position = pos;
-                                            comm_write(comm, &head, sizeof(head));
-                                            comm_write(comm, &b, sizeof(b));
-
-                                            discover_3x3(i, ctx, pos);
-                                        }
-                                        break;
-                                    }
-                                }
-                            }
-
-                            ent_iter = ent_iter->next;
-                        }
-                    }
-                }
-            }
+            server_resume_client(ctx, i);
         }
-    }
 
-    for (u32 i = 1; i < ctx->clients.used; ++i) {
-        if (ctx->clients.connecteds[i]) {
-            communication *comm = &ctx->clients.comms[i];
-            if (time_get_now_in_ms() - comm->last_sent_time > 300) {
-                comm_server_header header;
-                header.name = comm_server_msg_names::PING;
-                comm_write(comm, &header, sizeof(header));
-            }
-            
-            bool success = comm_flush(comm);
-            if (!success) {
-                ctx->clients.connecteds[i] = false;
-                sitrep(SITREP_INFO, "DISCONNECT");
-            }
-        }
+        ctx->resumed = false;
+        ctx->current_state = server_state_names::LOOP;
+    } else {
+        u64 start = profile_begin(&ctx->profile);
+        server_handle_inbound(ctx, mem);
+        profile_end(&ctx->profile, PROFILE_HANDLE, start);
     }
 
+    u64 commit_start = profile_begin(&ctx->profile);
+    output->journal_sync_ms = journal_commit(&ctx->journal);
+    profile_end(&ctx->profile, PROFILE_JOURNAL_COMMIT, commit_start);
+
+    // NOTE: Encoding deltas and flushing only read the game state
+    u64 send_start = profile_begin(&ctx->profile);
+    job_pool_parallel_for(ctx->config.pool, server_send_one, ctx, ctx->clients.used - 1);
+    profile_end(&ctx->profile, PROFILE_SEND, send_start);
+
     ctx->temp_buffer.used = 0;
+    profile_end(&ctx->profile, PROFILE_TICK, tick_start);
+}
+
+// NOTE: Gives back what the arena does not own, call before freeing it
+void server_release(memory_arena *mem) {
+    server_context *ctx = (server_context *)mem->base;
+    if (!ctx->is_init)
+        return;
+
+    map_cache_close(&ctx->map.cache);
+    server_keyframe_reap(ctx, true);
+    journal_close(&ctx->journal);
+
+    // NOTE: Snapshots grow with what their client sees, so they are the
+    // only part of a match on the heap
+    for (u32 i = 0; i < ctx->clients.max; ++i) {
+        sync_state *sync = &ctx->clients.sync[i];
+        for (u32 k = 0; k < COMM_SYNC_HISTORY; ++k) {
+            comm_sync_release(&sync->history[k]);
+        }
+        free(sync->scratch);
+        sync->scratch = NULL;
+        sync->scratch_max = 0;
+    }
 }
@@ -0,0 +1,551 @@
+// NOTE: Plays a whole match with bots over memory pipes behind the link
+// simulator, on its virtual clock, so a match of many minutes runs in
+// seconds. Every bot keeps its own picture of the units from what the
+// server tells it, which has to match what the server says it can see.
+// A link that loses, duplicates or reorders needs --delta-sync, and so
+// does one whose queue limit drops packets. comm_flush resends what is
+// not acknowledged, but comm_read hands packets on in the order they
+// arrive and twice if they come twice, so the unit messages of the
+// default mode would be applied out of order. Snapshots carry their id
+// and baseline and survive that.
+#define SOAK_PIPE_SIZE MB(4)
+#define SOAK_CONNECTION_BUFFER_SIZE MB(1)
+#define SOAK_READ_SIZE MB(1)
+#define SOAK_START_TICK 1
+#define SOAK_CONSTRUCTION_CHANCE 4
+
+// NOTE: How long an unreliable link gets to catch up at the end, every
+// resend a packet may need and then some
+#define SOAK_SETTLE_MS ((COMM_MAX_RETRIES + 2) * COMM_RETRANSMIT_MS)
+
+// NOTE: How much later a reordered packet arrives unless --soak-link says
+#define SOAK_REORDER_DELAY_MS 100
+
+enum soak_entity_kinds : u8 {
+    SOAK_NONE = 0,
+    SOAK_UNIT,
+    SOAK_TOWN
+};
+
+struct soak_entity {
+    soak_entity_kinds kind;
+    s32 owner;
+    unit_names name;
+    u32 action_points;
+    v2<u32> position;
+};
+
+struct soak_bot {
+    communication comm;
+    comm_sim_link link;
+
+    u32 id;
+    bool started, my_turn;
+
+    u32 width, height;
+    terrain_names *terrain;
+
+    // NOTE: Indexed by server id, which units and towns share
+    soak_entity *entities;
+    u32 max_entities;
+
+    comm_sync_snapshot history[COMM_SYNC_HISTORY];
+    u32 latest_snapshot;
+    comm_sync_entity *scratch;
+    u32 scratch_max;
+};
+
+soak_entity *soak_bot_entity(soak_bot *bot, u32 id) {
+    if (id >= bot->max_entities) {
+        u32 max = MAX(id + 1, bot->max_entities * 2);
+        bot->entities = (soak_entity *)realloc(bot->entities, sizeof(*bot->entities) * max);
+        assert(bot->entities);
+        memset(bot->entities + bot->max_entities, 0, sizeof(*bot->entities) * (max - bot->max_entities));
+        bot->max_entities = max;
+    }
+    return &bot->entities[id];
+}
+
+void soak_bot_set_unit(soak_bot *bot, u32 id, s32 owner, unit_names name, u32 action_points, v2<u32> position) {
+    soak_entity *e = soak_bot_entity(bot, id);
+    e->kind = SOAK_UNIT;
+    e->owner = owner;
+    e->name = name;
+    e->action_points = action_points;
+    e->position = position;
+}
+
+// NOTE: Only units the bot already knows may change
+soak_entity *soak_bot_known_unit(soak_bot *bot, u32 id) {
+    if (id >= bot->max_entities || bot->entities[id].kind != SOAK_UNIT) {
+        sitrep(SITREP_ERROR, "Soak bot %u was told about unit %u it does not know", bot->id, id);
+        return NULL;
+    }
+    return &bot->entities[id];
+}
+
+// NOTE: Applies a state the server sent, units missing from it are gone
+bool soak_bot_apply_delta(soak_bot *bot, u8 *data, u32 len, u32 *size) {
+    comm_server_entity_delta_body *body = (comm_server_entity_delta_body *)data;
+    *size = comm_read_entity_delta(data, len, NULL, 0, NULL, NULL);
+    if (*size == 0) {
+        sitrep(SITREP_ERROR, "Soak bot %u got a broken ENTITY_DELTA", bot->id);
+        return false;
+    }
+
+    comm_sync_snapshot *baseline = NULL;
+    if (body->baseline_id != COMM_SYNC_NO_BASELINE) {
+        baseline = &bot->history[body->baseline_id % COMM_SYNC_HISTORY];
+        if (baseline->id != body->baseline_id)
+            return true;
+    }
+    if (body->snapshot_id <= bot->latest_snapshot)
+        return true;
+
+    u32 num_baseline = baseline ? baseline->num : 0;
+    u32 max = num_baseline + body->num_changed;
+    if (max > bot->scratch_max) {
+        bot->scratch_max = MAX(max, bot->scratch_max * 2);
+        bot->scratch = (comm_sync_entity *)realloc(bot->scratch, sizeof(*bot->scratch) * bot->scratch_max);
+        assert(bot->scratch);
+    }
+
+    u32 num;
+    comm_read_entity_delta(data, len, baseline ? baseline->entities : NULL, num_baseline, bot->scratch, &num);
+    comm_sync_store(&bot->history[body->snapshot_id % COMM_SYNC_HISTORY], body->snapshot_id, bot->scratch, num);
+    bot->latest_snapshot = body->snapshot_id;
+
+    for (u32 i = 0; i < bot->max_entities; ++i) {
+        if (bot->entities[i].kind == SOAK_UNIT)
+            bot->entities[i].kind = SOAK_NONE;
+    }
+    for (u32 i = 0; i < num; ++i) {
+        comm_sync_entity *e = &bot->scratch[i];
+        soak_bot_set_unit(bot, e->id, e->owner, e->name, e->action_points, e->position);
+    }
+
+    comm_client_header header;
+    header.name = comm_client_msg_names::SYNC_ACK;
+    comm_write(&bot->comm, &header, sizeof(header));
+    comm_client_sync_ack_body ack;
+    ack.snapshot_id = body->snapshot_id;
+    comm_write(&bot->comm, &ack, sizeof(ack));
+    return true;
+}
+
+bool soak_bot_read(soak_bot *bot, u8 *buffer) {
+    for (;;) {
+        s32 len = comm_read(&bot->comm, buffer, SOAK_READ_SIZE);
+        if (len == 0)
+            break;
+        if (len < 0)
+            continue;
+
+        u32 it = sizeof(comm_shared_header);
+        while (it + sizeof(comm_server_header) <= (u32)len) {
+            comm_server_header *header = (comm_server_header *)(buffer + it);
+            it += sizeof(*header);
+            u8 *data = buffer + it;
+
+            switch (header->name) {
+                case comm_server_msg_names::INIT_MAP: {
+                    comm_server_init_map_body *body = (comm_server_init_map_body *)data;
+                    it += sizeof(*body);
+                    bot->id = body->your_id;
+                    bot->width = body->width;
+                    bot->height = body->height;
+                    if (!bot->terrain) {
+                        bot->terrain = (terrain_names *)calloc((umax)body->width * body->height, sizeof(*bot->terrain));
+                        assert(bot->terrain);
+                    }
+                } break;
+                case comm_server_msg_names::DISCOVER: {
+                    comm_server_discover_body *body = (comm_server_discover_body *)data;
+                    it += sizeof(*body);
+                    for (u32 i = 0; i < body->num; ++i) {
+                        comm_server_discover_body_tile *tile = (comm_server_discover_body_tile *)(buffer + it);
+                        it += sizeof(*tile);
+
+                        // NOTE: Terrain overtaking INIT_MAP only costs the
+                        // bot some walkable tiles
+                        if (bot->terrain)
+                            bot->terrain[tile->position.y * bot->width + tile->position.x] = tile->name;
+                    }
+                } break;
+                case comm_server_msg_names::PING: {
+                } break;
+                case comm_server_msg_names::DISCOVER_TOWN: {
+                    comm_server_discover_town_body *body = (comm_server_discover_town_body *)data;
+                    it += sizeof(*body);
+                    soak_entity *e = soak_bot_entity(bot, body->id);
+                    e->kind = SOAK_TOWN;
+                    e->owner = body->owner;
+                    e->position = body->position;
+                } break;
+                case comm_server_msg_names::YOUR_TURN: {
+                    bot->my_turn = true;
+                } break;
+                case comm_server_msg_names::CONSTRUCTION_SET: {
+                    it += sizeof(comm_server_construction_set_body);
+                } break;
+                case comm_server_msg_names::ADD_UNIT: {
+                    comm_server_add_unit_body *body = (comm_server_add_unit_body *)data;
+                    it += sizeof(*body);
+                    soak_bot_set_unit(bot, body->unit_id, (s32)body->owner, body->unit_name,
+                                      body->action_points, body->position);
+                } break;
+                case comm_server_msg_names::MOVE_UNIT: {
+                    comm_server_move_unit_body *body = (comm_server_move_unit_body *)data;
+                    it += sizeof(*body);
+                    soak_entity *e = soak_bot_known_unit(bot, body->unit_id);
+                    if (!e)
+                        return false;
+                    e->position = body->new_position;
+                    e->action_points = body->action_points_left;
+                } break;
+                case comm_server_msg_names::REMOVE_UNIT: {
+                    comm_server_remove_unit_body *body = (comm_server_remove_unit_body *)data;
+                    it += sizeof(*body);
+                    soak_entity *e = soak_bot_known_unit(bot, body->unit_id);
+                    if (!e)
+                        return false;
+                    e->kind = SOAK_NONE;
+                } break;
+                case comm_server_msg_names::SET_UNIT_ACTION_POINTS: {
+                    comm_server_set_unit_action_points_body *body = (comm_server_set_unit_action_points_body *)data;
+                    it += sizeof(*body);
+                    soak_entity *e = soak_bot_known_unit(bot, body->unit_id);
+                    if (!e)
+                        return false;
+                    e->action_points = body->new_action_points;
+                } break;
+                case comm_server_msg_names::LOAD_UNIT: {
+                    comm_server_load_unit_body *body = (comm_server_load_unit_body *)data;
+                    it += sizeof(*body);
+                    soak_entity *e = soak_bot_known_unit(bot, body->unit_to_load);
+                    if (!e)
+                        return false;
+                    e->position = body->new_position;
+                    e->action_points = body->action_points_left;
+                } break;
+                case comm_server_msg_names::UNLOAD_UNIT: {
+                    comm_server_unload_unit_body *body = (comm_server_unload_unit_body *)data;
+                    it += sizeof(*body);
+                    soak_entity *e = soak_bot_known_unit(bot, body->unit_id);
+                    if (!e)
+                        return false;
+                    e->position = body->new_position;
+                    e->action_points = body->action_points_left;
+                } break;
+                case comm_server_msg_names::STARTING: {
+                    bot->started = true;
+                } break;
+                case comm_server_msg_names::ENTITY_DELTA: {
+                    u32 size;
+                    if (!soak_bot_apply_delta(bot, data, len - it, &size))
+                        return false;
+                    it += size;
+                } break;
+                default: {
+                    sitrep(SITREP_ERROR, "Soak bot %u got unknown message %u", bot->id, (u32)header->name);
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+bool soak_walkable(soak_bot *bot, soak_entity *u, s32 x, s32 y) {
+    if (!bot->terrain || x < 0 || y < 0 || x >= (s32)bot->width || y >= (s32)bot->height)
+        return false;
+
+    terrain_names terrain = bot->terrain[y * bot->width + x];
+    return terrain == GRASS || (terrain == DESERT && u->name == unit_names::CARAVAN);
+}
+
+// NOTE: Carries the acks of what the bot read and resends what it lost
+void soak_bot_ack(soak_bot *bot) {
+    comm_client_header header;
+    header.name = comm_client_msg_names::PONG;
+    comm_write(&bot->comm, &header, sizeof(header));
+    comm_flush(&bot->comm);
+}
+
+// NOTE: On its turn a bot sometimes changes what a town builds and walks
+// every unit at random, half of them step by step and half as one path
+void soak_bot_act(soak_bot *bot, random_series *series) {
+    comm_client_header header;
+    if (!bot->my_turn) {
+        soak_bot_ack(bot);
+        return;
+    }
+
+    for (u32 id = 0; id < bot->max_entities; ++id) {
+        soak_entity *e = &bot->entities[id];
+        if (e->owner != (s32)bot->id)
+            continue;
+
+        if (e->kind == SOAK_TOWN) {
+            if (random_next_u32(series) % SOAK_CONSTRUCTION_CHANCE)
+                continue;
+
+            header.name = comm_client_msg_names::SET_CONSTRUCTION;
+            comm_write(&bot->comm, &header, sizeof(header));
+            comm_client_set_construction_body body;
+            body.town_id = id;
+            body.unit_name = random_next_u32(series) % 2 ? unit_names::SOLDIER : unit_names::CARAVAN;
+            comm_write(&bot->comm, &body, sizeof(body));
+        } else if (e->kind == SOAK_UNIT) {
+            bool as_path = random_next_u32(series) % 2;
+            comm_client_move_path_body path = {0};
+            path.unit_id = id;
+
+            v2<s32> at;
+            at.x = e->position.x;
+            at.y = e->position.y;
+            for (u32 step = 0; step < e->action_points && path.num_steps < COMM_MOVE_PATH_MAX_STEPS; ++step) {
+                v2<s32> delta;
+                delta.x = (s32)(random_next_u32(series) % 3) - 1;
+                delta.y = (s32)(random_next_u32(series) % 3) - 1;
+                if ((delta.x == 0 && delta.y == 0) || !soak_walkable(bot, e, at.x + delta.x, at.y + delta.y))
+                    continue;
+
+                at.x += delta.x;
+                at.y += delta.y;
+                if (as_path) {
+                    path.steps[path.num_steps++] = comm_path_direction(delta);
+                } else {
+                    header.name = comm_client_msg_names::MOVE_UNIT;
+                    comm_write(&bot->comm, &header, sizeof(header));
+                    comm_client_move_unit_body body;
+                    body.unit_id = id;
+                    body.delta = delta;
+                    comm_write(&bot->comm, &body, sizeof(body));
+                }
+            }
+
+            if (path.num_steps) {
+                header.name = comm_client_msg_names::MOVE_PATH;
+                comm_write(&bot->comm, &header, sizeof(header));
+                comm_write(&bot->comm, &path, sizeof(path));
+            }
+        }
+    }
+
+    header.name = comm_client_msg_names::END_TURN;
+    comm_write(&bot->comm, &header, sizeof(header));
+    bot->my_turn = false;
+    comm_flush(&bot->comm);
+}
+
+// NOTE: Every unit the server counts as seen by the bot has to be known
+// where it is, and the bot may know no other
+bool soak_check(server_context *ctx, soak_bot *bots, u32 num_bots, bool report) {
+    for (u32 b = 0; b < num_bots; ++b) {
+        soak_bot *bot = &bots[b];
+        if (!bot->started)
+            continue;
+
+        u32 num_visible = 0;
+        for (auto it = ctx->map.entities.first; it; it = it->next) {
+            entity *e = it->payload;
+            if (e->type != entity_types::UNIT)
+                continue;
+
+            u32 idx = e->position.y * ctx->map.terrain_width + e->position.x;
+            if (e->owner != (s32)bot->id && !((ctx->map.observers[idx] >> bot->id) & 1))
+                continue;
+
+            ++num_visible;
+            soak_entity *known = e->server_id < bot->max_entities ? &bot->entities[e->server_id] : NULL;
+            if (!known || known->kind != SOAK_UNIT || known->position != e->position) {
+                if (report)
+                    sitrep(SITREP_ERROR, "Soak bot %u does not see unit %u at (%u, %u)",
+                           bot->id, e->server_id, e->position.x, e->position.y);
+                return false;
+            }
+        }
+
+        u32 num_known = 0;
+        for (u32 id = 0; id < bot->max_entities; ++id) {
+            num_known += bot->entities[id].kind == SOAK_UNIT;
+        }
+        if (num_known != num_visible) {
+            if (report)
+                sitrep(SITREP_ERROR, "Soak bot %u knows %u units, the server shows it %u",
+                       bot->id, num_known, num_visible);
+            return false;
+        }
+    }
+    return true;
+}
+
+// NOTE: Checks every tick when the link delivers at once. Otherwise the
+// bots lag behind by design and are checked once at the end, after they
+// stop sending and everything the server wrote has arrived. Over an
+// unreliable link that takes resends, so the bots keep acknowledging
+// until their pictures settle or SOAK_SETTLE_MS runs out.
+bool server_soak(server_config config, u32 num_clients, u32 tick_rate, u32 ticks, comm_sim_config link) {
+    bool reliable = link.jitter_ms == 0 && link.loss == 0 && link.duplicate == 0 && link.reorder == 0 &&
+                    !(link.queue_limit_ms && link.bandwidth_bytes_per_second);
+    if (!reliable && !config.delta_sync) {
+        sitrep(SITREP_ERROR, "A soak link with jitter, loss, duplicates, reordering or a queue limit needs --delta-sync");
+        return false;
+    }
+
+    comm_sim_virtual_clock = true;
+    random_series series = random_seed(config.map_seed);
+
+    memory_arena total = {0};
+    total.name = "soak_memory";
+    total.max = server_memory_size(config, num_clients)
+                + num_clients * (2 * SOAK_PIPE_SIZE + 2 * SOAK_CONNECTION_BUFFER_SIZE + KB(4))
+                + SOAK_READ_SIZE;
+    total.base = (u8 *)calloc(1, total.max);
+    assert(total.base);
+
+    memory_arena server_memory = memory_arena_child(&total, server_memory_size(config, num_clients), "server_memory");
+    u8 *read_buffer = memory_arena_use(&total, SOAK_READ_SIZE);
+    communication *server_comms = (communication *)memory_arena_use(&total, sizeof(*server_comms) * num_clients);
+    comm_sim_link *server_links = (comm_sim_link *)memory_arena_use(&total, sizeof(*server_links) * num_clients);
+    comm_memory_pipe *pipes = (comm_memory_pipe *)memory_arena_use(&total, sizeof(*pipes) * 2 * num_clients);
+    ring_buffer<u8> *rings = (ring_buffer<u8> *)memory_arena_use(&total, sizeof(*rings) * 2 * num_clients);
+    soak_bot *bots = (soak_bot *)calloc(num_clients, sizeof(*bots));
+    assert(bots);
+
+    for (u32 i = 0; i < num_clients; ++i) {
+        ring_buffer<u8> *to_client = &rings[2 * i], *to_server = &rings[2 * i + 1];
+        *to_client = ring_buffer<u8>(&total, SOAK_PIPE_SIZE);
+        *to_server = ring_buffer<u8>(&total, SOAK_PIPE_SIZE);
+        pipes[2 * i] = {to_server, to_client};
+        pipes[2 * i + 1] = {to_client, to_server};
+
+        comm_server_memory_init(&server_comms[i], &pipes[2 * i],
+                                memory_arena_child(&total, SOAK_CONNECTION_BUFFER_SIZE, "server_to_client_memory"));
+        comm_client_memory_init(&bots[i].comm, &pipes[2 * i + 1],
+                                memory_arena_child(&total, SOAK_CONNECTION_BUFFER_SIZE, "client_to_server_memory"));
+        comm_sim_wrap(&server_comms[i], &server_links[i], link, config.map_seed + 2 * i);
+        comm_sim_wrap(&bots[i].comm, &bots[i].link, link, config.map_seed + 2 * i + 1);
+    }
+
+    u32 tick_ms = MAX(1000 / tick_rate, 1);
+    bool instant = reliable && link.latency_ms == 0 && link.bandwidth_bytes_per_second == 0;
+    server_input input = {0};
+    server_output output = {0};
+    u32 checks = 0;
+    bool ok = true;
+    real32 server_ms = 0;
+    real32 start = match_host_now_in_ms();
+
+    u32 tick = 0;
+    for (; ok && tick < ticks; ++tick) {
+        comm_sim_advance(tick_ms);
+        real32 tick_start = match_host_now_in_ms();
+        server_update(&server_memory, server_comms, num_clients, config, input, &output);
+        server_ms += match_host_now_in_ms() - tick_start;
+
+        for (u32 i = 0; ok && i < num_clients; ++i) {
+            ok = soak_bot_read(&bots[i], read_buffer);
+        }
+        if (ok && instant) {
+            ok = soak_check((server_context *)server_memory.base, bots, num_clients, true);
+            ++checks;
+        }
+
+        if (tick == SOAK_START_TICK) {
+            comm_client_header header;
+            header.name = comm_client_msg_names::START;
+            comm_write(&bots[0].comm, &header, sizeof(header));
+        }
+        for (u32 i = 0; ok && i < num_clients; ++i) {
+            soak_bot_act(&bots[i], &series);
+        }
+    }
+
+    // NOTE: The bots have stopped sending. Once the server has handled the
+    // last of it nothing changes, so whatever it wrote up to then is all
+    // the bots need to catch up.
+    for (u32 pass = 0; ok && pass < 2; ++pass) {
+        u32 drained_at = comm_sim_now;
+        for (u32 i = 0; i < num_clients; ++i) {
+            comm_sim_link *l = pass == 0 ? &bots[i].link : &server_links[i];
+            u32 at = comm_sim_drained_at(l);
+            if ((s32)(at - drained_at) > 0)
+                drained_at = at;
+        }
+
+        bool pending;
+        do {
+            comm_sim_advance(tick_ms);
+            server_update(&server_memory, server_comms, num_clients, config, input, &output);
+            for (u32 i = 0; ok && i < num_clients; ++i) {
+                ok = soak_bot_read(&bots[i], read_buffer);
+            }
+
+            // NOTE: Delivered to the pipe is not yet handled, the server
+            // takes a few packets per tick
+            pending = (s32)(comm_sim_now - drained_at) < 0;
+            for (u32 i = 0; pass == 0 && i < num_clients; ++i) {
+                pending |= rings[2 * i + 1].distance() > 0;
+            }
+        } while (ok && pending);
+    }
+
+    u32 settle_until = comm_sim_now + SOAK_SETTLE_MS;
+    while (ok && !reliable && (s32)(comm_sim_now - settle_until) < 0 &&
+           !soak_check((server_context *)server_memory.base, bots, num_clients, false)) {
+        comm_sim_advance(tick_ms);
+        server_update(&server_memory, server_comms, num_clients, config, input, &output);
+        for (u32 i = 0; ok && i < num_clients; ++i) {
+            ok = soak_bot_read(&bots[i], read_buffer);
+            soak_bot_ack(&bots[i]);
+        }
+    }
+    if (ok) {
+        ok = soak_check((server_context *)server_memory.base, bots, num_clients, true);
+        ++checks;
+    }
+
+    server_context *ctx = (server_context *)server_memory.base;
+    u32 num_units = 0;
+    for (auto it = ctx->map.entities.first; it; it = it->next) {
+        num_units += it->payload->type == entity_types::UNIT;
+    }
+    u32 sent = 0, delivered = 0, lost = 0, queue_dropped = 0, duplicated = 0, reordered = 0;
+    for (u32 i = 0; i < num_clients; ++i) {
+        sent += server_links[i].stats.sent + bots[i].link.stats.sent;
+        delivered += server_links[i].stats.delivered + bots[i].link.stats.delivered;
+        lost += server_links[i].stats.lost + bots[i].link.stats.lost;
+        duplicated += server_links[i].stats.duplicated + bots[i].link.stats.duplicated;
+        reordered += server_links[i].stats.reordered + bots[i].link.stats.reordered;
+        queue_dropped += server_links[i].stats.queue_dropped + bots[i].link.stats.queue_dropped;
+    }
+
+    sitrep(ok ? SITREP_INFO : SITREP_ERROR, "Soak %s: %u ticks, %.1f minutes of match time in %.1f s, server %.1f ms",
+           ok ? "passed" : "failed", tick, comm_sim_now / 60000.0f,
+           (match_host_now_in_ms() - start) / 1000.0f, server_ms);
+    sitrep(SITREP_INFO, "  %u clients, %u turns, %u units, %u checks, %u of %u packets delivered",
+           num_clients, ctx->turn_number, num_units, checks, delivered, sent);
+    if (!reliable)
+        sitrep(SITREP_INFO, "  %u lost, %u duplicated, %u reordered, %u dropped by the queue",
+               lost, duplicated, reordered, queue_dropped);
+    if (config.profile)
+        profile_report(&ctx->profile);
+
+    for (u32 i = 0; i < num_clients; ++i) {
+        comm_sim_unwrap(&server_comms[i], &server_links[i]);
+        comm_sim_unwrap(&bots[i].comm, &bots[i].link);
+        for (u32 k = 0; k < COMM_SYNC_HISTORY; ++k) {
+            comm_sync_release(&bots[i].history[k]);
+        }
+        free(bots[i].scratch);
+        free(bots[i].entities);
+        free(bots[i].terrain);
+    }
+    free(bots);
+    server_release(&server_memory);
+    free(total.base);
+    comm_sim_virtual_clock = false;
+    return ok;
+}
@@ -0,0 +1,135 @@
+// NOTE: Events due on a later turn, in a two level timer wheel keyed on
+// the journal's turn number. Every turn number starts exactly one
+// player's turn, so a bucket holds the events of that player for that
+// turn. The near level has one slot per turn of the current block of
+// TIMER_WHEEL_SLOTS turns, the far level one slot per block of the
+// current superblock and anything further waits in overflow. Entering a
+// block moves its far slot down, entering a superblock sorts overflow
+// again, so every event is touched a bounded number of times before it
+// fires.
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+enum timer_kinds : u32 {
+    // NOTE: data is the structure finishing a unit
+    TIMER_CONSTRUCTION = 0
+};
+
+struct timer_event {
+    timer_event *prev, *next;
+    // NOTE: The list the event is in, for unlinking it in O(1)
+    timer_event **list;
+
+    u32 due;
+    timer_kinds kind;
+    void *data;
+};
+
+struct timer_wheel {
+    // NOTE: The last turn advanced to, events are always due after it
+    u32 now;
+
+    timer_event *near[TIMER_WHEEL_SLOTS];
+    timer_event *far[TIMER_WHEEL_SLOTS];
+    timer_event *overflow;
+
+    // NOTE: Events come out of the arena and are reused once done
+    timer_event *free;
+};
+
+void timer_list_push(timer_event **list, timer_event *event) {
+    event->list = list;
+    event->prev = NULL;
+    event->next = *list;
+    if (*list)
+        (*list)->prev = event;
+    *list = event;
+}
+
+void timer_list_unlink(timer_event *event) {
+    if (event->prev)
+        event->prev->next = event->next;
+    else
+        *event->list = event->next;
+    if (event->next)
+        event->next->prev = event->prev;
+    event->prev = event->next = NULL;
+    event->list = NULL;
+}
+
+void timer_wheel_insert(timer_wheel *wheel, timer_event *event) {
+    // NOTE: Due now only while cascading, before the slot of now is taken
+    assert(event->due >= wheel->now);
+    u32 due = event->due, now = wheel->now;
+    if ((due >> TIMER_WHEEL_BITS) == (now >> TIMER_WHEEL_BITS)) {
+        timer_list_push(&wheel->near[due & TIMER_WHEEL_MASK], event);
+    } else if ((due >> (2 * TIMER_WHEEL_BITS)) == (now >> (2 * TIMER_WHEEL_BITS))) {
+        timer_list_push(&wheel->far[(due >> TIMER_WHEEL_BITS) & TIMER_WHEEL_MASK], event);
+    } else {
+        timer_list_push(&wheel->overflow, event);
+    }
+}
+
+timer_event *timer_wheel_schedule(timer_wheel *wheel, memory_arena *mem, u32 due, timer_kinds kind, void *data) {
+    assert(due > wheel->now);
+    timer_event *event = wheel->free;
+    if (event)
+        timer_list_unlink(event);
+    else
+        event = (timer_event *)memory_arena_use(mem, sizeof(*event));
+
+    event->due = due;
+    event->kind = kind;
+    event->data = data;
+    timer_wheel_insert(wheel, event);
+    return event;
+}
+
+void timer_wheel_cancel(timer_wheel *wheel, timer_event *event) {
+    timer_list_unlink(event);
+    timer_list_push(&wheel->free, event);
+}
+
+// NOTE: Sorts a whole list into the wheel again from the current turn
+void timer_wheel_cascade(timer_wheel *wheel, timer_event **list) {
+    timer_event *event = *list;
+    *list = NULL;
+    while (event) {
+        timer_event *next = event->next;
+        timer_wheel_insert(wheel, event);
+        event = next;
+    }
+}
+
+// NOTE: Moves the wheel on to turn and hands back the events due by
+// then, unlinked from the wheel. Each one has to be scheduled again with
+// timer_wheel_insert or given back with timer_wheel_release.
+timer_event *timer_wheel_advance(timer_wheel *wheel, u32 turn) {
+    timer_event *due = NULL;
+    while (wheel->now != turn) {
+        u32 now = ++wheel->now;
+        if ((now & TIMER_WHEEL_MASK) == 0) {
+            if (((now >> TIMER_WHEEL_BITS) & TIMER_WHEEL_MASK) == 0)
+                timer_wheel_cascade(wheel, &wheel->overflow);
+            timer_wheel_cascade(wheel, &wheel->far[(now >> TIMER_WHEEL_BITS) & TIMER_WHEEL_MASK]);
+        }
+
+        timer_event **slot = &wheel->near[now & TIMER_WHEEL_MASK];
+        while (*slot) {
+            timer_event *event = *slot;
+            timer_list_unlink(event);
+            timer_list_push(&due, event);
+        }
+    }
+
+    // NOTE: Detached, so the caller may insert them while walking
+    for (timer_event *event = due; event; event = event->next) {
+        event->list = NULL;
+    }
+    return due;
+}
+
+void timer_wheel_release(timer_wheel *wheel, timer_event *event) {
+    timer_list_push(&wheel->free, event);
+}
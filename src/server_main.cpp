@@ -0,0 +1,596 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+
+#include "shared.cpp"
+#include "communication/protocol.cpp"
+#include "communication/unix.cpp"
+#include "communication/server/memory.cpp"
+#include "communication/client/memory.cpp"
+#include "communication/server/unix.cpp"
+#include "communication/server/udp.cpp"
+#include "communication/simulator.cpp"
+#include "communication/capture.cpp"
+#include "server/jobs.cpp"
+#include "server/noise.cpp"
+#include "server/map_cache.cpp"
+#include "server/journal.cpp"
+#include "server/timers.cpp"
+#include "server/profile.cpp"
+#include "server/server.cpp"
+#include "server/save.cpp"
+#include "server/host.cpp"
+#include "server/replay.cpp"
+#include "server/soak.cpp"
+
+#define SERVER_MAX_CLIENTS 31
+#define SERVER_CONNECTION_BUFFER_SIZE MB(1)
+
+enum class server_transport_names {
+    UDP = 0,
+    UNIX
+};
+
+void sitrep(sitrep_names name, char *fmt, ...) {
+    char time_str[64] = {0};
+    time_t now = time(NULL);
+    struct tm *tm_info = localtime(&now);
+
+    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", tm_info);
+    printf("[%s] ", time_str);
+
+    switch (name) {
+        case SITREP_INFO: printf("[INFO] "); break;
+        case SITREP_WARNING: printf("[WARN] "); break;
+        case SITREP_ERROR: printf("[ERROR] "); break;
+        case SITREP_DEBUG: printf("[DEBUG] "); break;
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    printf("\n");
+    fflush(stdout);
+}
+
+u32 time_get_now_in_ms() {
+    if (comm_sim_virtual_clock)
+        return comm_sim_now;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    u32 rv = 0;
+    rv += ts.tv_sec * 1000;
+    rv += ts.tv_nsec / 1000000;
+
+    return rv;
+}
+
+void usage(char *name) {
+    printf("usage: %s [--udp <port> | --unix <path>] [--clients <n>] [--tick-rate <hz>] [--packets-per-tick <n>]\n"
+           "          [--matches <n>] [--threads <n>] [--delta-sync] [--capture <path>] [--profile]\n"
+           "          [--map <width>x<height>] [--seed <n>] [--map-cache <dir>] [--bench-noise]\n"
+           "          [--sight <town>,<soldier>,<caravan>]\n"
+           "          [--save <path>] [--load <path>] [--journal <path>] [--keyframe-turns <n>]\n"
+           "          [--wal] [--fork-keyframes] [--recover <journal>] [--replay <journal> [--turn <n>]]\n"
+           "          [--replay-capture <capture> [--max-speed]]\n"
+           "          [--soak <ticks> [--soak-link <latency ms>,<jitter ms>,<loss>,<duplicate>,<reorder>,\n"
+           "                                       <bytes per second>[,<reorder delay ms>[,<queue limit ms>]]]]\n", name);
+}
+
+volatile sig_atomic_t server_quit = 0;
+
+void server_signal(int signal) {
+    server_quit = 1;
+}
+
+// NOTE: Times every noise path this CPU can run over a map sized grid, in
+// the layout generate_map uses, and checks it against the scalar reference
+void bench_noise(u32 width, u32 height) {
+    umax area = (umax)width * height;
+    real32 *reference = (real32 *)malloc(sizeof(*reference) * area);
+    real32 *result = (real32 *)malloc(sizeof(*result) * area);
+    real32 *xs = (real32 *)malloc(sizeof(*xs) * width);
+    assert(reference && result && xs);
+    for (u32 x = 0; x < width; ++x) {
+        real32 nx = (real32)x / width - 0.5;
+        xs[x] = nx * MAP_NOISE_FREQUENCY;
+    }
+
+    u32 octave_counts[] = {1, 4};
+    for (u32 octaves : octave_counts) {
+        for (u32 path = 0; path <= (u32)noise_path; ++path) {
+            real32 *out = path == 0 ? reference : result;
+            real32 start = match_host_now_in_ms();
+            for (u32 y = 0; y < height; ++y) {
+                real32 ny = (real32)y / height - 0.5;
+                noise_fbm3_with((noise_path_names)path, out + (umax)y * width, xs, width,
+                                ny * MAP_NOISE_FREQUENCY, 0, MAP_NOISE_LACUNARITY, MAP_NOISE_GAIN, octaves);
+            }
+            real32 elapsed = match_host_now_in_ms() - start;
+
+            real32 max_error = 0;
+            for (umax i = 0; i < area; ++i) {
+                max_error = MAX(max_error, fabsf(out[i] - reference[i]));
+            }
+            sitrep(SITREP_INFO, "noise %ux%u, %u octaves, %s: %.1f Mtiles/s, max error %g",
+                   width, height, octaves, noise_path_strings[path],
+                   area / (elapsed * 1000.0f), max_error);
+        }
+    }
+
+    free(xs);
+    free(result);
+    free(reference);
+}
+
+struct server_connection {
+    communication comm;
+    comm_unix_socket *socket;
+    u32 udp_id;
+};
+
+// NOTE: Connections are gathered here until there are enough for a match
+struct server_lobby {
+    server_connection connections[SERVER_MAX_CLIENTS];
+    u32 used;
+};
+
+void server_connection_close(server_connection *conn, comm_udp_server *udp) {
+    if (conn->socket) {
+        close(conn->socket->fd);
+        free(conn->socket);
+    } else {
+        comm_udp_server_close(udp, conn->udp_id);
+    }
+    free(conn->comm.buffer.base);
+}
+
+struct server_state {
+    match_host host;
+    server_lobby lobby;
+    server_connection *match_connections;
+    s32 *udp_match;
+    u32 num_clients;
+    server_config config;
+
+    comm_capture capture;
+    comm_capture_link *capture_links;
+    u32 matches_started;
+
+    // NOTE: The first match continues from here instead of starting fresh
+    char *load_path;
+
+    // NOTE: Every match journals to the path with its start count
+    // appended, the config points into the slot of its match id
+    char *journal_path;
+    char (*journal_paths)[512];
+};
+
+// NOTE: Hands a full lobby to the host. Returns false while the host has
+// no room, in which case the lobby stays full.
+bool server_start_match(server_state *state) {
+    server_lobby *lobby = &state->lobby;
+    u32 num_clients = state->num_clients;
+
+    communication comms[SERVER_MAX_CLIENTS];
+    for (u32 i = 0; i < num_clients; ++i) {
+        comms[i] = lobby->connections[i].comm;
+    }
+
+    // NOTE: The host hands out the first free match id
+    server_config config = state->config;
+    if (state->journal_path) {
+        u32 slot = 0;
+        while (slot < state->host.max && state->host.matches[slot].in_use)
+            ++slot;
+        if (slot == state->host.max)
+            return false;
+        snprintf(state->journal_paths[slot], sizeof(state->journal_paths[slot]), "%s.%u",
+                 state->journal_path, state->matches_started);
+        config.journal_path = state->journal_paths[slot];
+    }
+
+    s32 match_id = -1;
+    if (state->load_path) {
+        match_id = match_host_load(&state->host, comms, num_clients, config, state->load_path);
+        if (match_id >= 0)
+            sitrep(SITREP_INFO, "Match %d loaded from '%s'", match_id, state->load_path);
+        state->load_path = NULL;
+    }
+    if (match_id < 0)
+        match_id = match_host_add(&state->host, comms, num_clients, config);
+    if (match_id < 0)
+        return false;
+
+    for (u32 i = 0; i < num_clients; ++i) {
+        server_connection *conn = &state->match_connections[match_id * num_clients + i];
+        *conn = lobby->connections[i];
+        if (!conn->socket)
+            state->udp_match[conn->udp_id] = match_id;
+        if (state->capture_links) {
+            comm_capture_wrap(&state->host.matches[match_id].comms[i],
+                              &state->capture_links[match_id * num_clients + i],
+                              &state->capture, state->matches_started * num_clients + i);
+        }
+    }
+    lobby->used = 0;
+    ++state->matches_started;
+    sitrep(SITREP_INFO, "Match %d started", match_id);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    // NOTE: Picks the noise path chunks are generated with. Matches start
+    // on pool workers and noise_init is not thread safe, so it runs here.
+    noise_init();
+
+    server_transport_names transport = server_transport_names::UDP;
+    u16 port = 7777;
+    char *path = "moac.sock";
+    char *capture_path = NULL;
+    char *save_path = NULL;
+    char *load_path = NULL;
+    char *journal_path = NULL;
+    char *replay_path = NULL;
+    char *replay_capture_path = NULL;
+    bool max_speed = false;
+    char *recover_path = NULL;
+    char recovered_path[512];
+    u32 replay_turn = 0xFFFFFFFF;
+    u32 num_clients = 2;
+    u32 tick_rate = 30;
+    u32 max_matches = 1;
+    s32 num_threads = -1;
+    server_config config = {0};
+    config.map_seed = (u64)time(NULL);
+    bool bench = false;
+    u32 soak_ticks = 0;
+    comm_sim_config soak_link = {0};
+
+    for (s32 i = 1; i < argc; ++i) {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--udp") == 0 && has_value) {
+            transport = server_transport_names::UDP;
+            port = (u16)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--unix") == 0 && has_value) {
+            transport = server_transport_names::UNIX;
+            path = argv[++i];
+        } else if (strcmp(argv[i], "--clients") == 0 && has_value) {
+            num_clients = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--tick-rate") == 0 && has_value) {
+            tick_rate = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--packets-per-tick") == 0 && has_value) {
+            config.max_packets_per_tick = atoi(argv[++i]);
+            if (config.max_packets_per_tick == 0) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--matches") == 0 && has_value) {
+            max_matches = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && has_value) {
+            num_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--capture") == 0 && has_value) {
+            capture_path = argv[++i];
+        } else if (strcmp(argv[i], "--map") == 0 && has_value) {
+            if (sscanf(argv[++i], "%ux%u", &config.map_width, &config.map_height) != 2) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--sight") == 0 && has_value) {
+            if (sscanf(argv[++i], "%u,%u,%u", &config.sight_radius[0], &config.sight_radius[1],
+                       &config.sight_radius[2]) != 3) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--seed") == 0 && has_value) {
+            config.map_seed = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--map-cache") == 0 && has_value) {
+            config.map_cache_dir = argv[++i];
+        } else if (strcmp(argv[i], "--save") == 0 && has_value) {
+            save_path = argv[++i];
+        } else if (strcmp(argv[i], "--load") == 0 && has_value) {
+            load_path = argv[++i];
+        } else if (strcmp(argv[i], "--journal") == 0 && has_value) {
+            journal_path = argv[++i];
+        } else if (strcmp(argv[i], "--keyframe-turns") == 0 && has_value) {
+            config.keyframe_turns = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--wal") == 0) {
+            config.journal_sync = true;
+        } else if (strcmp(argv[i], "--fork-keyframes") == 0) {
+            config.fork_keyframes = true;
+        } else if (strcmp(argv[i], "--recover") == 0 && has_value) {
+            recover_path = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && has_value) {
+            replay_path = argv[++i];
+        } else if (strcmp(argv[i], "--turn") == 0 && has_value) {
+            replay_turn = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--replay-capture") == 0 && has_value) {
+            replay_capture_path = argv[++i];
+        } else if (strcmp(argv[i], "--max-speed") == 0) {
+            max_speed = true;
+        } else if (strcmp(argv[i], "--soak") == 0 && has_value) {
+            soak_ticks = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--soak-link") == 0 && has_value) {
+            // NOTE: Loss, duplicate and reorder are chances per packet
+            soak_link.reorder_delay_ms = SOAK_REORDER_DELAY_MS;
+            s32 num = sscanf(argv[++i], "%u,%u,%f,%f,%f,%u,%u,%u", &soak_link.latency_ms, &soak_link.jitter_ms,
+                             &soak_link.loss, &soak_link.duplicate, &soak_link.reorder,
+                             &soak_link.bandwidth_bytes_per_second, &soak_link.reorder_delay_ms,
+                             &soak_link.queue_limit_ms);
+            if (num < 6 || soak_link.loss < 0 || soak_link.loss >= 1 || soak_link.duplicate < 0 ||
+                soak_link.duplicate > 1 || soak_link.reorder < 0 || soak_link.reorder > 1) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--bench-noise") == 0) {
+            bench = true;
+        } else if (strcmp(argv[i], "--delta-sync") == 0) {
+            config.delta_sync = true;
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            config.profile = true;
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (bench) {
+        bench_noise(config.map_width ? config.map_width : 2048, config.map_height ? config.map_height : 2048);
+        return EXIT_SUCCESS;
+    }
+
+    if (replay_path) {
+        return server_replay(replay_path, replay_turn, save_path) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (num_clients == 0 || num_clients > SERVER_MAX_CLIENTS || tick_rate == 0 || max_matches == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // NOTE: Single threaded unless --threads asks otherwise
+    if (replay_capture_path) {
+        job_pool pool;
+        if (num_threads > 0)
+            job_pool_init(&pool, num_threads);
+        bool ok = server_replay_capture(replay_capture_path, max_speed, config, num_clients, tick_rate,
+                                        num_threads > 0 ? &pool : NULL);
+        if (num_threads > 0)
+            job_pool_destroy(&pool);
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (soak_ticks) {
+        job_pool pool;
+        if (num_threads > 0) {
+            job_pool_init(&pool, num_threads);
+            config.pool = &pool;
+        }
+        return server_soak(config, num_clients, tick_rate, soak_ticks, soak_link) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // NOTE: The crashed match is replayed to the end of its journal, saved
+    // next to it and then loaded like any save. The first match journals to
+    // <journal>.0, which must not be the one being recovered.
+    if (recover_path) {
+        snprintf(recovered_path, sizeof(recovered_path), "%s.0", journal_path ? journal_path : "");
+        if (journal_path && strcmp(recovered_path, recover_path) == 0) {
+            sitrep(SITREP_ERROR, "Recovering '%s' needs a different --journal", recover_path);
+            return EXIT_FAILURE;
+        }
+        snprintf(recovered_path, sizeof(recovered_path), "%s.recovered", recover_path);
+        if (!server_replay(recover_path, 0xFFFFFFFF, recovered_path))
+            return EXIT_FAILURE;
+        load_path = recovered_path;
+    }
+
+    // NOTE: The calling thread works too, so one core needs no extra thread
+    if (num_threads < 0) {
+        num_threads = MAX((s32)sysconf(_SC_NPROCESSORS_ONLN) - 1, 0);
+    }
+    if (max_matches > 1) {
+        num_threads = MIN((u32)num_threads, max_matches - 1);
+    }
+
+    // NOTE: calloc leaves the pages untouched until used, so an idle
+    // instance only costs what it actually writes
+    u32 max_connections = (max_matches + 1) * num_clients;
+    memory_arena transport_memory;
+    transport_memory.name = "transport_memory";
+    transport_memory.used = 0;
+    transport_memory.max = MB(2) + max_connections * (COMM_UDP_INBOX_SIZE + KB(1));
+    transport_memory.base = (u8 *)calloc(1, transport_memory.max);
+    assert(transport_memory.base);
+
+    server_state *state = (server_state *)calloc(1, sizeof(*state));
+    state->num_clients = num_clients;
+    state->config = config;
+    state->load_path = load_path;
+    state->journal_path = journal_path;
+    if (journal_path) {
+        state->journal_paths = (char (*)[512])calloc(max_matches, sizeof(*state->journal_paths));
+    }
+
+    comm_udp_server udp = {0};
+    s32 listen_fd = -1;
+
+    if (transport == server_transport_names::UDP) {
+        if (!comm_udp_server_init(&udp, port, max_connections, &transport_memory))
+            return EXIT_FAILURE;
+        state->udp_match = (s32 *)memory_arena_use(&transport_memory, sizeof(*state->udp_match) * max_connections);
+        for (u32 i = 0; i < max_connections; ++i) {
+            state->udp_match[i] = -1;
+        }
+        sitrep(SITREP_INFO, "Waiting for clients on udp port %u, %u per match", port, num_clients);
+    } else {
+        listen_fd = comm_server_unix_listen(path);
+        if (listen_fd < 0)
+            return EXIT_FAILURE;
+        sitrep(SITREP_INFO, "Waiting for clients on '%s', %u per match", path, num_clients);
+    }
+    sitrep(SITREP_INFO, "Map seed %llu", (unsigned long long)config.map_seed);
+
+    job_pool pool;
+    job_pool_init(&pool, num_threads);
+
+    // NOTE: Several matches already keep the pool busy one match per
+    // worker, a lone match spreads its connections over it instead
+    if (max_matches == 1) {
+        state->config.pool = &pool;
+    }
+    match_host *host = &state->host;
+    match_host_init(host, max_matches, &pool);
+
+    server_lobby *lobby = &state->lobby;
+    state->match_connections =
+        (server_connection *)calloc(max_matches * num_clients, sizeof(*state->match_connections));
+
+    if (capture_path && comm_capture_open(&state->capture, capture_path)) {
+        state->capture_links = (comm_capture_link *)calloc(max_matches * num_clients, sizeof(*state->capture_links));
+    }
+    u32 last_report_time = time_get_now_in_ms();
+
+    // NOTE: Ticks are scheduled on absolute deadlines so a slow tick does
+    // not push every later one back
+    u64 tick_ns = 1000000000ull / tick_rate;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    signal(SIGINT, server_signal);
+    signal(SIGTERM, server_signal);
+
+    for (;;) {
+        // NOTE: Matches are saved between ticks, several matches get their
+        // id appended to the path
+        if (server_quit) {
+            for (u32 i = 0; save_path && i < host->max; ++i) {
+                if (!host->matches[i].in_use)
+                    continue;
+
+                char match_path[512];
+                if (max_matches == 1)
+                    snprintf(match_path, sizeof(match_path), "%s", save_path);
+                else
+                    snprintf(match_path, sizeof(match_path), "%s.%u", save_path, i);
+                if (match_host_save(host, i, match_path))
+                    sitrep(SITREP_INFO, "Match %u saved to '%s'", i, match_path);
+            }
+            sitrep(SITREP_INFO, "Shutting down");
+            break;
+        }
+
+        if (transport == server_transport_names::UDP) {
+            comm_udp_server_poll(&udp, 0);
+            for (u32 i = 0; i < udp.accepted_used; ++i) {
+                u32 id = udp.accepted[i];
+                if (lobby->used == num_clients) {
+                    comm_udp_server_close(&udp, id);
+                    continue;
+                }
+
+                server_connection *conn = &lobby->connections[lobby->used++];
+                memory_arena buffer = {(u8 *)calloc(1, SERVER_CONNECTION_BUFFER_SIZE), SERVER_CONNECTION_BUFFER_SIZE, 0, "server_to_client_memory"};
+                comm_server_udp_init(&conn->comm, &udp, id, buffer);
+                conn->socket = NULL;
+                conn->udp_id = id;
+
+                if (lobby->used == num_clients)
+                    server_start_match(state);
+            }
+            for (u32 i = 0; i < udp.ready_used; ++i) {
+                s32 match_id = state->udp_match[udp.ready[i]];
+                if (match_id >= 0)
+                    match_host_mark_pending(host, match_id);
+            }
+        } else {
+            while (lobby->used < num_clients) {
+                s32 fd = comm_server_unix_accept(listen_fd);
+                if (fd < 0)
+                    break;
+
+                server_connection *conn = &lobby->connections[lobby->used++];
+                u32 size = SERVER_CONNECTION_BUFFER_SIZE + COMM_SERVER_UNIX_SLOT_SIZE * COMM_UNIX_BATCH_SIZE;
+                memory_arena buffer = {(u8 *)calloc(1, size), size, 0, "server_to_client_memory"};
+                conn->socket = (comm_unix_socket *)malloc(sizeof(*conn->socket));
+                comm_server_unix_init(&conn->comm, conn->socket, fd, buffer);
+
+                if (lobby->used == num_clients && !server_start_match(state))
+                    break;
+            }
+
+            // NOTE: Seqpacket sockets give no readiness here, so every
+            // match is polled each tick
+            for (u32 i = 0; i < host->max; ++i) {
+                if (host->matches[i].in_use)
+                    match_host_mark_pending(host, i);
+            }
+        }
+
+        // NOTE: A lobby that filled up while the host was full
+        if (lobby->used == num_clients)
+            server_start_match(state);
+
+        match_host_tick(host);
+
+        // NOTE: The poll reports a udp connection of a match that just ran
+        // again when it is due a PING or a retransmit, which makes the
+        // match pending again
+        for (u32 k = 0; transport == server_transport_names::UDP && k < host->num_scheduled; ++k) {
+            u32 id = host->scheduled[k];
+            for (u32 j = 0; j < num_clients; ++j) {
+                u32 when;
+                if (match_host_wake_at(host, id, j, &when))
+                    comm_udp_server_wake_at(&udp, state->match_connections[id * num_clients + j].udp_id, when);
+            }
+        }
+
+        for (u32 i = 0; i < host->max; ++i) {
+            match *m = &host->matches[i];
+            if (!m->in_use || !m->finished)
+                continue;
+
+            sitrep(SITREP_INFO, "Match %u finished after %u ticks, avg tick %.3f ms, max tick %.3f ms",
+                   i, m->stats.ticks, m->stats.total_tick_ms / MAX(m->stats.ticks, 1), m->stats.max_tick_ms);
+            for (u32 j = 0; j < num_clients; ++j) {
+                server_connection *conn = &state->match_connections[i * num_clients + j];
+                if (!conn->socket)
+                    state->udp_match[conn->udp_id] = -1;
+                server_connection_close(conn, &udp);
+            }
+            match_host_remove(host, i);
+        }
+
+        if (max_matches == 1 && state->matches_started > 0 && host->used == 0) {
+            sitrep(SITREP_INFO, "Every client disconnected, shutting down");
+            break;
+        }
+
+        u32 now = time_get_now_in_ms();
+        if (host->used > 0 && now - last_report_time >= 10000) {
+            match_host_report(host);
+            last_report_time = now;
+        }
+
+        next.tv_nsec += tick_ns;
+        while (next.tv_nsec >= 1000000000) {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+
+    job_pool_destroy(&pool);
+    comm_capture_close(&state->capture);
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        unlink(path);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -2,6 +2,9 @@
 #include <assert.h>
 #include <time.h>
 #include <stdarg.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 #define KB(x) (x * 1024L)
 #define MB(x) (KB(x) * 1024L)
@@ -10,7 +13,9 @@
 #define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
 #define MAX(X, Y) (((X) > (Y)) ? (X) : (Y))
 
+typedef uint64_t u64;
 typedef uint32_t u32;
+typedef uint16_t u16;
 typedef uint8_t u8;
 typedef int32_t s32;
 typedef uintmax_t umax;
@@ -48,7 +53,7 @@ struct v2 {
     }
 };
 
-enum terrain_names {
+enum terrain_names : u8 {
     FOG = 0,
     GRASS,
     WATER,
@@ -78,11 +83,11 @@ u32 time_get_now_in_ms();
 
 struct memory_arena {
     u8 *base;
-    u32 max, used;
+    umax max, used;
     char *name;
 };
 
-u8 *memory_arena_use(memory_arena *mem, u32 amount) {
+u8 *memory_arena_use(memory_arena *mem, umax amount) {
     u8 *rv = mem->base + mem->used;
     if (mem->used + amount > mem->max) {
         sitrep(SITREP_ERROR, "TOO MUCH MEMORY USED FOR '%s'", mem->name);
@@ -92,7 +97,7 @@ u8 *memory_arena_use(memory_arena *mem, u32 amount) {
     return rv;
 }
 
-memory_arena memory_arena_child(memory_arena *parent, u32 size, char *name) {
+memory_arena memory_arena_child(memory_arena *parent, umax size, char *name) {
     memory_arena rv;
     rv.base = parent->base + parent->used;
     if (parent->used + size > parent->max) {
@@ -154,13 +159,15 @@ struct ring_buffer {
 	void add_to_read_it(u32 amount) {
 		assert(distance() >= amount);
 		read_it += amount;
+		if (read_it > max)
+			read_it -= max;
 	}
 
     u32 distance() {
         u32 rv = 0;
         if (write_it < read_it) {
             rv += max - read_it;
-            rv += read_it - write_it;
+            rv += write_it;
         } else {
             rv += write_it - read_it;
         }
@@ -169,6 +176,57 @@ struct ring_buffer {
     }
 };
 
+u32 find_least_significant_set_bit(u32 value) {
+    assert(value);
+#ifdef _MSC_VER
+    unsigned long rv;
+    _BitScanForward(&rv, value);
+    return (u32)rv;
+#else
+    return (u32)__builtin_ctz(value);
+#endif
+}
+
+u32 find_most_significant_set_bit(u64 value) {
+    assert(value);
+#ifdef _MSC_VER
+    unsigned long rv;
+    _BitScanReverse64(&rv, value);
+    return (u32)rv;
+#else
+    return 63 - (u32)__builtin_clzll(value);
+#endif
+}
+
+struct random_series {
+    u64 state;
+};
+
+random_series random_seed(u64 seed) {
+    random_series rv;
+    // NOTE: splitmix64 scramble, so nearby seeds give unrelated series
+    u64 z = seed + 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    rv.state = z ^ (z >> 31);
+    if (rv.state == 0)
+        rv.state = 1;
+    return rv;
+}
+
+u32 random_next_u32(random_series *series) {
+    u64 x = series->state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    series->state = x;
+    return (u32)((x * 0x2545F4914F6CDD1Dull) >> 32);
+}
+
+real32 random_unilateral(random_series *series) {
+    return (real32)(random_next_u32(series) >> 8) / (real32)(1 << 24);
+}
+
 template<class T>
 struct doubly_linked_list_node {
     struct doubly_linked_list_node *prev, *next;
@@ -279,9 +337,9 @@ struct doubly_linked_list {
                 if (iter->next) {
                     iter->next->prev = iter->prev;
                 }
-                free(iter);
                 if (first == iter)
-                    first = NULL;
+                    first = iter->next;
+                free(iter);
                 break;
             }
             iter = iter->next;
@@ -432,6 +490,52 @@ struct server_input {
 
 struct server_output {
     u32 current_turn_id;
+
+    // NOTE: Time the tick spent syncing the journal
+    real32 journal_sync_ms;
+};
+
+struct job_pool;
+
+struct server_config {
+    // NOTE: Send units as acknowledged snapshot deltas instead of
+    // ADD/MOVE/REMOVE events
+    bool delta_sync;
+
+    // NOTE: Spreads per-connection receive and send work over the pool.
+    // NULL does it on the calling thread.
+    job_pool *pool;
+
+    // NOTE: Packets read from each connection per tick, 0 picks the default
+    u32 max_packets_per_tick;
+
+    // NOTE: Size of the generated map in tiles, 0 picks the default
+    u32 map_width, map_height;
+
+    // NOTE: The same seed and size always generate the same map
+    u64 map_seed;
+
+    // NOTE: Directory of generated maps to reuse, NULL always generates
+    char *map_cache_dir;
+
+    // NOTE: Where to journal the match's commands, NULL keeps none.
+    // Keyframes go every keyframe_turns turns, 0 picks the default.
+    char *journal_path;
+    u32 keyframe_turns;
+
+    // NOTE: fdatasync the journal every tick before anything is sent, so
+    // it can recover the match after a crash
+    bool journal_sync;
+
+    // NOTE: Write keyframes from a forked child instead of the tick
+    bool fork_keyframes;
+
+    // NOTE: How far towns and units see, indexed by unit_names with NONE
+    // for towns. 0 picks the default.
+    u32 sight_radius[3];
+
+    // NOTE: Time the stages and handlers of every tick into histograms
+    bool profile;
 };
 
 struct entity {
@@ -439,11 +543,23 @@ struct entity {
     v2<u32> position;
     s32 owner;
     u32 server_id;
+
+    // NOTE: Server only, the neighbours in the index of the owner's
+    // entities of the same type
+    entity *owned_prev, *owned_next;
+
+    // NOTE: Server only, the neighbours among the units standing in the
+    // same chunk, towns never move and have chunk_towns instead
+    entity *chunk_prev, *chunk_next;
 };
 
+struct timer_event;
+
 struct structure : public entity {
     unit_names construction;
-    u32 construction_timer;
+
+    // NOTE: Server only, when the unit under construction is done
+    timer_event *construction_event;
 };
 
 struct unit : public entity {